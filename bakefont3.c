@@ -27,6 +27,11 @@
 #include "bakefont3.h"
 #include <string.h> // memcpy
 
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(BF3_NO_SIMD)
+#   define BF3_SSE2
+#   include <emmintrin.h>
+#endif
+
 
 // NOTE - this implementation works for LITTLE ENDIAN HOSTS only
 // (its quite trivial to fix but I don't have anything to test on)
@@ -37,32 +42,22 @@
 // Used to "round up" to the next integer, unless its "almost exact".
 int BF3_DECODE_FP26_CEIL_impl(bf3_fp26 x, bf3_fp26 tolerance)
 {
-    // TODO (PERF) this could be clever enough to operate on the integers
-    
-    float fx = BF3_DECODE_FP26(x);
-    float ftolerance = BF3_DECODE_FP26(tolerance);
-    ftolerance = copysignf(ftolerance, fx);
-    
-    float sgn_ceil = copysignf(0.5f, fx); // round towards +/-ve infinity
-    
-    float result = (fx - ftolerance + sgn_ceil);
-    return (int) lround(result);
+    if (tolerance < 0) { tolerance = -tolerance; }
+
+    // round to nearest, after moving half a pixel away from zero, less the
+    // tolerance (the same as with floats, but exact)
+    return (x >= 0) ? BF3_DECODE_FP26_NEAREST(x - tolerance + 32)
+                    : BF3_DECODE_FP26_NEAREST(x + tolerance - 32);
 }
 
 
 // As above, but rounds towards zero
 int BF3_DECODE_FP26_FLOOR_impl(bf3_fp26 x, bf3_fp26 tolerance)
 {
-    // TODO (PERF) this could be clever enough to operate on the integers
-    
-    float fx = BF3_DECODE_FP26(x);
-    float ftolerance = BF3_DECODE_FP26(tolerance);
-    ftolerance = copysignf(ftolerance, fx);
+    if (tolerance < 0) { tolerance = -tolerance; }
 
-    float sgn_floor = copysignf(0.5f, fx); // round towards +/-ve infinity
-    
-    float result = (fx + ftolerance - sgn_floor);
-    return (int) lround(result);
+    return (x >= 0) ? BF3_DECODE_FP26_NEAREST(x + tolerance - 32)
+                    : BF3_DECODE_FP26_NEAREST(x - tolerance + 32);
 }
 
 
@@ -98,9 +93,10 @@ bool bf3_header_load(bf3_info *info, char *hdr, bf3_filelike *filelike, size_t h
     // uint16(height)   # 14 |  2 | texture atlas height
     // uint16(depth)    # 16 |  2 | texture atlas depth (1, 3, 4)
     // uint16(bytesize) # 18 |  2 | ...
-    // b'\0\0\0\0'      # 20 |  4 | padding (realign to 8 bytes)
+    // uint8(bits)      # 20 |  1 | bits per glyph layer (0 means 8)
+    // b'\0\0\0'        # 21 |  3 | padding (realign to 8 bytes)
 
-    int w, h, d, num_fonts, num_modes, num_tables;
+    int w, h, d, bits, num_fonts, num_modes, num_tables;
 
     size_t was_read = filelike->read(hdr, filelike, 0, header_size);
     if (was_read < header_size) { goto fail; }
@@ -109,6 +105,10 @@ bool bf3_header_load(bf3_info *info, char *hdr, bf3_filelike *filelike, size_t h
     memcpy(v, hdr + 12, 6);
     w = v[0]; h = v[1]; d = v[2];
     
+    bits = (unsigned char) hdr[20];
+    if (!bits) { bits = 8; }
+    if ((bits != 8) && (bits != 4) && (bits != 1)) { goto fail; }
+    
     // FONT TABLE HEADER - 6 bytes
     // b"FONT"                   # 24 | 4 | debugging marker
     // uint16(len(result.fonts)) # 28 | 2 | number of fonts
@@ -145,7 +145,7 @@ bool bf3_header_load(bf3_info *info, char *hdr, bf3_filelike *filelike, size_t h
     num_tables = v[0];
     
     
-    bf3_info _info = {w, h, d, num_fonts, num_modes, num_tables};
+    bf3_info _info = {w, h, d, num_fonts, num_modes, num_tables, bits};
     memcpy(info, &_info, sizeof(bf3_info));
     return true;
     
@@ -179,8 +179,9 @@ void bf3_mode_get(bf3_mode *mode, char *buf, int index)
     
     
     // o +0 |  2 | font ID
-    // o +2 |  1 | flag: 'A' if the font is antialiased, otherwise 'a'
-    // o +3 |  1 | RESERVED
+    // o +2 |  1 | flag: 'A' if the font is antialiased, otherwise 'a',
+    //             or 'S' for a signed distance field
+    // o +3 |  1 | SDF spread in pixels (or 0 if not a SDF)
     // o +4 |  4 | font size - fixed point 26.6
     //            (divide the signed int32 by 64 to get original float)
     // o +8 |  4 | lineheight aka linespacing - (fixed point 26.6)
@@ -191,7 +192,9 @@ void bf3_mode_get(bf3_mode *mode, char *buf, int index)
     uint16_t font_id;
     memcpy(&font_id, buf + offset + 0, 2);
     
-    char antialias = *(buf + offset + 2) == 'A';
+    char sdf = *(buf + offset + 2) == 'S';
+    char antialias = sdf || (*(buf + offset + 2) == 'A');
+    uint8_t spread = sdf ? (uint8_t) *(buf + offset + 3) : 0;
     
     uint32_t pts[4];
     memcpy(pts, buf + offset + 4, 16);
@@ -201,7 +204,7 @@ void bf3_mode_get(bf3_mode *mode, char *buf, int index)
     bf3_fp26 underline_position  = { pts[2] };
     bf3_fp26 underline_thickness = { pts[3] };
     
-    bf3_mode _mode = {index, font_id, antialias,
+    bf3_mode _mode = {index, font_id, antialias, sdf, spread,
         size, lineheight, underline_position, underline_thickness};
     
     memcpy(mode, &_mode, sizeof(bf3_mode));
@@ -389,3 +392,1247 @@ bool bf3_kpair_get(bf3_kpair *kpair, const char *kerning,
     
 #   undef RECORD
 }
+
+
+int bf3_coverage(const bf3_info *info, const unsigned char *texel, int tex_z)
+{
+    int bits = info->bits;
+    if (bits == 8) { return texel[tex_z]; }
+    
+    int levels = (1 << bits) - 1;
+    int value = texel[BF3_TEX_CHANNEL(info, tex_z)];
+    value = (value >> (BF3_TEX_LAYER(info, tex_z) * bits)) & levels;
+    
+    return (value * 255) / levels;
+}
+
+
+// ----------------------------------------------------------------------------
+// Layout
+
+
+static inline uint32_t bf3_read_u32(const char *buf)
+{
+    uint32_t value;
+    memcpy(&value, buf, 4);
+    return value;
+}
+
+
+// A FP26 position rounded to the nearest whole pixel, halves upwards, so that
+// moving the pen by a whole pixel always moves the quad by a whole pixel.
+// (floor(x / 64), without shifting a negative number)
+static inline int32_t bf3_fp26_pixel(bf3_fp26 x)
+{
+    x += 32;
+    return (x >= 0) ? (x >> 6) : ~((~x) >> 6);
+}
+
+
+// The index of the last metric record with a codepoint <= `codepoint`
+// (or 0), by a binary search without branches in the loop
+static inline uint32_t bf3_metric_bound(const char *records, uint32_t nmemb, uint32_t codepoint)
+{
+    uint32_t base = 0;
+
+    while (nmemb > 1)
+    {
+        uint32_t half = nmemb / 2;
+        base = (bf3_read_u32(records + (40 * (base + half))) <= codepoint) ? base + half : base;
+        nmemb -= half;
+    }
+
+    return base;
+}
+
+
+// The metric record for a codepoint, or NULL
+static inline const char *bf3_layout_metric(const bf3_layout *layout, uint32_t codepoint)
+{
+    const char *records = layout->metrics + 4;
+
+    uint32_t dense = codepoint - layout->dense_first;
+    if (dense < layout->dense_count)
+        { return records + (40 * (layout->dense_index + dense)); }
+
+    if (!layout->num_metrics) { return NULL; }
+
+    uint32_t index = bf3_metric_bound(records, layout->num_metrics, codepoint);
+    const char *record = records + (40 * index);
+    return (bf3_read_u32(record) == codepoint) ? record : NULL;
+}
+
+
+// The grid-fitted kerning for a pair of codepoints, in FP26
+static inline int32_t bf3_layout_kern(const bf3_layout *layout, uint32_t left, uint32_t right)
+{
+    const char *records = layout->kerning + 4;
+    uint64_t key = ((uint64_t) left << 32) | right;
+
+    uint32_t base = 0;
+    uint32_t nmemb = layout->num_kerning;
+
+    while (nmemb > 1)
+    {
+        uint32_t half = nmemb / 2;
+        const char *record = records + (16 * (base + half));
+        uint64_t current = ((uint64_t) bf3_read_u32(record) << 32) | bf3_read_u32(record + 4);
+        base = (current <= key) ? base + half : base;
+        nmemb -= half;
+    }
+
+    const char *record = records + (16 * base);
+    if ((bf3_read_u32(record) != left) || (bf3_read_u32(record + 4) != right)) { return 0; }
+
+    return (bf3_fp26) bf3_read_u32(record + 8);
+}
+
+
+void bf3_layout_init(bf3_layout *layout, const bf3_mode *mode,
+    const char *metrics, const char *kerning, int32_t x, int32_t y)
+{
+    memset(layout, 0, sizeof(bf3_layout));
+
+    layout->origin_x = x * 64;
+    layout->pen_x = x * 64;
+    layout->pen_y = y * 64;
+    layout->lineheight = mode->lineheight;
+
+    layout->metrics = metrics;
+    layout->kerning = kerning;
+    layout->num_metrics = bf3_read_u32(metrics);
+    layout->num_kerning = kerning ? bf3_read_u32(kerning) : 0;
+
+    // Find the longest run of consecutive codepoints starting at the first
+    // printable one, so that e.g. ASCII text needs no binary search. The
+    // records are sorted and unique, so record (start + n) continues the
+    // run only if every record before it does, and it can be bisected.
+    const char *records = metrics + 4;
+    uint32_t nmemb = layout->num_metrics;
+    if (!nmemb) { return; }
+
+    uint32_t start = bf3_metric_bound(records, nmemb, ' ');
+    uint32_t first = bf3_read_u32(records + (40 * start));
+    if (first < ' ')
+    {
+        if (start + 1 >= nmemb) { return; }
+        first = bf3_read_u32(records + (40 * ++start));
+    }
+
+    uint32_t lo = 0, hi = nmemb - start - 1; // the run is at least 1 long
+    while (lo < hi)
+    {
+        uint32_t mid = lo + ((hi - lo + 1) / 2);
+        if (bf3_read_u32(records + (40 * (start + mid))) - first == mid) { lo = mid; }
+        else { hi = mid - 1; }
+    }
+
+    layout->dense_first = first;
+    layout->dense_index = start;
+    layout->dense_count = lo + 1;
+}
+
+
+// Lay out one codepoint, writing a quad if it has an image.
+// Returns 1 if a quad was written, otherwise 0.
+static inline size_t bf3_layout_codepoint(bf3_layout *layout, uint32_t codepoint, bf3_quad *quad)
+{
+    if (codepoint == '\n')
+    {
+        layout->pen_x = layout->origin_x;
+        layout->pen_y += layout->lineheight;
+        layout->previous = 0;
+        return 0;
+    }
+
+    const char *record = bf3_layout_metric(layout, codepoint);
+    if (!record) { layout->previous = 0; return 0; }
+
+    bf3_fp26 x = layout->pen_x;
+    if (layout->previous && layout->num_kerning)
+        { x += bf3_layout_kern(layout, layout->previous, codepoint); }
+
+    // see the GSET record layout in bf3_metric
+    bf3_fp26 hadvance = (bf3_fp26) bf3_read_u32(record + 24);
+    layout->pen_x = x + hadvance;
+    layout->previous = codepoint;
+
+    if (!record[11]) { return 0; } // no image, e.g. space
+
+    // the bitmap offset is in whole pixels from a whole-pixel pen position
+    int16_t bitmap[2]; // left, top
+    memcpy(bitmap, record + 12, 4);
+
+    quad->x = bf3_fp26_pixel(x) + bitmap[0];
+    quad->y = bf3_fp26_pixel(layout->pen_y) - bitmap[1];
+    memcpy(&quad->tex_x, record + 4, 4); // tex_x, tex_y
+    quad->tex_w = (uint8_t) record[9];
+    quad->tex_h = (uint8_t) record[10];
+    quad->tex_z = (uint8_t) record[8];
+    quad->reserved = 0;
+
+    return 1;
+}
+
+
+// Decode one UTF-8 sequence that doesn't start with an ASCII byte, with the
+// same rules as lib/utf8.c. Returns the number of bytes used, or 0 if the
+// text ends partway through the sequence. Invalid bytes decode one at a
+// time as U+FFFD.
+static inline size_t bf3_utf8_decode(const unsigned char *p, const unsigned char *end,
+    uint32_t *codepoint)
+{
+    unsigned int c = p[0];
+    uint32_t result, minimum;
+    size_t length;
+
+    if      ((c & 0xE0) == 0xC0) { length = 2; result = c & 0x1F; minimum = 0x80; }
+    else if ((c & 0xF0) == 0xE0) { length = 3; result = c & 0x0F; minimum = 0x800; }
+    else if ((c & 0xF8) == 0xF0) { length = 4; result = c & 0x07; minimum = 0x10000; }
+    else { goto invalid; } // a continuation byte, or 11111xxx
+
+    for (size_t i = 1; i < length; i++)
+    {
+        if (p + i >= end) { return 0; }
+        if ((p[i] & 0xC0) != 0x80) { goto invalid; }
+        result = (result << 6) | (p[i] & 0x3F);
+    }
+
+    // reject overlong sequences, surrogates, and anything past U+10FFFF
+    if ((result < minimum) || (result > 0x10FFFF)) { goto invalid; }
+    if ((result >= 0xD800) && (result <= 0xDFFF)) { goto invalid; }
+
+    *codepoint = result;
+    return length;
+
+    invalid:
+        *codepoint = 0xFFFD;
+        return 1;
+}
+
+
+size_t bf3_layout_utf8(bf3_layout *layout, bf3_quad *quads, size_t max_quads,
+    const char *text, size_t len, size_t *consumed)
+{
+    const unsigned char *p = (const unsigned char *) text;
+    const unsigned char *end = p + len;
+    size_t count = 0;
+
+    while ((p < end) && (count < max_quads))
+    {
+        uint32_t codepoint = *p;
+        size_t length = 1;
+
+        if (codepoint >= 0x80)
+        {
+            length = bf3_utf8_decode(p, end, &codepoint);
+            if (!length) { break; }
+        }
+
+        p += length;
+        count += bf3_layout_codepoint(layout, codepoint, quads + count);
+    }
+
+    if (consumed) { *consumed = (size_t) (p - (const unsigned char *) text); }
+    return count;
+}
+
+
+size_t bf3_layout_utf32(bf3_layout *layout, bf3_quad *quads, size_t max_quads,
+    const uint32_t *text, size_t len, size_t *consumed)
+{
+    size_t i = 0;
+    size_t count = 0;
+
+    for (; (i < len) && (count < max_quads); i++)
+        { count += bf3_layout_codepoint(layout, text[i], quads + count); }
+
+    if (consumed) { *consumed = i; }
+    return count;
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Vertex data
+
+void bf3_emitter_init(bf3_emitter *emitter, const bf3_info *info)
+{
+    memset(emitter, 0, sizeof(bf3_emitter));
+
+    emitter->inv_width = 1.0f / (float) info->width;
+    emitter->inv_height = 1.0f / (float) info->height;
+    emitter->channel_shift = (info->bits == 1) ? 3 : (info->bits == 4) ? 1 : 0;
+
+    memset(emitter->color_top, 255, 4);
+    memset(emitter->color_bottom, 255, 4);
+}
+
+
+// The mask for a glyph in layer `tex_z`: 255 in the byte for its channel
+static inline uint32_t bf3_emit_mask(const bf3_emitter *emitter, uint8_t tex_z)
+{
+    uint32_t channel = (uint32_t) tex_z >> emitter->channel_shift;
+    return (channel < 4) ? (UINT32_C(0xFF) << (8 * channel)) : 0;
+}
+
+
+// The corners of each quad are numbered 0: top left, 1: bottom left,
+// 2: bottom right, 3: top right. Triangles use them in this order.
+static const uint8_t bf3_emit_order[6] = {0, 1, 2, 0, 2, 3};
+
+
+// Write the vertices for one quad, where corners[n] is the (x, y, u, v) of
+// corner n: 6 corners for triangles, or the 4 corners in order
+static inline void bf3_emit_quad(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const float corners[4][4], uint32_t mask, size_t per_quad)
+{
+    for (size_t i = 0; i < per_quad; i++)
+    {
+        uint8_t corner = (per_quad == 6) ? bf3_emit_order[i] : (uint8_t) i;
+        const uint8_t *color = ((corner == 0) || (corner == 3)) ?
+            emitter->color_top : emitter->color_bottom;
+
+        memcpy(&vertices[i].x, corners[corner], 16);
+        memcpy(vertices[i].mask, &mask, 4);
+        memcpy(vertices[i].color, color, 4);
+    }
+}
+
+
+#ifdef BF3_SSE2
+
+// Convert four quads at once. Each of the results holds one value for each
+// of the four quads: x0, y0, x1, y1, u0, v0, u1, v1. Converting the integers
+// to floats and multiplying by the reciprocal gives exactly the same result
+// as the scalar code.
+static inline void bf3_emit_convert4(const bf3_emitter *emitter, __m128 result[8],
+    const bf3_quad *quads)
+{
+    // transpose four 16 byte quads into x, y, (tex_x, tex_y), (w, h, z, 0)
+    __m128 r0 = _mm_loadu_ps((const float *) (quads + 0));
+    __m128 r1 = _mm_loadu_ps((const float *) (quads + 1));
+    __m128 r2 = _mm_loadu_ps((const float *) (quads + 2));
+    __m128 r3 = _mm_loadu_ps((const float *) (quads + 3));
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+    __m128i x = _mm_castps_si128(r0);
+    __m128i y = _mm_castps_si128(r1);
+    __m128i tex_xy = _mm_castps_si128(r2);
+    __m128i tex_whz = _mm_castps_si128(r3);
+
+    __m128i mask16 = _mm_set1_epi32(0xFFFF);
+    __m128i mask8 = _mm_set1_epi32(0xFF);
+    __m128i tex_x = _mm_and_si128(tex_xy, mask16);
+    __m128i tex_y = _mm_srli_epi32(tex_xy, 16);
+    __m128i tex_w = _mm_and_si128(tex_whz, mask8);
+    __m128i tex_h = _mm_and_si128(_mm_srli_epi32(tex_whz, 8), mask8);
+
+    __m128 inv_width = _mm_set1_ps(emitter->inv_width);
+    __m128 inv_height = _mm_set1_ps(emitter->inv_height);
+
+    result[0] = _mm_cvtepi32_ps(x);
+    result[1] = _mm_cvtepi32_ps(y);
+    result[2] = _mm_cvtepi32_ps(_mm_add_epi32(x, tex_w));
+    result[3] = _mm_cvtepi32_ps(_mm_add_epi32(y, tex_h));
+    result[4] = _mm_mul_ps(_mm_cvtepi32_ps(tex_x), inv_width);
+    result[5] = _mm_mul_ps(_mm_cvtepi32_ps(tex_y), inv_height);
+    result[6] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(tex_x, tex_w)), inv_width);
+    result[7] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(tex_y, tex_h)), inv_height);
+}
+
+
+// Write the vertices for four quads
+static inline void bf3_emit_vertices4(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quads, size_t per_quad)
+{
+    __m128 c[8];
+    bf3_emit_convert4(emitter, c, quads);
+
+    // transpose into (x, y, u, v) for each corner of each quad
+    __m128 tl[4] = {c[0], c[1], c[4], c[5]};
+    __m128 bl[4] = {c[0], c[3], c[4], c[7]};
+    __m128 br[4] = {c[2], c[3], c[6], c[7]};
+    __m128 tr[4] = {c[2], c[1], c[6], c[5]};
+    _MM_TRANSPOSE4_PS(tl[0], tl[1], tl[2], tl[3]);
+    _MM_TRANSPOSE4_PS(bl[0], bl[1], bl[2], bl[3]);
+    _MM_TRANSPOSE4_PS(br[0], br[1], br[2], br[3]);
+    _MM_TRANSPOSE4_PS(tr[0], tr[1], tr[2], tr[3]);
+
+    // the mask and colour of each vertex, 8 bytes at a time
+    uint32_t color_top, color_bottom;
+    memcpy(&color_top, emitter->color_top, 4);
+    memcpy(&color_bottom, emitter->color_bottom, 4);
+
+    for (size_t n = 0; n < 4; n++)
+    {
+        uint32_t mask = bf3_emit_mask(emitter, quads[n].tex_z);
+        __m128i top = _mm_set_epi32(0, 0, (int) color_top, (int) mask);
+        __m128i bottom = _mm_set_epi32(0, 0, (int) color_bottom, (int) mask);
+
+        // top left, bottom left, bottom right, (for triangles, top left and
+        // bottom right again), top right
+        bf3_vertex *vertex = vertices + (per_quad * n);
+        _mm_storeu_ps(&vertex[0].x, tl[n]);
+        _mm_storel_epi64((__m128i *) vertex[0].mask, top);
+        _mm_storeu_ps(&vertex[1].x, bl[n]);
+        _mm_storel_epi64((__m128i *) vertex[1].mask, bottom);
+        _mm_storeu_ps(&vertex[2].x, br[n]);
+        _mm_storel_epi64((__m128i *) vertex[2].mask, bottom);
+
+        if (per_quad == 6)
+        {
+            _mm_storeu_ps(&vertex[3].x, tl[n]);
+            _mm_storel_epi64((__m128i *) vertex[3].mask, top);
+            _mm_storeu_ps(&vertex[4].x, br[n]);
+            _mm_storel_epi64((__m128i *) vertex[4].mask, bottom);
+            vertex += 2;
+        }
+
+        _mm_storeu_ps(&vertex[3].x, tr[n]);
+        _mm_storel_epi64((__m128i *) vertex[3].mask, top);
+    }
+}
+
+#endif // BF3_SSE2
+
+
+// Write the vertices for one quad, without SIMD
+static inline void bf3_emit_vertices1(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quad, size_t per_quad)
+{
+    float x0 = (float) quad->x;
+    float y0 = (float) quad->y;
+    float x1 = (float) (quad->x + quad->tex_w);
+    float y1 = (float) (quad->y + quad->tex_h);
+    float u0 = (float) quad->tex_x * emitter->inv_width;
+    float v0 = (float) quad->tex_y * emitter->inv_height;
+    float u1 = (float) (quad->tex_x + quad->tex_w) * emitter->inv_width;
+    float v1 = (float) (quad->tex_y + quad->tex_h) * emitter->inv_height;
+
+    const float corners[4][4] =
+    {
+        {x0, y0, u0, v0},
+        {x0, y1, u0, v1},
+        {x1, y1, u1, v1},
+        {x1, y0, u1, v0},
+    };
+
+    uint32_t mask = bf3_emit_mask(emitter, quad->tex_z);
+    bf3_emit_quad(emitter, vertices, corners, mask, per_quad);
+}
+
+
+static inline size_t bf3_emit_vertices(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quads, size_t num_quads, size_t per_quad)
+{
+    size_t i = 0;
+
+#   ifdef BF3_SSE2
+    for (; i + 4 <= num_quads; i += 4)
+        { bf3_emit_vertices4(emitter, vertices + (per_quad * i), quads + i, per_quad); }
+#   endif
+
+    for (; i < num_quads; i++)
+        { bf3_emit_vertices1(emitter, vertices + (per_quad * i), quads + i, per_quad); }
+
+    return per_quad * num_quads;
+}
+
+
+size_t bf3_emit_triangles(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quads, size_t num_quads)
+{
+    return bf3_emit_vertices(emitter, vertices, quads, num_quads, 6);
+}
+
+
+size_t bf3_emit_quads(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quads, size_t num_quads)
+{
+    return bf3_emit_vertices(emitter, vertices, quads, num_quads, 4);
+}
+
+
+size_t bf3_emit_indices(uint32_t *indices, size_t first_quad, size_t num_quads)
+{
+    for (size_t i = 0; i < num_quads; i++)
+    {
+        uint32_t base = (uint32_t) (4 * (first_quad + i));
+        for (size_t j = 0; j < 6; j++)
+            { indices[(6 * i) + j] = base + bf3_emit_order[j]; }
+    }
+
+    return 6 * num_quads;
+}
+
+
+size_t bf3_emit_instances(const bf3_emitter *emitter, bf3_instance *instances,
+    const bf3_quad *quads, size_t num_quads)
+{
+    size_t i = 0;
+
+#   ifdef BF3_SSE2
+    for (; i + 4 <= num_quads; i += 4)
+    {
+        __m128 c[8];
+        bf3_emit_convert4(emitter, c, quads + i);
+        _MM_TRANSPOSE4_PS(c[0], c[1], c[2], c[3]);
+        _MM_TRANSPOSE4_PS(c[4], c[5], c[6], c[7]);
+
+        for (size_t n = 0; n < 4; n++)
+        {
+            bf3_instance *instance = instances + i + n;
+            uint32_t mask = bf3_emit_mask(emitter, quads[i + n].tex_z);
+
+            _mm_storeu_ps(&instance->x0, c[n]);
+            _mm_storeu_ps(&instance->u0, c[4 + n]);
+            memcpy(instance->mask, &mask, 4);
+            memcpy(instance->color_top, emitter->color_top, 4);
+            memcpy(instance->color_bottom, emitter->color_bottom, 4);
+        }
+    }
+#   endif
+
+    for (; i < num_quads; i++)
+    {
+        const bf3_quad *quad = quads + i;
+        bf3_instance *instance = instances + i;
+        uint32_t mask = bf3_emit_mask(emitter, quad->tex_z);
+
+        instance->x0 = (float) quad->x;
+        instance->y0 = (float) quad->y;
+        instance->x1 = (float) (quad->x + quad->tex_w);
+        instance->y1 = (float) (quad->y + quad->tex_h);
+        instance->u0 = (float) quad->tex_x * emitter->inv_width;
+        instance->v0 = (float) quad->tex_y * emitter->inv_height;
+        instance->u1 = (float) (quad->tex_x + quad->tex_w) * emitter->inv_width;
+        instance->v1 = (float) (quad->tex_y + quad->tex_h) * emitter->inv_height;
+        memcpy(instance->mask, &mask, 4);
+        memcpy(instance->color_top, emitter->color_top, 4);
+        memcpy(instance->color_bottom, emitter->color_bottom, 4);
+    }
+
+    return num_quads;
+}
+
+
+// A pixel position clamped to the range of an int16_t
+static inline int16_t bf3_emit_clamp16(int32_t x)
+{
+    return (int16_t) ((x < INT16_MIN) ? INT16_MIN : (x > INT16_MAX) ? INT16_MAX : x);
+}
+
+
+size_t bf3_emit_instances16(const bf3_emitter *emitter, bf3_instance16 *instances,
+    const bf3_quad *quads, size_t num_quads)
+{
+    uint8_t layer_mask = (uint8_t) ((1 << emitter->channel_shift) - 1);
+
+    for (size_t i = 0; i < num_quads; i++)
+    {
+        const bf3_quad *quad = quads + i;
+        bf3_instance16 *instance = instances + i;
+
+        instance->x = bf3_emit_clamp16(quad->x);
+        instance->y = bf3_emit_clamp16(quad->y);
+        instance->tex_x = quad->tex_x;
+        instance->tex_y = quad->tex_y;
+        instance->tex_w = quad->tex_w;
+        instance->tex_h = quad->tex_h;
+        instance->channel = (uint8_t) (quad->tex_z >> emitter->channel_shift);
+        instance->layer = quad->tex_z & layer_mask;
+        memcpy(instance->color, emitter->color_top, 4);
+    }
+
+    return num_quads;
+}
+
+
+// How many quads bf3_layout_emit_utf8 lays out before emitting them: few
+// enough (1KB) to stay in the L1 cache, enough to keep the emitter busy
+#define BF3_EMIT_WINDOW 64
+
+// Lay out UTF-8 a window of quads at a time, and emit each window while it
+// is still in the cache, as triangles if `triangles`, otherwise instances
+static size_t bf3_layout_emit_utf8(bf3_layout *layout, const bf3_emitter *emitter,
+    void *dest, bool triangles, size_t max_quads, const char *text, size_t len,
+    size_t *consumed)
+{
+    bf3_quad window[BF3_EMIT_WINDOW];
+    size_t count = 0;
+    size_t offset = 0;
+
+    while ((count < max_quads) && (offset < len))
+    {
+        size_t room = max_quads - count;
+        if (room > BF3_EMIT_WINDOW) { room = BF3_EMIT_WINDOW; }
+
+        size_t used;
+        size_t n = bf3_layout_utf8(layout, window, room, text + offset, len - offset, &used);
+        offset += used;
+
+        if (triangles)
+            { bf3_emit_triangles(emitter, (bf3_vertex *) dest + (6 * count), window, n); }
+        else
+            { bf3_emit_instances(emitter, (bf3_instance *) dest + count, window, n); }
+
+        count += n;
+
+        // the window wasn't filled, so the text ended (or ends partway
+        // through a UTF-8 sequence)
+        if (n < room) { break; }
+    }
+
+    if (consumed) { *consumed = offset; }
+    return count;
+}
+
+
+size_t bf3_layout_triangles_utf8(bf3_layout *layout, const bf3_emitter *emitter,
+    bf3_vertex *vertices, size_t max_quads, const char *text, size_t len, size_t *consumed)
+{
+    return bf3_layout_emit_utf8(layout, emitter, vertices, true, max_quads, text, len, consumed);
+}
+
+
+size_t bf3_layout_instances_utf8(bf3_layout *layout, const bf3_emitter *emitter,
+    bf3_instance *instances, size_t max_quads, const char *text, size_t len, size_t *consumed)
+{
+    return bf3_layout_emit_utf8(layout, emitter, instances, false, max_quads, text, len, consumed);
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Text blocks
+
+void bf3_text_init(bf3_text *text, uint32_t *codepoints, bf3_quad *quads,
+    bf3_vertex *vertices, size_t capacity)
+{
+    memset(text, 0, sizeof(bf3_text));
+
+    text->codepoints = codepoints;
+    text->quads = quads;
+    text->vertices = vertices;
+    text->capacity = capacity;
+
+    memset(text->emitter.color_top, 255, 4);
+    memset(text->emitter.color_bottom, 255, 4);
+}
+
+
+// field by field, as padding and the unused bits of a bitfield may differ
+static bool bf3_mode_equal(const bf3_mode *a, const bf3_mode *b)
+{
+    return (a->mode_id == b->mode_id)
+        && (a->font_id == b->font_id)
+        && (a->antialias == b->antialias)
+        && (a->sdf == b->sdf)
+        && (a->spread == b->spread)
+        && (a->size == b->size)
+        && (a->lineheight == b->lineheight)
+        && (a->underline_position == b->underline_position)
+        && (a->underline_thickness == b->underline_thickness);
+}
+
+
+void bf3_text_set_table(bf3_text *text, const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning)
+{
+    bf3_emitter emitter;
+    bf3_emitter_init(&emitter, info);
+    memcpy(emitter.color_top, text->emitter.color_top, 4);
+    memcpy(emitter.color_bottom, text->emitter.color_bottom, 4);
+
+    // (the colours are the same, as they were just copied)
+    if ((text->metrics == metrics) && (text->kerning == kerning)
+        && bf3_mode_equal(&text->mode, mode)
+        && (text->emitter.inv_width == emitter.inv_width)
+        && (text->emitter.inv_height == emitter.inv_height)
+        && (text->emitter.channel_shift == emitter.channel_shift))
+        { return; }
+
+    text->mode = *mode;
+    text->metrics = metrics;
+    text->kerning = kerning;
+    text->emitter = emitter;
+    text->dirty |= BF3_TEXT_DIRTY_LAYOUT | BF3_TEXT_DIRTY_VERTICES;
+}
+
+
+bool bf3_text_set_utf8(bf3_text *text, const char *utf8, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) utf8;
+    const unsigned char *end = p + len;
+    bool changed = false;
+    size_t count = 0;
+
+    // write over the old codepoints, noting any differences
+    for (; (p < end) && (count < text->capacity); count++)
+    {
+        uint32_t codepoint = *p;
+        size_t length = 1;
+
+        if (codepoint >= 0x80)
+        {
+            length = bf3_utf8_decode(p, end, &codepoint);
+            if (!length) { codepoint = 0xFFFD; length = 1; } // cut short
+        }
+
+        p += length;
+        changed |= (count >= text->num_codepoints) || (text->codepoints[count] != codepoint);
+        text->codepoints[count] = codepoint;
+    }
+
+    if (changed || (count != text->num_codepoints))
+    {
+        text->num_codepoints = count;
+        text->dirty |= BF3_TEXT_DIRTY_LAYOUT | BF3_TEXT_DIRTY_VERTICES;
+    }
+
+    return (p == end);
+}
+
+
+bool bf3_text_set_utf32(bf3_text *text, const uint32_t *utf32, size_t len)
+{
+    size_t count = (len < text->capacity) ? len : text->capacity;
+
+    if ((count != text->num_codepoints)
+        || (0 != memcmp(text->codepoints, utf32, count * sizeof(uint32_t))))
+    {
+        memcpy(text->codepoints, utf32, count * sizeof(uint32_t));
+        text->num_codepoints = count;
+        text->dirty |= BF3_TEXT_DIRTY_LAYOUT | BF3_TEXT_DIRTY_VERTICES;
+    }
+
+    return (count == len);
+}
+
+
+void bf3_text_set_origin(bf3_text *text, int32_t x, int32_t y)
+{
+    if ((x == text->x) && (y == text->y)) { return; }
+
+    // the layout is rounded to pixels from a whole pixel origin, so moving
+    // the origin by whole pixels moves every quad by the same amount
+    if (!(text->dirty & BF3_TEXT_DIRTY_LAYOUT))
+    {
+        for (size_t i = 0; i < text->num_quads; i++)
+        {
+            text->quads[i].x += x - text->x;
+            text->quads[i].y += y - text->y;
+        }
+    }
+
+    text->x = x;
+    text->y = y;
+    text->dirty |= BF3_TEXT_DIRTY_VERTICES;
+}
+
+
+void bf3_text_set_color(bf3_text *text, const uint8_t top[4], const uint8_t bottom[4])
+{
+    if ((0 == memcmp(text->emitter.color_top, top, 4))
+        && (0 == memcmp(text->emitter.color_bottom, bottom, 4)))
+        { return; }
+
+    memcpy(text->emitter.color_top, top, 4);
+    memcpy(text->emitter.color_bottom, bottom, 4);
+    text->dirty |= BF3_TEXT_DIRTY_VERTICES;
+}
+
+
+bool bf3_text_update(bf3_text *text)
+{
+    if (!text->dirty) { return false; }
+
+    if ((text->dirty & BF3_TEXT_DIRTY_LAYOUT) && text->metrics)
+    {
+        // the first baseline is a line below the top, in FP26
+        bf3_layout layout;
+        bf3_layout_init(&layout, &text->mode, text->metrics, text->kerning, text->x, text->y);
+        layout.pen_y += text->mode.lineheight;
+
+        text->num_quads = bf3_layout_utf32(&layout, text->quads, text->capacity,
+            text->codepoints, text->num_codepoints, NULL);
+        text->relayouts++;
+    }
+
+    if (!text->metrics) { text->num_quads = 0; }
+
+    text->num_vertices = bf3_emit_triangles(&text->emitter, text->vertices,
+        text->quads, text->num_quads);
+    text->updates++;
+    text->dirty = 0;
+
+    return true;
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Edited text
+
+void bf3_lines_init(bf3_lines *lines, uint32_t *codepoints, bf3_quad *quads,
+    bf3_vertex *vertices, size_t capacity, bf3_line *line_storage, size_t max_lines)
+{
+    memset(lines, 0, sizeof(bf3_lines));
+
+    lines->codepoints = codepoints;
+    lines->quads = quads;
+    lines->vertices = vertices;
+    lines->capacity = capacity;
+    lines->lines = line_storage;
+    lines->max_lines = max_lines;
+
+    memset(lines->emitter.color_top, 255, 4);
+    memset(lines->emitter.color_bottom, 255, 4);
+
+    // one empty line
+    if (max_lines)
+    {
+        memset(line_storage, 0, sizeof(bf3_line));
+        lines->num_lines = 1;
+    }
+}
+
+
+// The baseline of line `index`, in FP26
+static inline bf3_fp26 bf3_lines_pen_y(const bf3_lines *lines, size_t index)
+{
+    return (lines->y * 64) + (lines->mode.lineheight * (bf3_fp26) (index + 1));
+}
+
+
+// Add vertices[first] to vertices[end - 1] to the dirty range
+static void bf3_lines_dirty(bf3_lines *lines, size_t first, size_t end)
+{
+    if (first >= end) { return; }
+
+    if (lines->dirty_first == lines->dirty_end)
+        { lines->dirty_first = first; lines->dirty_end = end; return; }
+
+    if (first < lines->dirty_first) { lines->dirty_first = first; }
+    if (end > lines->dirty_end) { lines->dirty_end = end; }
+}
+
+
+// Split codepoints[first_codepoint] to codepoints[end - 1] into lines, from
+// lines[first_line] on. The range ends with a '\n', unless it is the `last`
+// line, which may be empty. Returns the number of lines.
+static size_t bf3_lines_split(bf3_lines *lines, size_t first_line,
+    size_t first_codepoint, size_t end, bool last)
+{
+    bf3_line *line = lines->lines + first_line;
+    size_t start = first_codepoint;
+
+    for (size_t i = first_codepoint; i < end; i++)
+    {
+        if (lines->codepoints[i] != '\n') { continue; }
+
+        line->first_codepoint = (uint32_t) start;
+        line->num_codepoints = (uint32_t) (i + 1 - start);
+        line++;
+        start = i + 1;
+    }
+
+    if (last)
+    {
+        line->first_codepoint = (uint32_t) start;
+        line->num_codepoints = (uint32_t) (end - start);
+        line++;
+    }
+
+    return (size_t) (line - (lines->lines + first_line));
+}
+
+
+// Lay out lines[first] to lines[end - 1], writing their quads from
+// quads[quad] to at most quads[max_quad - 1]. Returns the index after the
+// last quad written.
+static size_t bf3_lines_layout(bf3_lines *lines, size_t first, size_t end,
+    size_t quad, size_t max_quad)
+{
+    bf3_layout layout;
+    if (lines->metrics)
+    {
+        bf3_layout_init(&layout, &lines->mode, lines->metrics, lines->kerning,
+            lines->x, lines->y);
+    }
+
+    for (size_t i = first; i < end; i++)
+    {
+        bf3_line *line = lines->lines + i;
+        line->first_quad = (uint32_t) quad;
+        line->num_quads = 0;
+        line->pen_y = bf3_lines_pen_y(lines, i);
+        line->width = 0;
+        lines->relayouts++;
+
+        if (!lines->metrics) { continue; }
+
+        // each line starts afresh, so needs no kerning against the last
+        const uint32_t *text = lines->codepoints + line->first_codepoint;
+        size_t len = line->num_codepoints;
+        if (len && (text[len - 1] == '\n')) { len--; }
+
+        layout.pen_x = layout.origin_x;
+        layout.pen_y = line->pen_y;
+        layout.previous = 0;
+
+        line->num_quads = (uint32_t) bf3_layout_utf32(&layout, lines->quads + quad,
+            max_quad - quad, text, len, NULL);
+        line->width = layout.pen_x - layout.origin_x;
+        quad += line->num_quads;
+    }
+
+    return quad;
+}
+
+
+// Lay out every line, and write every vertex
+static void bf3_lines_relayout(bf3_lines *lines)
+{
+    lines->num_quads = bf3_lines_layout(lines, 0, lines->num_lines, 0, lines->capacity);
+    bf3_emit_triangles(&lines->emitter, lines->vertices, lines->quads, lines->num_quads);
+    bf3_lines_dirty(lines, 0, 6 * lines->num_quads);
+}
+
+
+void bf3_lines_set_table(bf3_lines *lines, const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning)
+{
+    uint8_t color_top[4], color_bottom[4];
+    memcpy(color_top, lines->emitter.color_top, 4);
+    memcpy(color_bottom, lines->emitter.color_bottom, 4);
+
+    bf3_emitter_init(&lines->emitter, info);
+    memcpy(lines->emitter.color_top, color_top, 4);
+    memcpy(lines->emitter.color_bottom, color_bottom, 4);
+
+    lines->mode = *mode;
+    lines->metrics = metrics;
+    lines->kerning = kerning;
+
+    bf3_lines_relayout(lines);
+}
+
+
+void bf3_lines_set_origin(bf3_lines *lines, int32_t x, int32_t y)
+{
+    int32_t dx = x - lines->x;
+    int32_t dy = y - lines->y;
+    if (!dx && !dy) { return; }
+
+    // the layout is rounded to pixels from a whole pixel origin, so moving
+    // the origin by whole pixels moves every quad by the same amount
+    for (size_t i = 0; i < lines->num_quads; i++)
+    {
+        lines->quads[i].x += dx;
+        lines->quads[i].y += dy;
+    }
+
+    for (size_t i = 0; i < 6 * lines->num_quads; i++)
+    {
+        lines->vertices[i].x += (float) dx;
+        lines->vertices[i].y += (float) dy;
+    }
+
+    for (size_t i = 0; i < lines->num_lines; i++)
+        { lines->lines[i].pen_y += dy * 64; }
+
+    lines->x = x;
+    lines->y = y;
+    bf3_lines_dirty(lines, 0, 6 * lines->num_quads);
+}
+
+
+bool bf3_lines_set_utf8(bf3_lines *lines, const char *utf8, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) utf8;
+    const unsigned char *end = p + len;
+    size_t count = 0;
+    size_t newlines = 0;
+
+    // no room for even an empty line
+    if (!lines->max_lines) { return false; }
+
+    for (; (p < end) && (count < lines->capacity); count++)
+    {
+        uint32_t codepoint = *p;
+        size_t length = 1;
+
+        if (codepoint >= 0x80)
+        {
+            length = bf3_utf8_decode(p, end, &codepoint);
+            if (!length) { codepoint = 0xFFFD; length = 1; } // cut short
+        }
+
+        p += length;
+        newlines += (codepoint == '\n');
+        lines->codepoints[count] = codepoint;
+    }
+
+    bool fits = (p == end) && (newlines < lines->max_lines);
+    lines->num_codepoints = fits ? count : 0;
+    lines->num_lines = bf3_lines_split(lines, 0, 0, lines->num_codepoints, true);
+
+    bf3_lines_relayout(lines);
+    return fits;
+}
+
+
+size_t bf3_lines_find(const bf3_lines *lines, size_t index)
+{
+    if (!lines->num_lines) { return 0; }
+
+    // the last line starting at or before `index`
+    size_t lo = 0, hi = lines->num_lines - 1;
+    while (lo < hi)
+    {
+        size_t mid = lo + ((hi - lo + 1) / 2);
+        if (lines->lines[mid].first_codepoint <= index) { lo = mid; }
+        else { hi = mid - 1; }
+    }
+
+    return lo;
+}
+
+
+bool bf3_lines_replace(bf3_lines *lines, size_t start, size_t remove,
+    const uint32_t *insert, size_t insert_len)
+{
+    size_t num_codepoints = lines->num_codepoints;
+    if (!lines->num_lines) { return false; } // max_lines is 0
+    if ((start > num_codepoints) || (remove > num_codepoints - start)) { return false; }
+    if (num_codepoints - remove + insert_len > lines->capacity) { return false; }
+
+    size_t inserted_lines = 0;
+    for (size_t i = 0; i < insert_len; i++)
+        { inserted_lines += (insert[i] == '\n'); }
+
+    // lines first to last hold the edit, and become 1 + inserted_lines lines
+    // (every '\n' removed joins two of them)
+    size_t first = bf3_lines_find(lines, start);
+    size_t last = bf3_lines_find(lines, start + remove);
+    size_t old_count = last - first + 1;
+    size_t new_count = 1 + inserted_lines;
+    if (lines->num_lines - old_count + new_count > lines->max_lines) { return false; }
+
+    bf3_line *line = lines->lines;
+    size_t region_first = line[first].first_codepoint;
+    size_t region_end = line[last].first_codepoint + line[last].num_codepoints;
+    region_end = region_end + insert_len - remove;
+    size_t quad_first = line[first].first_quad;
+    size_t quad_end = line[last].first_quad + line[last].num_quads;
+    size_t old_quads = lines->num_quads;
+    size_t tail_quads = old_quads - quad_end;
+    size_t tail_lines = lines->num_lines - (last + 1);
+
+    // edit the codepoints
+    uint32_t *codepoints = lines->codepoints;
+    memmove(codepoints + start + insert_len, codepoints + start + remove,
+        (num_codepoints - start - remove) * sizeof(uint32_t));
+    if (insert_len) { memcpy(codepoints + start, insert, insert_len * sizeof(uint32_t)); }
+    lines->num_codepoints = num_codepoints - remove + insert_len;
+
+    // replace the lines holding the edit
+    memmove(line + first + new_count, line + last + 1, tail_lines * sizeof(bf3_line));
+    lines->num_lines = lines->num_lines - old_count + new_count;
+    bf3_lines_split(lines, first, region_first, region_end, !tail_lines);
+
+    // move the quads after the edit to the end of the storage, out of the
+    // way, lay out the new lines, then move them back
+    bf3_quad *quads = lines->quads;
+    size_t parked = lines->capacity - tail_quads;
+    memmove(quads + parked, quads + quad_end, tail_quads * sizeof(bf3_quad));
+    size_t new_quad_end = bf3_lines_layout(lines, first, first + new_count, quad_first, parked);
+    memmove(quads + new_quad_end, quads + parked, tail_quads * sizeof(bf3_quad));
+    lines->num_quads = new_quad_end + tail_quads;
+
+    // move the vertices after the edit, then write the new lines' vertices
+    bf3_vertex *vertices = lines->vertices;
+    memmove(vertices + (6 * new_quad_end), vertices + (6 * quad_end),
+        6 * tail_quads * sizeof(bf3_vertex));
+    bf3_emit_triangles(&lines->emitter, vertices + (6 * quad_first),
+        quads + quad_first, new_quad_end - quad_first);
+
+    // the lines after the edit move, and move down or up if the number of
+    // lines changed, by whole pixels
+    for (size_t i = first + new_count; i < lines->num_lines; i++)
+    {
+        line[i].first_codepoint = (uint32_t) (line[i].first_codepoint + insert_len - remove);
+        line[i].first_quad = (uint32_t) (line[i].first_quad + new_quad_end - quad_end);
+        if (new_count == old_count) { continue; }
+
+        bf3_fp26 pen_y = bf3_lines_pen_y(lines, i);
+        int32_t dy = bf3_fp26_pixel(pen_y) - bf3_fp26_pixel(line[i].pen_y);
+        line[i].pen_y = pen_y;
+        if (!dy) { continue; }
+
+        size_t end = line[i].first_quad + line[i].num_quads;
+        for (size_t q = line[i].first_quad; q < end; q++)
+        {
+            quads[q].y += dy;
+            for (size_t v = 0; v < 6; v++) { vertices[(6 * q) + v].y += (float) dy; }
+        }
+    }
+
+    // everything after the edit changed if it moved
+    bool moved = tail_quads && ((new_quad_end != quad_end) || (new_count != old_count));
+    size_t dirty_end = moved ? lines->num_quads : new_quad_end;
+    if (dirty_end < quad_end) { dirty_end = quad_end; } // if fewer quads
+    if (moved && (dirty_end < old_quads)) { dirty_end = old_quads; }
+    bf3_lines_dirty(lines, 6 * quad_first, 6 * dirty_end);
+
+    return true;
+}
+
+
+void bf3_lines_clean(bf3_lines *lines)
+{
+    lines->dirty_first = 0;
+    lines->dirty_end = 0;
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Large documents
+
+void bf3_line_index_init(bf3_line_index *index, const bf3_mode *mode,
+    size_t *offsets, size_t max_lines)
+{
+    memset(index, 0, sizeof(bf3_line_index));
+
+    index->offsets = offsets;
+    index->max_lines = max_lines;
+    index->lineheight = mode->lineheight;
+
+    if (max_lines)
+    {
+        offsets[0] = 0;
+        index->num_lines = 1;
+    }
+}
+
+
+bool bf3_line_index_update(bf3_line_index *index, const char *utf8, size_t len)
+{
+    while (index->indexed < len)
+    {
+        const char *start = utf8 + index->indexed;
+        const char *newline = memchr(start, '\n', len - index->indexed);
+        if (!newline) { index->indexed = len; break; }
+
+        if (index->num_lines >= index->max_lines) { return false; }
+
+        index->indexed = (size_t) (newline + 1 - utf8);
+        index->offsets[index->num_lines++] = index->indexed;
+    }
+
+    return true;
+}
+
+
+int64_t bf3_line_index_height(const bf3_line_index *index)
+{
+    return (int64_t) index->lineheight * (int64_t) index->num_lines;
+}
+
+
+// The line at `y` FP26 units below the top of the document, which may be
+// before the first line or after the last
+static inline int64_t bf3_line_index_floor(const bf3_line_index *index, int64_t y)
+{
+    int64_t line = y / index->lineheight;
+    if ((y % index->lineheight) < 0) { line--; } // round down, not to zero
+    return line;
+}
+
+
+size_t bf3_line_index_find(const bf3_line_index *index, int32_t y)
+{
+    if (index->lineheight <= 0) { return 0; }
+
+    int64_t line = bf3_line_index_floor(index, (int64_t) y * 64);
+    if (line < 0) { return 0; }
+    if (line >= (int64_t) index->num_lines) { return index->num_lines - 1; }
+    return (size_t) line;
+}
+
+
+size_t bf3_layout_view(bf3_layout *layout, const bf3_line_index *index,
+    const char *utf8, size_t len, const bf3_view *view,
+    bf3_quad *quads, size_t max_quads)
+{
+    if (index->lineheight <= 0) { return 0; }
+    if ((view->clip_left >= view->clip_right) || (view->clip_top >= view->clip_bottom)) { return 0; }
+
+    // Glyphs may reach a little outside their line, so lay out one more line
+    // above and below the ones crossing the clip rectangle
+    int64_t first = bf3_line_index_floor(index, ((int64_t) view->clip_top - view->y) * 64) - 1;
+    int64_t last = bf3_line_index_floor(index, ((int64_t) view->clip_bottom - 1 - view->y) * 64) + 1;
+    if (first < 0) { first = 0; }
+    if (last >= (int64_t) index->num_lines) { last = (int64_t) index->num_lines - 1; }
+
+    // Likewise, a glyph may start a little left of the pen, so a line only
+    // ends when the pen is well past the right of the clip rectangle
+    int32_t margin = bf3_fp26_pixel(index->lineheight);
+    bf3_fp26 right = (bf3_fp26) (view->clip_right + margin) * 64;
+
+    const unsigned char *document = (const unsigned char *) utf8;
+    size_t count = 0;
+
+    for (int64_t line = first; (line <= last) && (count < max_quads); line++)
+    {
+        size_t offset = index->offsets[line];
+        if (offset >= len) { break; }
+
+        // the line ends before its '\n', if it has one
+        const unsigned char *p = document + offset;
+        const unsigned char *end = document + len;
+        const unsigned char *newline = NULL;
+        if (line + 1 < (int64_t) index->num_lines)
+            { newline = document + index->offsets[line + 1] - 1; }
+        else
+            { newline = memchr(p, '\n', len - offset); }
+        if (newline) { end = newline; }
+
+        // the baseline is on screen, even if the line number is large
+        int64_t baseline = ((int64_t) view->y * 64) + ((int64_t) index->lineheight * (line + 1));
+        layout->origin_x = view->x * 64;
+        layout->pen_x = layout->origin_x;
+        layout->pen_y = (bf3_fp26) baseline;
+        layout->previous = 0;
+
+        while ((p < end) && (count < max_quads) && (layout->pen_x < right))
+        {
+            uint32_t codepoint = *p;
+            size_t length = 1;
+
+            if (codepoint >= 0x80)
+            {
+                length = bf3_utf8_decode(p, end, &codepoint);
+                if (!length && !newline) { break; } // the document is cut short
+                if (!length) { codepoint = 0xFFFD; length = 1; } // by the '\n'
+            }
+
+            p += length;
+
+            bf3_quad *quad = quads + count;
+            if (!bf3_layout_codepoint(layout, codepoint, quad)) { continue; }
+
+            // cull glyphs outside the clip rectangle
+            if ((quad->x >= view->clip_right) || (quad->x + quad->tex_w <= view->clip_left)
+                || (quad->y >= view->clip_bottom) || (quad->y + quad->tex_h <= view->clip_top))
+                { continue; }
+
+            count++;
+        }
+    }
+
+    return count;
+}
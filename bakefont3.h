@@ -48,6 +48,9 @@
 // use BF3_DECODE_FP26_NEAREST((int32_t) x) to get a result as an integer,
 // rounded to the nearest integer (rounding away from 0 if exactly half way).
 
+// NEAREST, CEIL and FLOOR only use integer arithmetic, so they don't need a
+// conversion to float, and they give the same result on every platform.
+
 // use BF3_DECODE_FP26_CEIL((int32_t) x, (bf3_fp26) tolerance) to get the
 // result as an integer rounded towards +/-ve infinity, with a bit of tolerance
 // where the value is rounded to the nearest integer instead. This is useful
@@ -60,13 +63,31 @@
 
 typedef int32_t bf3_fp26;
 
+// A font mode with the `sdf` flag set is baked at one reference size (the
+// mode's `size`) but can be drawn at any size. Scale every metric, kerning
+// offset, and the glyph quad by (wanted size / mode size) e.g. with
+// BF3_FP26_SCALE(metric.hadvance, mode.size, BF3_ENCODE_FP26(wanted)).
+// In the fragment shader, with `spread` scaled to screen pixels:
+//     float d = texture(sample0, uv)[channel];
+//     float w = 0.25 / spread_pixels; // about one pixel of antialiasing
+//     float opacity = smoothstep(0.5 - w, 0.5 + w, d);
+
+#define BF3_FP26_SCALE(x, from_size, to_size) \
+    ((bf3_fp26) (((int64_t) (x) * (to_size)) / (from_size)))
+
 #define BF3_DECODE_FP26(x) ( ((float) (x)) / 64.0f )
 #define BF3_ENCODE_FP26(x) ((bf3_fp26) (x  * 64.0f))
 
-#define BF3_DECODE_FP26_NEAREST(x) ((int) lroundf(BF3_DECODE_FP26(x)))
+#define BF3_DECODE_FP26_NEAREST(x) BF3_DECODE_FP26_NEAREST_impl(x)
 #define BF3_DECODE_FP26_CEIL(x, tolerance) BF3_DECODE_FP26_CEIL_impl(x, tolerance)
 #define BF3_DECODE_FP26_FLOOR(x, tolerance) BF3_DECODE_FP26_FLOOR_impl(x, tolerance)
 
+// (inline, as it's used for every glyph)
+static inline int BF3_DECODE_FP26_NEAREST_impl(bf3_fp26 x)
+{
+    return (x < 0) ? -(int) ((32 - (int64_t) x) >> 6) : (int) (((int64_t) x + 32) >> 6);
+}
+
 int BF3_DECODE_FP26_CEIL_impl(bf3_fp26 x, bf3_fp26 tolerance);
 int BF3_DECODE_FP26_FLOOR_impl(bf3_fp26 x, bf3_fp26 tolerance);
 
@@ -106,6 +127,7 @@ struct bf3_info
     uint16_t num_fonts; // A list of font names; the index is the FontID
     uint16_t num_modes; // ModeID => (FontID, size, antialias)
     uint16_t num_tables; // A list of (ModeID, Glyphsetname) mappings to offsets
+    uint16_t bits;   // bits per glyph layer: 8 (one glyph per channel), 4, 1
 };
 
 
@@ -139,7 +161,13 @@ struct bf3_mode
     // the ID of the font used, from 0 to (num_fonts-1)
     uint16_t font_id;
     
-    int antialias:1; // was hinting used?
+    int antialias:1; // was hinting used? (also true for sdf)
+    int sdf:1;       // is each glyph a signed distance field? (see below)
+    
+    // for a signed distance field, the distance in pixels (at this size) from
+    // the glyph outline to where the field reaches 0 or 255 (it is 128 on
+    // the outline)
+    uint8_t spread;
     
     // fixed float values (1/64th precision)
     // use BF3_DECODE_FP26(size) to get an actual float
@@ -187,7 +215,7 @@ struct bf3_metric
     // relative to top-left
     uint16_t tex_x;
     uint16_t tex_y;
-    uint8_t  tex_z; // channel
+    uint8_t  tex_z; // channel (see bf3_coverage if bits is less than 8)
     
     // size of the rasterised image in texture atlas
     uint8_t  tex_w;
@@ -276,4 +304,545 @@ bool bf3_metric_get(bf3_metric *metric, const char *metrics, uint32_t codepoint)
 bool bf3_kpair_get(bf3_kpair *kpair, const char *kerning,
     uint32_t codepoint_left, uint32_t codepoint_right);
 
+
+// When `info->bits` is less than 8, each colour channel of the texture atlas
+// holds (8 / bits) glyph layers, and a metric's tex_z identifies both:
+//     channel = tex_z / (8 / bits)
+//     layer   = tex_z % (8 / bits)
+// and the glyph's coverage is in bits (layer * bits) to ((layer+1) * bits) - 1
+// of that channel. e.g. with bits=1, one RGBA texel holds 32 1-bit glyphs, and
+// with bits=4, one RGBA texel holds 8 glyphs with 16 levels of coverage.
+// Always sample the texture atlas with GL_NEAREST.
+
+#define BF3_TEX_CHANNEL(info, tex_z) ((tex_z) / (8 / (info)->bits))
+#define BF3_TEX_LAYER(info, tex_z)   ((tex_z) % (8 / (info)->bits))
+
+// Decode the coverage (0 to 255) of the glyph in layer `tex_z` from one texel,
+// `texel`, of `info->depth` bytes from the texture atlas. Reference GLSL:
+//
+//     // texel: from texture(), channel and layer: as above
+//     float bf3_coverage(vec4 texel, int channel, int layer, int bits)
+//     {
+//         float value  = floor(texel[channel] * 255.0 + 0.5);
+//         float levels = exp2(float(bits));
+//         float shift  = exp2(float(layer * bits));
+//         return mod(floor(value / shift), levels) / (levels - 1.0);
+//     }
+int bf3_coverage(const bf3_info *info, const unsigned char *texel, int tex_z);
+
+
+// Layout
+//
+// bf3_layout positions each glyph of a line or block of text, using the
+// buffers filled by bf3_metrics_load and bf3_kerning_load, and writes a
+// bf3_quad for every glyph with an image into a buffer you provide.
+//
+// It never allocates memory and keeps no global state: all of its state is
+// in the bf3_layout structure. The metrics and kerning buffers are only read,
+// so any number of threads can lay out text with the same table at once,
+// each with its own bf3_layout.
+//
+// Text is laid out left to right from the pen position, with kerning between
+// each pair of glyphs. A newline ('\n') moves the pen to the start of the
+// next line, `lineheight` down. Codepoints the table doesn't have are
+// skipped. The pen, advances and kerning are added up in 26.6 fixed point,
+// and rounded to whole pixels only for each quad, with integers only, so the
+// result is the same on every platform. x is to the right and y is down.
+
+// The bf3_quad structure describes where to draw one glyph image
+
+typedef struct bf3_quad bf3_quad;
+
+struct bf3_quad
+{
+    // top-left corner of the glyph image, in pixels
+    int32_t x;
+    int32_t y;
+
+    // the glyph image in the texture atlas (see bf3_metric)
+    uint16_t tex_x;
+    uint16_t tex_y;
+    uint8_t  tex_w;
+    uint8_t  tex_h;
+    uint8_t  tex_z; // channel (see bf3_coverage if bits is less than 8)
+
+    uint8_t  reserved; // always zero
+};
+
+
+// The bf3_layout structure holds the state of a layout between calls
+
+typedef struct bf3_layout bf3_layout;
+
+struct bf3_layout
+{
+    // where each line starts, and the pen position (y is the baseline), in
+    // FP26. These can be changed between calls, e.g. to start a paragraph.
+    bf3_fp26 origin_x;
+    bf3_fp26 pen_x;
+    bf3_fp26 pen_y;
+
+    // distance between lines, in FP26 (from bf3_mode.lineheight)
+    bf3_fp26 lineheight;
+
+    // the last codepoint laid out on this line, for kerning (0 if none)
+    uint32_t previous;
+
+    // set by bf3_layout_init - read only
+    const char *metrics;
+    const char *kerning;
+    uint32_t num_metrics;
+    uint32_t num_kerning;
+
+    // a run of consecutive codepoints (usually printable ASCII) whose
+    // metrics are found by index instead of by a binary search
+    uint32_t dense_first;
+    uint32_t dense_index;
+    uint32_t dense_count;
+};
+
+// Start a layout with a table's metrics and kerning buffers (kerning may be
+// NULL), for text in the font mode `mode`, with the pen at pixel (x, y), where
+// y is the baseline of the first line (e.g. the top of the text + lineheight).
+void bf3_layout_init(bf3_layout *layout, const bf3_mode *mode,
+    const char *metrics, const char *kerning, int32_t x, int32_t y);
+
+// Lay out `len` bytes of UTF-8 text, writing at most `max_quads` quads.
+// Returns the number of quads written. If `consumed` isn't NULL, it is set to
+// the number of bytes laid out: less than `len` if `quads` is full (call again
+// with the rest of the text), or if the text ends partway through a UTF-8
+// sequence (pass those bytes again with the text that follows).
+// Invalid UTF-8 (including overlong sequences and surrogates) is laid out as
+// U+FFFD, one byte at a time.
+size_t bf3_layout_utf8(bf3_layout *layout, bf3_quad *quads, size_t max_quads,
+    const char *text, size_t len, size_t *consumed);
+
+// As above, for `len` codepoints of UTF-32 text. `consumed` is in codepoints.
+size_t bf3_layout_utf32(bf3_layout *layout, bf3_quad *quads, size_t max_quads,
+    const uint32_t *text, size_t len, size_t *consumed);
+
+
+// Vertex data
+//
+// bf3_emit turns the quads written by bf3_layout into interleaved vertex data
+// that can be copied straight into one vertex buffer. There are three
+// layouts: six vertices per glyph (two triangles, for glDrawArrays), four
+// vertices per glyph plus an index buffer (for glDrawElements), or one
+// instance record per glyph (for glDrawArraysInstanced).
+//
+// On x86 with SSE2 (every x86-64 target), quads are converted four at a
+// time. Define BF3_NO_SIMD to always use the plain C version.
+
+// The bf3_vertex structure is one corner of a glyph quad (24 bytes)
+
+typedef struct bf3_vertex bf3_vertex;
+
+struct bf3_vertex
+{
+    float x, y; // position, in pixels
+    float u, v; // texture atlas coordinates, from 0 to 1
+
+    // 255 in the colour channel holding the glyph, 0 in the others, so a
+    // shader can use dot(texel, mask) (the layer is lost if bits < 8)
+    uint8_t mask[4];
+
+    uint8_t color[4]; // RGBA
+};
+
+
+// The bf3_instance structure is one glyph quad, for a shader that expands
+// each instance into a quad itself (44 bytes)
+
+typedef struct bf3_instance bf3_instance;
+
+struct bf3_instance
+{
+    float x0, y0, x1, y1; // position of the top left and bottom right corners
+    float u0, v0, u1, v1; // the same corners in the texture atlas
+    uint8_t mask[4];      // as bf3_vertex
+    uint8_t color_top[4];
+    uint8_t color_bottom[4];
+};
+
+
+// The bf3_emitter structure holds what is the same for every glyph
+
+typedef struct bf3_emitter bf3_emitter;
+
+struct bf3_emitter
+{
+    // set by bf3_emitter_init - read only
+    float inv_width;  // 1 / texture atlas width
+    float inv_height; // 1 / texture atlas height
+    uint8_t channel_shift; // channel = tex_z >> channel_shift
+
+    // colour of the top and bottom edges of every glyph (a vertical gradient)
+    // These can be changed between calls. Default: opaque white.
+    uint8_t color_top[4];
+    uint8_t color_bottom[4];
+};
+
+// Set up an emitter for quads in the texture atlas described by `info`
+void bf3_emitter_init(bf3_emitter *emitter, const bf3_info *info);
+
+// Write 6 vertices per quad to `vertices` (two counter-clockwise triangles:
+// top left, bottom left, bottom right, then top left, bottom right, top
+// right). Returns the number of vertices written (6 * num_quads).
+size_t bf3_emit_triangles(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quads, size_t num_quads);
+
+// Write 4 vertices per quad to `vertices` (top left, bottom left, bottom
+// right, top right). Returns the number of vertices written (4 * num_quads).
+size_t bf3_emit_quads(const bf3_emitter *emitter, bf3_vertex *vertices,
+    const bf3_quad *quads, size_t num_quads);
+
+// Write 6 indices per quad to `indices` for `num_quads` quads written by
+// bf3_emit_quads, starting with quad number `first_quad` in the vertex
+// buffer. The indices only depend on the number of quads, so they can be
+// written once for the largest number needed. Returns 6 * num_quads.
+size_t bf3_emit_indices(uint32_t *indices, size_t first_quad, size_t num_quads);
+
+// Write one instance record per quad to `instances`. Returns num_quads.
+size_t bf3_emit_instances(const bf3_emitter *emitter, bf3_instance *instances,
+    const bf3_quad *quads, size_t num_quads);
+
+
+// The bf3_instance16 structure is a compact instance record (16 bytes, or
+// about a ninth of six bf3_vertex) for a shader that expands each instance
+// into a quad itself. It has one colour, and the channel and layer of the
+// glyph instead of a mask, so it works with any `bits`. Positions outside
+// -32768 to 32767 are clamped.
+//
+// Reference GLSL (#version 330), drawn with glDrawArraysInstanced
+// (GL_TRIANGLES, 0, 6, count) and a divisor of 1 for each attribute:
+//
+//     uniform mat4 projection_matrix;
+//     uniform vec2 atlas_scale;   // emitter.inv_width, emitter.inv_height
+//
+//     in ivec2 attrib_xy;         // GL_SHORT, glVertexAttribIPointer
+//     in uvec2 attrib_tex_xy;     // GL_UNSIGNED_SHORT, glVertexAttribIPointer
+//     in uvec4 attrib_tex_whcl;   // GL_UNSIGNED_BYTE, glVertexAttribIPointer
+//     in vec4  attrib_color;      // GL_UNSIGNED_BYTE, normalized
+//
+//     out vec2 uv;
+//     out vec4 color;
+//     flat out int channel;
+//     flat out int layer;
+//
+//     void main(void)
+//     {
+//         // corners in the same order as bf3_emit_triangles
+//         const int corners[6] = int[6](0, 1, 2, 0, 2, 3);
+//         int corner = corners[gl_VertexID];
+//         vec2 offset = vec2(attrib_tex_whcl.xy) *
+//             vec2(corner >= 2 ? 1.0 : 0.0, (corner == 1 || corner == 2) ? 1.0 : 0.0);
+//
+//         uv = (vec2(attrib_tex_xy) + offset) * atlas_scale;
+//         color = attrib_color;
+//         channel = int(attrib_tex_whcl.z);
+//         layer = int(attrib_tex_whcl.w);
+//         gl_Position = vec4(vec2(attrib_xy) + offset, 0.0, 1.0) * projection_matrix;
+//     }
+//
+// and in the fragment shader, with bf3_coverage (above):
+//
+//     float opacity = bf3_coverage(texture(sample0, uv), channel, layer, bits);
+//     frag_color = vec4(color.rgb, color.a * opacity);
+
+typedef struct bf3_instance16 bf3_instance16;
+
+struct bf3_instance16
+{
+    int16_t  x, y;          // top left corner, in pixels
+    uint16_t tex_x, tex_y;  // the glyph image in the texture atlas
+    uint8_t  tex_w, tex_h;
+    uint8_t  channel;       // BF3_TEX_CHANNEL
+    uint8_t  layer;         // BF3_TEX_LAYER (0 if bits is 8)
+    uint8_t  color[4];      // RGBA, from the emitter's color_top
+};
+
+// Write one compact instance record per quad to `instances`.
+// Returns num_quads.
+size_t bf3_emit_instances16(const bf3_emitter *emitter, bf3_instance16 *instances,
+    const bf3_quad *quads, size_t num_quads);
+
+// Lay out and emit in one pass: bf3_layout_utf8 followed by bf3_emit_triangles
+// (or bf3_emit_instances), with the same result, but the quads only ever go
+// in a small buffer that stays in the CPU cache, a few at a time, instead of
+// being written out for the whole text and read back. `max_quads` and
+// `consumed` are as for bf3_layout_utf8. Returns the number of quads.
+size_t bf3_layout_triangles_utf8(bf3_layout *layout, const bf3_emitter *emitter,
+    bf3_vertex *vertices, size_t max_quads, const char *text, size_t len, size_t *consumed);
+
+size_t bf3_layout_instances_utf8(bf3_layout *layout, const bf3_emitter *emitter,
+    bf3_instance *instances, size_t max_quads, const char *text, size_t len, size_t *consumed);
+
+
+// Text blocks
+//
+// A bf3_text holds a block of text that is drawn every frame but rarely
+// changes, e.g. a label in a user interface: its codepoints, its quads and
+// its vertices (six per quad, as bf3_emit_triangles). The text is only laid
+// out again when the string or the table changes, and the vertices are only
+// written again when the layout, the origin or the colour changes. Otherwise
+// bf3_text_update does nothing, so static text costs no layout work at all.
+//
+// Like bf3_layout, it never allocates: the caller provides the storage.
+
+// the `dirty` flags of a bf3_text
+#define BF3_TEXT_DIRTY_LAYOUT   1 // lay out the codepoints again
+#define BF3_TEXT_DIRTY_VERTICES 2 // write the vertices again
+
+typedef struct bf3_text bf3_text;
+
+struct bf3_text
+{
+    // storage provided to bf3_text_init, for up to `capacity` codepoints,
+    // `capacity` quads and 6 * `capacity` vertices
+    uint32_t *codepoints;
+    bf3_quad *quads;
+    bf3_vertex *vertices;
+    size_t capacity;
+
+    size_t num_codepoints;
+    size_t num_quads;
+    size_t num_vertices; // vertices[0] to vertices[num_vertices - 1]
+
+    // set with bf3_text_set_table - read only
+    bf3_mode mode;
+    const char *metrics;
+    const char *kerning;
+    bf3_emitter emitter; // the colour is set with bf3_text_set_color
+
+    // top left of the first line, in pixels (see bf3_text_set_origin)
+    int32_t x;
+    int32_t y;
+
+    // what bf3_text_update needs to do (BF3_TEXT_DIRTY_*)
+    unsigned int dirty;
+
+    // how many times the text has been laid out, and the vertices written
+    uint32_t relayouts;
+    uint32_t updates;
+};
+
+// Start an empty text block, with storage for `capacity` codepoints.
+// `vertices` must have room for 6 * `capacity`.
+void bf3_text_init(bf3_text *text, uint32_t *codepoints, bf3_quad *quads,
+    bf3_vertex *vertices, size_t capacity);
+
+// Use the table with these metrics and kerning buffers (kerning may be NULL)
+// in the font mode `mode`, in the texture atlas described by `info`. Only
+// marks the text dirty if any of these are different.
+void bf3_text_set_table(bf3_text *text, const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning);
+
+// Set the text to `len` bytes of UTF-8 (invalid UTF-8 is U+FFFD), or `len`
+// codepoints. Only marks the text dirty if it is different. Returns false
+// if the text was cut short to fit in `capacity` codepoints.
+bool bf3_text_set_utf8(bf3_text *text, const char *utf8, size_t len);
+bool bf3_text_set_utf32(bf3_text *text, const uint32_t *utf32, size_t len);
+
+// Move the top left of the text to pixel (x, y). This moves the quads
+// without laying the text out again.
+void bf3_text_set_origin(bf3_text *text, int32_t x, int32_t y);
+
+// Set the colour of the top and bottom of every glyph (RGBA)
+void bf3_text_set_color(bf3_text *text, const uint8_t top[4], const uint8_t bottom[4]);
+
+// Lay out the text and write its vertices again, if anything has changed.
+// Returns true if the vertices changed (so need to be uploaded again).
+bool bf3_text_update(bf3_text *text);
+
+// Edited text
+//
+// A bf3_lines holds a block of text that is edited a little at a time, e.g.
+// in a text editor or a console, laid out one line at a time. A line ends
+// after each '\n', and a new line starts with no kerning against the line
+// before, so each line can be laid out on its own. bf3_lines_replace lays
+// out again only the lines an edit touches; the lines after it are moved,
+// up or down by whole pixels if the number of lines changed, but not laid
+// out again.
+//
+// The quads and vertices (six per quad, as bf3_emit_triangles) of all the
+// lines are kept in order, in one array. After an edit, the range of
+// vertices from `dirty_first` to `dirty_end` is all that changed, so only
+// that part of a vertex buffer needs to be written again. An edit near the
+// end of the text only changes vertices near the end.
+//
+// Like bf3_layout, it never allocates: the caller provides the storage.
+
+// The bf3_line structure is the layout of one line of a bf3_lines
+
+typedef struct bf3_line bf3_line;
+
+struct bf3_line
+{
+    // codepoints[first_codepoint] to codepoints[first_codepoint +
+    // num_codepoints - 1], including the '\n' at the end (if any)
+    uint32_t first_codepoint;
+    uint32_t num_codepoints;
+
+    // quads[first_quad] to quads[first_quad + num_quads - 1]
+    uint32_t first_quad;
+    uint32_t num_quads;
+
+    bf3_fp26 pen_y; // the baseline
+    bf3_fp26 width; // the pen position at the end of the line, from x
+};
+
+
+typedef struct bf3_lines bf3_lines;
+
+struct bf3_lines
+{
+    // storage provided to bf3_lines_init: up to `capacity` codepoints,
+    // `capacity` quads, 6 * `capacity` vertices and `max_lines` lines
+    uint32_t *codepoints;
+    bf3_quad *quads;
+    bf3_vertex *vertices;
+    size_t capacity;
+    bf3_line *lines;
+    size_t max_lines;
+
+    size_t num_codepoints;
+    size_t num_quads; // and 6 * num_quads vertices
+    size_t num_lines; // at least 1 (the number of '\n' + 1)
+
+    // set with bf3_lines_set_table - read only. The emitter's colours can be
+    // changed before setting the text.
+    bf3_mode mode;
+    const char *metrics;
+    const char *kerning;
+    bf3_emitter emitter;
+
+    // top left of the first line, in pixels (see bf3_lines_set_origin)
+    int32_t x;
+    int32_t y;
+
+    // the vertices that changed since bf3_lines_clean, from
+    // vertices[dirty_first] to vertices[dirty_end - 1] (none if equal)
+    size_t dirty_first;
+    size_t dirty_end;
+
+    // how many lines have been laid out
+    uint32_t relayouts;
+};
+
+// Start an empty text, with storage for `capacity` codepoints and
+// `max_lines` lines. `vertices` must have room for 6 * `capacity`. Even an
+// empty text is one line, so with a `max_lines` of 0 (and NULL storage) the
+// text stays empty and every edit returns false.
+void bf3_lines_init(bf3_lines *lines, uint32_t *codepoints, bf3_quad *quads,
+    bf3_vertex *vertices, size_t capacity, bf3_line *line_storage, size_t max_lines);
+
+// Use the table with these metrics and kerning buffers (kerning may be NULL)
+// in the font mode `mode`, in the texture atlas described by `info`, and
+// lay out all the text again.
+void bf3_lines_set_table(bf3_lines *lines, const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning);
+
+// Move the top left of the text to pixel (x, y), without laying it out again
+void bf3_lines_set_origin(bf3_lines *lines, int32_t x, int32_t y);
+
+// Replace all the text with `len` bytes of UTF-8 (invalid UTF-8 is U+FFFD),
+// and lay it out. Returns false if there isn't room for it (and then the
+// text is empty).
+bool bf3_lines_set_utf8(bf3_lines *lines, const char *utf8, size_t len);
+
+// Replace `remove` codepoints from codepoint `start` with `insert_len`
+// codepoints (either may be 0), and lay out the lines that changed.
+// Returns false, changing nothing, if the range is outside the text, or
+// there isn't room for the result.
+bool bf3_lines_replace(bf3_lines *lines, size_t start, size_t remove,
+    const uint32_t *insert, size_t insert_len);
+
+// The index of the line holding codepoint `index` (the last line, for the
+// end of the text), or 0 if there are no lines
+size_t bf3_lines_find(const bf3_lines *lines, size_t index);
+
+// Mark every vertex as uploaded (i.e. clear dirty_first and dirty_end)
+void bf3_lines_clean(bf3_lines *lines);
+
+// Large documents
+//
+// Laying out a whole document just to show the part that fits on screen
+// wastes most of the work. A bf3_line_index records the byte offset where
+// each line of a UTF-8 document starts. Every line is `lineheight` tall, so
+// line n starts n * lineheight below the top of the document, and the lines
+// on screen are found by a division, not a search. bf3_layout_view then lays
+// out only the lines that cross a clip rectangle, and only writes quads for
+// glyphs inside it, so scrolling costs as much as the text on screen.
+//
+// The index can be built all at once, or as the document grows (e.g. a log
+// file being appended to). Like bf3_layout, it never allocates: the caller
+// provides the storage, and the document itself is not copied.
+
+typedef struct bf3_line_index bf3_line_index;
+
+struct bf3_line_index
+{
+    // storage provided to bf3_line_index_init: where each line starts
+    size_t *offsets;
+    size_t max_lines;
+
+    size_t num_lines; // at least 1
+    size_t indexed;   // how many bytes of the document have been indexed
+
+    // from bf3_mode.lineheight, in FP26
+    bf3_fp26 lineheight;
+};
+
+
+// The bf3_view structure describes what part of a document is on screen
+
+typedef struct bf3_view bf3_view;
+
+struct bf3_view
+{
+    // the top left of the document, in pixels on screen (scrolling down
+    // moves it up)
+    int32_t x;
+    int32_t y;
+
+    // glyphs are only laid out inside this rectangle, in pixels on screen,
+    // from (clip_left, clip_top) up to but not including (clip_right,
+    // clip_bottom)
+    int32_t clip_left;
+    int32_t clip_top;
+    int32_t clip_right;
+    int32_t clip_bottom;
+};
+
+// Start an empty index, with storage for `max_lines` line offsets, for text
+// in the font mode `mode`.
+void bf3_line_index_init(bf3_line_index *index, const bf3_mode *mode,
+    size_t *offsets, size_t max_lines);
+
+// Index a document of `len` bytes of UTF-8, carrying on from the last call:
+// only the bytes after `index->indexed` are read, so a document that is only
+// ever appended to can be indexed as it grows. (To index a different
+// document, call bf3_line_index_init again first.) Returns false if there
+// are more lines than `max_lines`: the lines after those aren't indexed.
+bool bf3_line_index_update(bf3_line_index *index, const char *utf8, size_t len);
+
+// The height of the indexed document, in FP26 (which may not fit in a
+// bf3_fp26, for a very long document)
+int64_t bf3_line_index_height(const bf3_line_index *index);
+
+// The index of the line at `y` pixels below the top of the document
+// (clamped to the first and last lines)
+size_t bf3_line_index_find(const bf3_line_index *index, int32_t y);
+
+// Lay out the lines of the indexed document `utf8` (`len` bytes) that are
+// in view, writing at most `max_quads` quads, only for glyphs inside the
+// clip rectangle. `layout` is a layout started with bf3_layout_init for the
+// table to use; its pen is moved to the start of each line. Returns the
+// number of quads written. These are the same quads bf3_layout_utf8 writes
+// for the whole document from (view->x, view->y + lineheight), less the
+// ones outside the clip rectangle.
+size_t bf3_layout_view(bf3_layout *layout, const bf3_line_index *index,
+    const char *utf8, size_t len, const bf3_view *view,
+    bf3_quad *quads, size_t max_quads);
+
 #endif // ifndef BAKEFONT3_H
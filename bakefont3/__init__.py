@@ -1,4 +1,5 @@
 from .pack      import pack
 from .geometry  import Cube, TernaryTree
-from .glyph     import Glyph, Render
-
+from .glyph     import Glyph, Render, Arena, SDF
+from .          import sizes
+from .          import trace
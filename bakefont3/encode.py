@@ -1,6 +1,9 @@
 import struct
-import itertools
+import io
+import contextlib
 import freetype
+import bakefont3 as bf3
+import numpy as np
 
 ENDIAN = '<' # always little endian
 
@@ -78,6 +81,7 @@ def fixedstring(nativeString, bufsize, encoding="utf-8"):
 
 def header(result, bytesize):
     width, height, depth = result.size
+    bits = 0 if result.bits == 8 else result.bits
 
     # Notation: `offset | size | notes`
 
@@ -87,12 +91,18 @@ def header(result, bytesize):
     yield uint16(height)   # 14 |  2 | texture atlas height
     yield uint16(depth)    # 16 |  2 | texture atlas depth (1, 3, 4)
     yield uint16(bytesize) # 18 |  2 | ...
-    yield b'\0\0\0\0'      # 20 |  4 | padding (realign to 8 bytes)
+    yield uint8(bits)      # 20 |  1 | bits per glyph layer (0 means 8)
+    yield b'\0\0\0'        # 21 |  3 | padding (realign to 8 bytes)
 
     # bytesize is a number of bytes you can read from the start of
     # the file in one go to load all the important indexes. It's going to be
     # only a few hundred bytes.
 
+    # bits is 0 for an ordinary texture atlas where each glyph uses a whole
+    # colour channel. Otherwise, each channel holds (8 / bits) glyph layers,
+    # and a glyph's channel is tex_z / (8 / bits), and its layer within that
+    # channel is tex_z % (8 / bits).
+
 
 def fontrelative(face, fsize, value):
     # value is in relative Font Units, so converted into pixels for the
@@ -141,8 +151,9 @@ def modes(result):
 
         # offset o = r + 8 + (32 * n)
         # o +0 |  2 | font ID
-        # o +2 |  1 | flag: 'A' if the font is antialiased, otherwise 'a'
-        # o +3 |  1 | RESERVED
+        # o +2 |  1 | flag: 'A' if the font is antialiased, otherwise 'a',
+        #             or 'S' for a signed distance field
+        # o +3 |  1 | SDF spread in pixels (or 0 if not a SDF)
         # o +4 |  4 | font size - fixed point 26.6
         #            (divide the signed int32 by 64 to get original float)
         # o +8 |  4 | lineheight aka linespacing - (fixed point 26.6)
@@ -150,9 +161,15 @@ def modes(result):
         # o+16 |  4 | underline vertical thickness, centered on position (fp26.6)
         # o+20 | 12 | RESERVED
 
+        sdf = (antialias == bf3.SDF)
+
         yield uint16(fontID)
-        yield b'A' if antialias else 'a'
-        yield b"\0"
+        if sdf:
+            yield b'S'
+            yield uint8(result.spread)
+        else:
+            yield b'A' if antialias else b'a'
+            yield b"\0"
         yield fp26_6(size)
 
         # lineheight aka linespacing
@@ -171,7 +188,7 @@ def modes(result):
         yield b'\0' * (4 + 4 + 4) # RESERVED
 
 
-def index(result, startingOffset, cb):
+def index(result):
     # offset is relative to r = 24 + 8 + (48 * number of fonts)
     #                              + 8 + (32 * number of modes)
 
@@ -180,50 +197,84 @@ def index(result, startingOffset, cb):
     yield uint16(len(result.modeTable)) # r+4 | 2 | number of (modeID, charsetname) pairs
     yield b"\0\0"                       # r+6 | 2 | padding (realign to 8 bytes)
 
-    offset = startingOffset
 
-    # GLYPHSET structures - variable length, located at a dynamic offset
-    glyphsets = []
-    for modeID, charsetname, glyphs in result.modeTable:
-        glyphsets.append(b''.join(glyphset(result, modeID)))
+def table(modeID, charsetname, metrics, kerning):
+    # GLYPH TABLE RECORDS - 40 bytes each
+    # where metrics, kerning are (absolute byte offset, byte size) pairs
+
+    # offset o = r + 8 + (40 * number of (modeID, charsetname) pairs)
+    # o +0 |  2 | mode ID
+    # o +2 |  2 | RESERVED
+    # o +4 |  4 | absolute byte offset of glyph metrics data
+    # o +8 |  4 | byte size of glyph metrics data
+    #             (subtract 4, divide by 40 to get number of entries)
+    # o+12 |  4 | absolute byte offset of glyph kerning data
+    # o+16 |  4 | byte size of glyph kerning data
+    #             (subtract 4, divide by 16 to get number of entries)
+    # o+20 | 20 | charset name (string, null terminated)
+
+    yield uint16(modeID)
+    yield b"\0\0"
+
+    # absolute byte offset to glyph metrics structure for this font mode
+    yield uint32(metrics[0])
+    yield uint32(metrics[1])
+
+    # absolute byte offset to kerning structure for this font mode
+    yield uint32(kerning[0])
+    yield uint32(kerning[1])
+
+    yield fixedstring(charsetname, 20)
+
+
+# GLYPH SET record - 40 bytes
+GSET_RECORD = np.dtype([
+    ('codepoint',    ENDIAN+'u4'), #  0 | 4 | Unicode code point
+    ('x',            ENDIAN+'u2'), #  4 | 2 | pixel position in texture atlas
+    ('y',            ENDIAN+'u2'), #  6 | 2 |
+    ('z',            ENDIAN+'u1'), #  8 | 1 | channel, or channel and layer
+    ('width',        ENDIAN+'u1'), #  9 | 1 | pixel size in texture atlas
+    ('height',       ENDIAN+'u1'), # 10 | 1 |
+    ('depth',        ENDIAN+'u1'), # 11 | 1 | (always 0 or 1)
+    ('bitmap_left',  ENDIAN+'i2'), # 12 | 2 |
+    ('bitmap_top',   ENDIAN+'i2'), # 14 | 2 |
+    ('horiBearingX', ENDIAN+'i4'), # 16 | 4 | (all remaining fields are FP26.6)
+    ('horiBearingY', ENDIAN+'i4'), # 20 | 4 |
+    ('horiAdvance',  ENDIAN+'i4'), # 24 | 4 |
+    ('vertBearingX', ENDIAN+'i4'), # 28 | 4 |
+    ('vertBearingY', ENDIAN+'i4'), # 32 | 4 |
+    ('vertAdvance',  ENDIAN+'i4'), # 36 | 4 |
+])
+assert GSET_RECORD.itemsize == 40
+
+# KERNING record - 16 bytes
+KERN_RECORD = np.dtype([
+    ('left',   ENDIAN+'u4'), #  0 | 4 | left glyph in kerning pair
+    ('right',  ENDIAN+'u4'), #  4 | 4 | right glyph in kerning pair
+    ('x',      ENDIAN+'i4'), #  8 | 4 | grid-fitted offset x (FP26.6)
+    ('x_fine', ENDIAN+'i4'), # 12 | 4 | non-grid-fitted offset x (FP26.6)
+])
+assert KERN_RECORD.itemsize == 16
+
+
+def records(dtype, columns):
+    """
+    Pack a mapping of field name => list of native ints into a numpy array of
+    records with the given dtype, checking that every value fits.
+    """
+    count = len(next(iter(columns.values()))) if columns else 0
+    array = np.zeros(count, dtype=dtype)
 
-    # KERNING structures - variable length, located at a dynamic offset
-    kernings = []
-    for modeID, charsetname, glyphs in result.modeTable:
-        kernings.append(b''.join(kerning(result, modeID, charsetname, glyphs, cb)))
+    for name, values in columns.items():
+        kind = dtype[name]
+        info = np.iinfo(kind)
+        values = np.array(values, dtype=np.int64)
+        if count:
+            assert info.min <= values.min() and values.max() <= info.max, \
+                "%s out of range for %s" % (name, kind)
+        array[name] = values
 
-    # GLYPH TABLE RECORDS - 40 bytes each
-    for index, tple in enumerate(result.modeTable):
-        modeID, charsetname, glyphs = tple
-        # offset o = r + 8 + (40 * number of (modeID, charsetname) pairs)
-        # o +0 |  2 | mode ID
-        # o +2 |  2 | RESERVED
-        # o +4 |  4 | absolute byte offset of glyph metrics data
-        # o +8 |  4 | byte size of glyph metrics data
-        #             (subtract 4, divide by 40 to get number of entries)
-        # o+12 |  4 | absolute byte offset of glyph kerning data
-        # o+16 |  4 | byte size of glyph kerning data
-        #             (subtract 4, divide by 16 to get number of entries)
-        # o+20 | 20 | charset name (string, null terminated)
-
-        yield uint16(modeID)
-        yield b"\0\0"
-
-        # absolute byte offset to glyph metrics structure for this font mode
-        yield uint32(offset)
-        yield uint32(len(glyphsets[index]))
-        offset += len(glyphsets[index])
-
-        # absolute byte offset to kerning structure for this font mode
-        yield uint32(offset)
-        yield uint32(len(kernings[index]))
-        offset += len(kernings[index])
-
-        yield fixedstring(charsetname, 20)
-
-    for i in range(len(glyphsets)):
-        yield glyphsets[i]
-        yield kernings[i]
+    return array
 
 
 def glyphset(result, modeID):
@@ -233,80 +284,110 @@ def glyphset(result, modeID):
     # GLYPH SET HEADER - 4 bytes
     yield b"GSET"                       # r+0 | 4 | debugging marker
 
-    # record - 40 bytes
-    for codepoint, glyph in sorted(glyphset.items()):
-        # Unicode code point
-        yield uint32(codepoint)  # 4 bytes
+    # arena records, sorted by codepoint
+    glyphs = result.arena.glyphs[[index for _, index in sorted(glyphset.items())]]
+
+    # records - 40 bytes each, see GSET_RECORD
+    # NOTE!!! bearings and advances are already FP26.6!!!
+    yield records(GSET_RECORD, {
+        'codepoint':    glyphs['codepoint'],
+        'x':            glyphs['x0'],
+        'y':            glyphs['y0'],
+        'z':            glyphs['z0'],
+        'width':        glyphs['width'],
+        'height':       glyphs['height'],
+        'depth':        glyphs['depth'],
+        'bitmap_left':  glyphs['bitmap_left'],
+        'bitmap_top':   glyphs['bitmap_top'],
+        'horiBearingX': glyphs['horiBearingX'],
+        'horiBearingY': glyphs['horiBearingY'],
+        'horiAdvance':  glyphs['horiAdvance'],
+        'vertBearingX': glyphs['vertBearingX'],
+        'vertBearingY': glyphs['vertBearingY'],
+        'vertAdvance':  glyphs['vertAdvance'],
+    }).tobytes()
+
+
+def kernpairs(face, size, charset, fp, cb, stats=None, lock=None):
+    """
+    Write the KERNING records for every ordered pair of characters in the
+    charset that the font has a glyph for, sorted by (left, right) codepoint,
+    to `fp`, a binary file-like object, one row (left character) at a time.
+
+    Sets the face's char size, so if the face is shared between threads, give
+    a `lock` on it: it is taken for each row rather than the whole table, so
+    that other threads can use the face in between.
 
-        # pixel position in texture atlas
-        yield uint16(glyph.x0)  # 2 bytes
-        yield uint16(glyph.y0)  # 2 bytes
-        yield uint8(glyph.z0)   # 1 byte
+    If given, the dict `stats` is updated with the number of `pairs` looked
+    up and the number of `records` (pairs with a kerning offset).
+    """
+    if stats is None: stats = dict()
+    if lock is None: lock = contextlib.nullcontext()
+    stats['pairs'] = 0
+    stats['records'] = 0
 
-        # pixel width in texture atlas
-        yield uint8(glyph.width)  # 1 byte
-        yield uint8(glyph.height) # 1 byte
-        yield uint8(glyph.depth)  # 1 byte (always 0 or 1)
-        assert 0 <= glyph.depth <= 1
+    if not face.has_kerning:
+        return
 
-        yield int16(glyph.bitmap_left); # 2 byte
-        yield int16(glyph.bitmap_top);  # 2 byte
+    size_fp = int(size * 64.0)  # convert to fixed point 26.6 format
+    dpi = 72  # typographic DPI where 1pt = 1px
 
-        # horizontal left side bearing and top side bearing
-        # positioning information relative to baseline
-        # NOTE!!! These are already FP26.6!!!
-        yield int32(glyph.horiBearingX)  # 4 bytes
-        yield int32(glyph.horiBearingY)  # 4 bytes
-        # advance - how much to advance the pen by horizontally after drawing
-        yield int32(glyph.horiAdvance)  # 4 bytes
+    glyphs = []
+    with lock:
+        for char in charset:
+            codepoint = ord(char) if isinstance(char, str) else char
+            index = face.get_char_index(codepoint)
+            if index: glyphs.append((codepoint, index))
+    glyphs.sort()
 
-        yield int32(glyph.vertBearingX)  # 4 bytes
-        yield int32(glyph.vertBearingY)  # 4 bytes
-        # advance - how much to advance the pen by vertically after drawing
-        yield int32(glyph.vertAdvance)  # 4 bytes
+    num = 0; count = len(glyphs) * max(0, len(glyphs) - 1)
 
+    for codepointL, indexL in glyphs:
+        rights = []; xs = []; xs_fine = []
 
-def kerning(result, modeID, setname, glyphset, cb):
-    fontID, size, antialias = result.modes[modeID]
-    font, face = result.fonts[fontID]
+        with lock:
+            # another thread may have set a different size since the last row
+            face.set_char_size(size_fp, 0, dpi, 0)
 
-    size_fp = int(size * 64.0)  # convert to fixed point 26.6 format
-    dpi = 72  # typographic DPI where 1pt = 1px
-    face.set_char_size(size_fp, 0, dpi, 0)
+            for codepointR, indexR in glyphs:
+                if codepointL == codepointR: continue
+                num += 1; cb.step(num, count)
 
-    if not face.has_kerning:
-        yield b'KERN'
-        raise StopIteration
+                # the grid-fitted offset is the unfitted offset rounded, so it
+                # can only be non-zero if the unfitted offset is
+                kerning_fine = face.get_kerning(indexL, indexR, freetype.FT_KERNING_UNFITTED)
+                if not kerning_fine.x: continue
+                kerning = face.get_kerning(indexL, indexR)
 
-    # GLYPH SET HEADER - 4 bytes
-    yield b"KERN"                       # r+0 | 4 | debugging marker
+                rights.append(codepointR)
+                xs.append(kerning.x) # NOTE already in FP26.6
+                xs_fine.append(kerning_fine.x) # NOTE already in FP26.6
+
+                # TODO could probably use only one of these
 
-    cb.stage("Gathering kerning data for font %s %s %s, table %s" \
-        % (repr(font), size, 'AA' if antialias else 'noAA', repr(setname)))
+        if not rights: continue
+        stats['records'] += len(rights)
 
-    combinations = list(itertools.permutations(glyphset, 2))
-    num = 0; count = len(combinations)
+        # records - 16 bytes each, see KERN_RECORD
+        fp.write(records(KERN_RECORD, {
+            'left': [codepointL] * len(rights), 'right': rights, 'x': xs, 'x_fine': xs_fine,
+        }).tobytes())
 
-    # record - 16 bytes
-    for codepointL, codepointR in sorted(combinations):
-        num += 1; cb.step(num, count)
+    stats['pairs'] = count
 
-        #  0 | 4 | uint32 Unicode Codepoint of left glyph in kerning pair
-        #  4 | 4 | uint32 Unicode Codepoint of right glyph in kerning pair
-        #  8 | 4 | (floating point 26.6; divide by 64.0) grid-fitted offset x (pixels)
-        # 12 | 4 | (floating point 26.6; divide by 64.0) non-grid-fitted offset x (pixels)
 
-        indexL = face.get_char_index(codepointL)
-        indexR = face.get_char_index(codepointR)
-        kerning = face.get_kerning(indexL, indexR)
-        kerning_fine = face.get_kerning(indexL, indexR, freetype.FT_KERNING_UNFITTED)
-        if kerning.x or kerning_fine.x:
-            yield uint32(indexL)
-            yield uint32(indexR)
-            yield int32(kerning.x) # NOTE already in FP26.6
-            yield int32(kerning_fine.x) # NOTE already in FP26.6
+def kerning(result, modeID, setname):
+    # GLYPH SET HEADER - 4 bytes
+    yield b"KERN"                       # r+0 | 4 | debugging marker
 
-            # TODO could probably use only one of these
+    # records - 16 bytes each, see KERN_RECORD
+    # (gathered by pack into a temporary file, while other stages were running)
+    fp = result.kerning[(modeID, setname)]
+    fp.seek(0)
+    while True:
+        chunk = fp.read(1 << 16)
+        if not chunk: break
+        yield chunk
 
 
 def notes(result):
@@ -323,7 +404,11 @@ def notes(result):
     def mode_notes(mode):
         fontID, size, antialias = mode
         name, face = result.fonts[fontID]
-        return "    (%s, %s, %s)," % (repr(name), size, "True" if antialias else "False")
+        if antialias == bf3.SDF:
+            antialias = "bakefont3.SDF"
+        else:
+            antialias = "True" if antialias else "False"
+        return "    (%s, %s, %s)," % (repr(name), size, antialias)
 
     notes = """
 
@@ -348,20 +433,61 @@ modes = [
 
 
 
-def all(result, cb):
+def write(result, fp, cb):
+    """
+    Write a complete bakefont3 file to `fp`, a binary file-like object with
+    seek and tell methods.
+
+    GLYPHSET and KERNING structures are variable length and located at a
+    dynamic offset, so the GLYPH TABLE is first written with placeholder
+    offsets, and back-patched once every structure has been written. Only
+    one structure is held in memory at a time.
+    """
+    start = fp.tell()
+
     preambleBytesize = 24 + \
                        8 + (48 * len(result.fonts)) + \
                        8 + (32 * len(result.modes)) + \
                        8 + (40 * len(result.modeTable))
 
-    _header  = b''.join(header(result, preambleBytesize))
-    _fonts   = b''.join(fonts(result))
-    _modes   = b''.join(modes(result))
-    _index   = b''.join(index(result, preambleBytesize, cb))
-    _notes   = b''.join(notes(result))
-
-    yield _header
-    yield _fonts
-    yield _modes
-    yield _index
-    yield _notes
+    def write_all(chunks):
+        for chunk in chunks:
+            fp.write(chunk)
+
+    write_all(header(result, preambleBytesize))
+    write_all(fonts(result))
+    write_all(modes(result))
+    write_all(index(result))
+
+    tableOffset = fp.tell()
+    for modeID, charsetname, glyphs in result.modeTable:
+        write_all(table(modeID, charsetname, (0, 0), (0, 0)))
+
+    assert (fp.tell() - start) == preambleBytesize
+
+    locations = []
+    for modeID, charsetname, glyphs in result.modeTable:
+        offset = fp.tell() - start
+        write_all(glyphset(result, modeID))
+        metrics = (offset, fp.tell() - start - offset)
+
+        offset = fp.tell() - start
+        write_all(kerning(result, modeID, charsetname))
+        kern = (offset, fp.tell() - start - offset)
+
+        locations.append((metrics, kern))
+
+    write_all(notes(result))
+    end = fp.tell()
+
+    # back-patch the glyph table
+    fp.seek(tableOffset)
+    for (modeID, charsetname, glyphs), (metrics, kern) in zip(result.modeTable, locations):
+        write_all(table(modeID, charsetname, metrics, kern))
+    fp.seek(end)
+
+
+def all(result, cb):
+    fp = io.BytesIO()
+    write(result, fp, cb)
+    yield fp.getvalue()
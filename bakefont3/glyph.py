@@ -2,17 +2,44 @@ import bakefont3 as bf3
 from PIL import Image
 import numpy as np
 import freetype
-import copy
+
+
+# use as the `antialias` value of a font mode to bake a signed distance field
+SDF = "sdf"
+
+# a SDF is computed from a bitmap rendered at this many times the mode size
+SDF_OVERSAMPLE = 4
 
 
 class Render(bf3.Cube):
+    """
+    A rasterised glyph: a (height, width) numpy array of coverage (or None
+    for an empty glyph, e.g. a space) and its metrics.
+
+    With finish=False, a signed distance field isn't computed until
+    `finish()` is called, so that the caller can release a lock on the font
+    face first: only the FreeType calls need one.
+    """
+
     __slots__ = [
-        'image', 'bitmap_left', 'bitmap_top',
+        'coverage', 'bitmap_left', 'bitmap_top',
         'horiBearingX', 'horiBearingY', 'horiAdvance',
-        'vertBearingX', 'vertBearingY', 'vertAdvance'
+        'vertBearingX', 'vertBearingY', 'vertAdvance',
+        'outline'
     ]
 
-    def __init__(self, ftFace, codepoint, antialias=True):
+    @property
+    def image(self):
+        if self.coverage is None: return None
+        return Image.fromarray(self.coverage, mode="L")
+
+    def __init__(self, ftFace, codepoint, antialias=True, size=None, spread=4, finish=True):
+        self.outline = None
+
+        if antialias == SDF:
+            self._init_sdf(ftFace, codepoint, size, spread)
+            if finish: self.finish()
+            return
 
         if antialias:
             ftFace.load_char(codepoint)
@@ -31,30 +58,22 @@ class Render(bf3.Cube):
         src    = glyph.bitmap.buffer
 
         if (pitch < 0):
-            raise NotImplemented("TODO handle negative pitch")
+            raise NotImplementedError("negative bitmap pitch is not supported")
 
         if (width > 0) and (height > 0):
-            arr = np.zeros(shape=(height, width), dtype=np.uint8)
+            rows = np.array(src[:pitch * height], dtype=np.uint8).reshape((height, pitch))
 
             if antialias:
-                for y in range(height):
-                    for x in range(width):
-                        pixel = src[x + (y * pitch)]
-                        arr[y, x] = pixel
+                arr = np.ascontiguousarray(rows[:, :width])
             else:
-                for y in range(height):
-                    for x in range(width):
-                        index = int(x/8) + (y * pitch)
-                        pixel = src[index]
-                        mask = 0x1 << (7 - (x % 8))
-                        pixel &= mask
-                        if pixel: arr[y, x] = 255
+                # 1 bit per pixel, most significant bit first
+                arr = np.unpackbits(rows, axis=1)[:, :width] * np.uint8(255)
 
             super().__init__(0, 0, 0, width, height, 1)
-            self.image = Image.fromarray(arr, mode="L")
+            self.coverage = arr
         else:
             super().__init__(0, 0, 0, 0, 0, 0)
-            self.image = None
+            self.coverage = None
 
         # get bitmap_*, metrics, etc
         self.bitmap_left  = glyph.bitmap_left
@@ -67,20 +86,222 @@ class Render(bf3.Cube):
         self.vertAdvance  = glyph.metrics.vertAdvance
 
 
-class Glyph(bf3.Cube):
-    __slots__ = ['codepoint', 'render']
+    def _init_sdf(self, ftFace, codepoint, size, spread):
+        """
+        A single-channel signed distance field: 128 on the outline, 255 at
+        `spread` pixels (or more) inside it, and 0 at `spread` pixels (or more)
+        outside it. Metrics are unhinted, for scaling to any size.
+        """
+        scale = SDF_OVERSAMPLE
+
+        # unhinted metrics at the mode size
+        ftFace.load_char(codepoint, flags=freetype.FT_LOAD_NO_HINTING)
+        glyph = ftFace.glyph
+        self.horiBearingX = glyph.metrics.horiBearingX
+        self.horiBearingY = glyph.metrics.horiBearingY
+        self.horiAdvance  = glyph.metrics.horiAdvance
+        self.vertBearingX = glyph.metrics.vertBearingX
+        self.vertBearingY = glyph.metrics.vertBearingY
+        self.vertAdvance  = glyph.metrics.vertAdvance
+
+        # oversampled bitmap to measure distances from
+        ftFace.set_char_size(int(size * 64.0 * scale), 0, 72, 0)
+        try:
+            flags = freetype.FT_LOAD_RENDER | freetype.FT_LOAD_NO_HINTING
+            ftFace.load_char(codepoint, flags=flags)
+            glyph  = ftFace.glyph
+            width  = glyph.bitmap.width
+            height = glyph.bitmap.rows
+            pitch  = glyph.bitmap.pitch
+            left   = glyph.bitmap_left
+            top    = glyph.bitmap_top
+            src    = np.array(glyph.bitmap.buffer, dtype=np.uint8)
+        finally:
+            ftFace.set_char_size(int(size * 64.0), 0, 72, 0)
+
+        if (pitch < 0):
+            raise NotImplementedError("negative bitmap pitch is not supported")
+
+        super().__init__(0, 0, 0, 0, 0, 0)
+        self.coverage = None
+        self.bitmap_left = 0
+        self.bitmap_top = 0
+
+        if not ((width > 0) and (height > 0)):
+            return
+
+        inside = src.reshape((height, pitch))[:, :width] >= 128
+        self.outline = (inside, left, top, spread)
+
+    def finish(self):
+        """Compute a pending signed distance field (no FreeType calls)"""
+        if self.outline is None: return
+        inside, left, top, spread = self.outline
+        self.outline = None
+
+        scale = SDF_OVERSAMPLE
+        height, width = inside.shape
+
+        # outline pixels: inside pixels next to an outside pixel
+        padded = np.pad(inside, 1, mode='constant', constant_values=False)
+        interior = padded[:-2, 1:-1] & padded[2:, 1:-1] & padded[1:-1, :-2] & padded[1:-1, 2:]
+        rows, cols = np.nonzero(inside & ~interior)
+        edges_x = left + cols + 0.5 # oversampled pixels, upwards y +ve
+        edges_y = top - rows - 0.5
+
+        # the distance field in pixels at the mode size, with room for spread
+        sdf_left = (left // scale) - spread
+        sdf_top = -((-top) // scale) + spread # ceil
+        sdf_width = -((-(left + width)) // scale) + spread - sdf_left
+        sdf_height = sdf_top - ((top - height) // scale) + spread
+
+        # sample at the centre of each pixel
+        sample_x = (sdf_left + np.arange(sdf_width) + 0.5) * scale
+        sample_y = (sdf_top - np.arange(sdf_height) - 0.5) * scale
+        sample_x, sample_y = np.meshgrid(sample_x, sample_y)
+        sample_x = sample_x.ravel()
+        sample_y = sample_y.ravel()
+
+        distance = np.full(sample_x.shape, np.inf)
+        if len(edges_x):
+            chunk = max(1, (1 << 20) // len(edges_x))
+            for start in range(0, len(sample_x), chunk):
+                dx = sample_x[start:start+chunk, None] - edges_x[None, :]
+                dy = sample_y[start:start+chunk, None] - edges_y[None, :]
+                distance[start:start+chunk] = np.sqrt(np.min((dx * dx) + (dy * dy), axis=1))
+
+        # which samples are inside the outline?
+        col = np.floor(sample_x - left).astype(int)
+        row = np.floor(top - sample_y).astype(int)
+        valid = (col >= 0) & (col < width) & (row >= 0) & (row < height)
+        sign = np.full(sample_x.shape, -1.0)
+        sign[valid] = np.where(inside[row[valid], col[valid]], 1.0, -1.0)
+
+        # the outline is half a pixel beyond the centre of an outline pixel
+        distance = ((sign * distance) + 0.5) / scale # pixels at the mode size
+        value = 128.0 + ((distance * 127.0) / spread)
+        arr = np.clip(np.rint(value), 0, 255).astype(np.uint8)
+        arr = arr.reshape((sdf_height, sdf_width))
+
+        super().__init__(0, 0, 0, sdf_width, sdf_height, 1)
+        self.coverage = arr
+        self.bitmap_left = sdf_left
+        self.bitmap_top = sdf_top
+
+
+# One record per glyph in an Arena
+GLYPH = np.dtype([
+    ('codepoint',    'u4'),
+    ('mode',         'u2'),
+    ('offset',       'u8'), # of the coverage bitmap in Arena.pixels
+    ('width',        'u2'), # of the coverage bitmap
+    ('height',       'u2'),
+    ('bitmap_left',  'i4'),
+    ('bitmap_top',   'i4'),
+    ('horiBearingX', 'i4'), # (FP26.6)
+    ('horiBearingY', 'i4'),
+    ('horiAdvance',  'i4'),
+    ('vertBearingX', 'i4'),
+    ('vertBearingY', 'i4'),
+    ('vertAdvance',  'i4'),
+    ('x0',           'u4'), # position in the texture atlas, once fitted
+    ('y0',           'u4'),
+    ('z0',           'u2'),
+    ('depth',        'u1'), # 1 if placed in the texture atlas, otherwise 0
+])
+
+
+class Arena:
+    """
+    Contiguous storage for every rendered glyph: the coverage bitmaps are
+    packed one after another into a single array of bytes, and the metrics
+    and texture atlas positions are a numpy structured array of GLYPH
+    records. Both grow by doubling.
+
+    This avoids holding a Python object and an image per glyph, and lets
+    passes over every glyph (sorting, fitting) work on whole columns.
+    """
+
+    def __init__(self, capacity=1024):
+        self.count = 0
+        self.used = 0
+        self.records = np.zeros(capacity, dtype=GLYPH)
+        self.pixels = np.zeros(capacity * 64, dtype=np.uint8)
+
+    @property
+    def glyphs(self):
+        """The GLYPH records in use (a view)"""
+        return self.records[:self.count]
+
+    def add(self, codepoint, modeID, render):
+        """Copy a Render into the arena, returning its index"""
+        if self.count == len(self.records):
+            self.records = np.resize(self.records, len(self.records) * 2)
+
+        size = render.width * render.height
+        if self.used + size > len(self.pixels):
+            pixels = np.zeros(max(len(self.pixels) * 2, self.used + size), dtype=np.uint8)
+            pixels[:self.used] = self.pixels[:self.used]
+            self.pixels = pixels
+
+        if size:
+            self.pixels[self.used:self.used + size] = render.coverage.ravel()
+
+        index = self.count
+        self.records[index] = (
+            codepoint, modeID, self.used, render.width, render.height,
+            render.bitmap_left, render.bitmap_top,
+            render.horiBearingX, render.horiBearingY, render.horiAdvance,
+            render.vertBearingX, render.vertBearingY, render.vertAdvance,
+            0, 0, 0, 0)
+
+        self.count += 1
+        self.used += size
+        return index
+
+    def coverage(self, index):
+        """A (height, width) view of a glyph's coverage, or None if empty"""
+        record = self.records[index]
+        width = int(record['width'])
+        height = int(record['height'])
+        if not (width and height): return None
+
+        offset = int(record['offset'])
+        return self.pixels[offset:offset + (width * height)].reshape((height, width))
+
+
+class Glyph:
+    """A lightweight view of one glyph in an Arena"""
+
+    __slots__ = ['arena', 'index']
+
+    def __init__(self, arena, index):
+        self.arena = arena
+        self.index = index
 
     def __getattr__(self, attr):
-        return getattr(self.render, attr)
+        if attr in GLYPH.names:
+            return self.arena.records[self.index][attr].item()
+        raise AttributeError(attr)
 
     @property
     def char(self):
         return chr(self.codepoint)
 
-    def __init__(self, codepoint, render):
-        assert isinstance(codepoint, int) # unicode value
-        assert isinstance(render, Render)
+    @property
+    def coverage(self):
+        return self.arena.coverage(self.index)
 
-        super().__init__(0, 0, 0, 0, 0, 0)
-        self.codepoint = codepoint
-        self.render = render
+    @property
+    def image(self):
+        coverage = self.coverage
+        if coverage is None: return None
+        return Image.fromarray(coverage, mode="L")
+
+    # bounding box in the texture atlas
+    @property
+    def x1(self): return self.x0 + self.width
+    @property
+    def y1(self): return self.y0 + self.height
+    @property
+    def z1(self): return self.z0 + self.depth
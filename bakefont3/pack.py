@@ -1,20 +1,45 @@
 import bakefont3 as bf3
 import bakefont3.encode
+import bakefont3.png
+import bakefont3.trace
 import unicodedata
+import os
+import shutil
+import tempfile
+import itertools
+import functools
+import time
+import threading
+import collections
+from concurrent.futures import ProcessPoolExecutor, ThreadPoolExecutor
 from PIL import Image
 import numpy as np
 
 
 class Saveable:
-    def __init__(self, data):
-        self.data = data
+    """
+    The binary bakefont3 data for a result. It is encoded once, when pack
+    reaches the "Generating binary" stage, into an anonymous temporary file
+    instead of memory. `save` copies that file, and `bytes` reads it in (once).
+    """
+
+    def __init__(self, result, cb):
+        self.lock = threading.Lock()
+        self.file = tempfile.TemporaryFile()
+        self.data = None
+        bakefont3.encode.write(result, self.file, cb)
 
     def bytes(self):
-        return self.data
+        with self.lock:
+            if self.data is None:
+                self.file.seek(0)
+                self.data = self.file.read()
+            return self.data
 
     def save(self, filename):
-        with open(filename, 'wb') as fp:
-            fp.write(self.data)
+        with self.lock, open(filename, 'wb') as fp:
+            self.file.seek(0)
+            shutil.copyfileobj(self.file, fp)
 
 
 class _default_cb:
@@ -42,20 +67,75 @@ class pack:
             if (name, size, antialias) == mode: return index
         raise ValueError
 
-    def __init__(self, fonts, tasks, sizes, cb=_default_cb()):
+    @property
+    def allGlyphs(self):
+        """A list of views of every glyph (see also self.arena)"""
+        return [bf3.Glyph(self.arena, index) for index in range(self.arena.count)]
+
+    def tiles(self, rows=256):
+        """
+        Yield (y, pixels) for each band of `rows` rows of the texture atlas,
+        where pixels is a (rows, width, depth) array of bytes.
+        """
+        height = self.size[1]
+        for y in range(0, height, rows):
+            yield y, self.atlas[y:y+rows]
+
+    def save_png(self, filename, rows=256):
+        """Save the texture atlas as a PNG file, one band of rows at a time"""
+        with open(filename, 'wb') as fp:
+            bakefont3.png.write(fp, self.size, self.tiles(rows))
+
+    def __init__(self, fonts, tasks, sizes, cb=_default_cb(), search="linear", workers=None,
+                 dedupe=True, bits=8, dither=False, spread=4, atlasfile=None, threads=None,
+                 trace=None):
         self.data = None
         self.image = None
+        self.atlas = None
         self.size = (0, 0, 0)
 
         """
         :param fonts: a mapping font name => font face
         :param tasks: a list of (mode, charset name, charset) tuples, where
                       mode is a tuple (font name, size, antialias?)
+                      and antialias is True, False, or bakefont3.SDF to
+                      bake a signed distance field at that reference size
         :param sizes: a (possibly infinite) sequence of sizes to try
         :param cb:    a callback object with methods `stage(self, msg)` and
                       `step(self, current, total)`, `info(self, msg)`.
+        :param search: how to find a size that fits:
+                      "linear" - try every size in order, use the first fit
+                      "bisect" - assume that if a size fits, every size after
+                      it fits too (e.g. `bakefont3.sizes.squares`) and do a
+                      galloping binary search for the first fit
+        :param workers: number of worker processes used to try several
+                      candidate sizes at once (default: one, no processes)
+        :param dedupe: if True, glyphs with identical bitmaps share the same
+                      space in the texture atlas
+        :param bits:  bits per pixel for each glyph in the texture atlas:
+                      8 - each glyph uses a whole colour channel
+                      4 - each colour channel holds 2 glyphs, with coverage
+                          quantised to 16 levels
+                      1 - each colour channel holds 8 glyphs as bit planes
+                          (every font mode must have antialias=False)
+        :param dither: if True, quantise coverage for bits=4 with an ordered
+                      dither instead of rounding to the nearest level
+        :param spread: for SDF font modes, the distance in pixels (at the
+                      reference size) from the outline to full coverage
+        :param atlasfile: if given, compose the texture atlas directly into
+                      a memory-mapped file of this name (raw pixels) instead
+                      of in memory - for very large atlases
+        :param threads: number of threads used to render glyphs and gather
+                      kerning data in a pipeline alongside the other stages
+                      (default: one per CPU). With 1, every stage runs in
+                      turn on the calling thread. The result is the same.
+        :param trace: a bakefont3.trace.Trace to record the time, CPU time and
+                      memory use of each stage, font mode and fit attempt
         """
 
+        if trace is None: trace = bakefont3.trace.NoTrace()
+        cb = trace.callback(cb)
+
         # capture args just once if they're generated
         fonts = dict(fonts)
         tasks = list(tasks)
@@ -87,6 +167,26 @@ class pack:
             assert name in fonts, "font mode references a missing font name"
 
 
+        if bits not in (8, 4, 1):
+            raise ValueError("Invalid bits (expected 8, 4, 1) got %s" % repr(bits))
+
+        if bits == 1:
+            for (name, size, antialias), _, _ in tasks:
+                if antialias:
+                    raise ValueError("bits=1 needs antialias=False for every font mode")
+
+        if bits < 8:
+            for (name, size, antialias), _, _ in tasks:
+                if antialias == bf3.SDF:
+                    raise ValueError("SDF font modes need bits=8")
+
+        assert 0 < spread < 128
+        self.spread = spread
+
+        # number of glyph layers stored in each colour channel of the atlas
+        layers = 8 // bits
+        self.bits = bits
+
         # convert parameters for use in lookup tables
 
         # construct a mapping font ID => (font name, font face)
@@ -103,7 +203,8 @@ class pack:
             mode = (fontID, size, antialias)
             if mode not in modelist:
                 modelist.append(mode)
-        modelist = sorted(modelist) # by ascending fontID, size
+        # by ascending fontID, size (and noAA, AA, SDF)
+        modelist = sorted(modelist, key=lambda mode: (mode[0], mode[1], str(mode[2])))
         self.modes = modelist
 
         # construct a concrete list of tasks
@@ -140,185 +241,578 @@ class pack:
         # ---------------------------------------------------------------------
         cb.stage("Rendering Glyphs")
         # ---------------------------------------------------------------------
-        count = 0
+        if threads is None: threads = os.cpu_count() or 1
+        assert threads >= 1
+
+        # FreeType faces aren't thread safe, and every font mode sharing a
+        # face sets its own char size on it, so only one thread uses a face
+        # at a time (even if it appears under two font names)
+        faceLocks = dict()
+        locks = [faceLocks.setdefault(id(face), threading.Lock()) for _, face in self.fonts]
+
+        # glyphs are rendered in chunks of codepoints, in the same order as
+        # they would be one at a time so that the result is the same
+        chunks = []
         numglyphs = 0
         for modeID, charset in modeChars.items():
-            numglyphs += len(charset)
-
-        modeGlyphs = dict()
-        for modeID, charset in modeChars.items():
-            glyphset = dict()
-
-            fontID, size, antialias = self.modes[modeID]
-            fontname, face = self.fonts[fontID]
-
-            size_fp = int(size * 64.0) # convert to fixed point 26.6 format
-            dpi = 72 # typographic DPI where 1pt = 1px
-            face.set_char_size(size_fp, 0, dpi, 0)
-
+            codepoints = []
             for char in charset:
-                cb.step(count, numglyphs); count += 1
-
                 if isinstance(char, str) and len(char) == 1:
-                    codepoint = ord(char)
+                    codepoints.append(ord(char))
                 elif isinstance(char, int) and 0 <= char <= 2**32:
-                    codepoint = char
+                    codepoints.append(char)
                 else:
                     raise TypeError("Invalid codepoint in charset")
 
-                if face.get_char_index(codepoint):
-                    render = bf3.Render(face, codepoint, antialias)
-                    glyphset[codepoint] = bf3.Glyph(codepoint, render)
-                else:
-                    print("notice: font %s doesn't include codepoint %#x / %s (%s)" %
-                          (repr(fontname), codepoint, repr(chr(codepoint)), unicodedata.name(chr(codepoint), "unknown name")))
+            numglyphs += len(codepoints)
+            for start in range(0, len(codepoints), _CHUNK):
+                chunks.append((modeID, codepoints[start:start+_CHUNK]))
+
+        # the last chunk of each mode, after which its kerning can be gathered
+        lastChunk = {modeID: index for index, (modeID, _) in enumerate(chunks)}
 
-            modeGlyphs[modeID] = glyphset
+        # every rendered glyph is stored in one arena
+        arena = bf3.Arena(max(numglyphs, 1))
+        self.arena = arena
 
+        # a mapping fontmode ID => (a mapping codepoint => arena index)
+        modeGlyphs = {modeID: dict() for modeID in modeChars}
         self.modeGlyphs = modeGlyphs
 
-        # make a list of all glyph objects, for fitting
-        allGlyphs = []
-        for _, glyphset in modeGlyphs.items():
-            for _, glyph in glyphset.items():
-                allGlyphs.append(glyph)
-        self.allGlyphs = allGlyphs
+        # a mapping (fontmode ID, charsetname) => temporary file of kerning records
+        self.kerning = dict()
+        kerning = [] # (modeID, name, future)
 
-        # ---------------------------------------------------------------------
-        cb.stage("Fitting Glyphs")
-        # ---------------------------------------------------------------------
+        def submit_kerning(modeID):
+            for tableModeID, name, charset in modeTable:
+                if tableModeID == modeID:
+                    future = pool.submit(kern_table, modeID, name, charset, _default_cb())
+                    kerning.append((modeID, name, future))
 
-        # sort by height for packing - good heuristic
-        allGlyphs.sort(key=lambda glyph: glyph.render.height, reverse=True)
-
-        # estimate area for best-case smallest area with 100% packing efficiency
-        minVolume = 0
-        for glyph in allGlyphs:
-            minVolume += glyph.render.width * glyph.render.height;
-
-        # attempt a fit for each size
-        count = 0
-        for size in sizes:
-            cb.step(0, len(allGlyphs))
-
-            width, height, depth = size
-            volume = width * height * depth
-            if minVolume > volume:
-                cb.info("Early discard for size %s" % repr(size))
-                continue # skip this size
-
-            if _fit(size, allGlyphs, cb):
-                self.size = size
-                break
+        def mode_name(modeID):
+            fontID, size, antialias = self.modes[modeID]
+            return repr((self.fonts[fontID][0], size, antialias))
+
+        def render_chunk(modeID, codepoints):
+            fontID, _, _ = self.modes[modeID]
+            _, face = self.fonts[fontID]
+            with trace.span("render", "render", mode=mode_name(modeID), glyphs=len(codepoints)) as args:
+                return _render(face, trace.timed_lock(locks[fontID], args), self.modes[modeID], codepoints, spread)
+
+        def kern_table(modeID, name, charset, cb):
+            fontID, size, _ = self.modes[modeID]
+            _, face = self.fonts[fontID]
+            # spooled to a temporary file, so that only one row of kerning
+            # records is in memory at a time
+            fp = tempfile.TemporaryFile()
+            with trace.span("kerning %s" % name, "kerning", mode=mode_name(modeID), table=name) as stats:
+                bakefont3.encode.kernpairs(face, size, charset, fp, cb, stats, trace.timed_lock(locks[fontID], stats))
+            return fp
+
+        pool = ThreadPoolExecutor(max_workers=threads) if threads > 1 else None
+        try:
+            jobs = (functools.partial(render_chunk, modeID, codepoints) for modeID, codepoints in chunks)
+
+            # the arena is filled on this thread, in order, as chunks come
+            # back from the bounded queue of rendering jobs
+            count = 0
+            for index, renders in enumerate(_pipeline(pool, jobs, threads * 2)):
+                modeID, _ = chunks[index]
+                fontID, _, _ = self.modes[modeID]
+                fontname, _ = self.fonts[fontID]
+
+                for codepoint, render in renders:
+                    cb.step(count, numglyphs); count += 1
+
+                    if render:
+                        modeGlyphs[modeID][codepoint] = arena.add(codepoint, modeID, render)
+                    else:
+                        print("notice: font %s doesn't include codepoint %#x / %s (%s)" %
+                              (repr(fontname), codepoint, repr(chr(codepoint)), unicodedata.name(chr(codepoint), "unknown name")))
+
+                # with a pool, gather kerning for a mode while later modes are
+                # still rendering, and while glyphs are fitted and composed
+                if pool and (lastChunk[modeID] == index):
+                    submit_kerning(modeID)
+
+            if pool:
+                for modeID in modeChars:
+                    if modeID not in lastChunk: submit_kerning(modeID) # empty charset
+
+            self._atlas(arena, sizes, cb, search, workers, dedupe, layers, bits, dither, atlasfile, trace)
+
+            # -----------------------------------------------------------------
+            cb.stage("Gathering kerning data")
+            # -----------------------------------------------------------------
+
+            if pool:
+                for num, (modeID, name, future) in enumerate(kerning):
+                    cb.step(num, len(kerning))
+                    self.kerning[(modeID, name)] = future.result()
             else:
-                cb.info("No fit for size %s" % repr(size))
-                continue
+                for modeID, name, charset in modeTable:
+                    fontID, size, antialias = self.modes[modeID]
+                    fontname, _ = self.fonts[fontID]
+                    cb.stage("Gathering kerning data for font %s %s %s, table %s" \
+                        % (repr(fontname), size, 'SDF' if antialias == bf3.SDF else 'AA' if antialias else 'noAA',
+                           repr(name)))
+                    self.kerning[(modeID, name)] = kern_table(modeID, name, charset, cb)
+        finally:
+            if pool: pool.shutdown(cancel_futures=True)
 
         # ---------------------------------------------------------------------
-        cb.stage("Composing Texture Atlas")
+        cb.stage("Generating binary")
         # ---------------------------------------------------------------------
 
+        # (into a temporary file, so that the file isn't held in memory)
         if self.size[0]:
-            self.image = _image(self.size, allGlyphs)
+            self.data = Saveable(self, cb)
+
+        for fp in self.kerning.values():
+            fp.close()
 
         # ---------------------------------------------------------------------
-        cb.stage("Generating binary")
+        cb.stage("Done")
         # ---------------------------------------------------------------------
+        trace.end()
 
-        if self.size[0]:
-            self.data = Saveable(b''.join(bakefont3.encode.all(self, cb)))
+
+    def _atlas(self, arena, sizes, cb, search, workers, dedupe, layers, bits, dither, atlasfile, trace):
+        """Fit the rendered glyphs into a texture atlas, and compose it"""
 
         # ---------------------------------------------------------------------
-        cb.stage("Done")
+        cb.stage("Fitting Glyphs")
+        # ---------------------------------------------------------------------
+
+        glyphs = arena.glyphs
+
+        # sort by height for packing - good heuristic
+        # (stable, so that equal heights stay in the order they were rendered)
+        allGlyphs = np.argsort(-glyphs['height'].astype(np.int64), kind='stable')
+
+        # identical bitmaps (e.g. "A", Greek "Α" and Cyrillic "А" in the same
+        # mode) only need to take up space in the texture atlas once
+        if dedupe:
+            uniqueGlyphs, copies = _dedupe(arena, allGlyphs)
+            if len(copies):
+                cb.info("%d glyphs share a bitmap with another glyph" % len(copies))
+        else:
+            uniqueGlyphs, copies = allGlyphs, np.zeros((0, 2), dtype=np.int64)
+
+        # the dimensions of each glyph, in the same order as uniqueGlyphs, in
+        # a form that's cheap to send to worker processes
+        dims = list(zip(glyphs['width'][uniqueGlyphs].tolist(),
+                        glyphs['height'][uniqueGlyphs].tolist()))
+
+        if search == "linear":
+            fit = _search_linear(sizes, dims, layers, cb, workers, trace)
+        elif search == "bisect":
+            fit = _search_bisect(sizes, dims, layers, cb, workers, trace)
+        else:
+            raise ValueError("Invalid search (expected 'linear', 'bisect') got %s" % repr(search))
+
+        if fit:
+            self.size, fits = fit
+            _place(self.size, arena, uniqueGlyphs, fits, layers)
+
+            glyph, original = copies[:, 0], copies[:, 1]
+            for field in ('x0', 'y0', 'z0', 'depth'):
+                glyphs[field][glyph] = glyphs[field][original]
+
+        # ---------------------------------------------------------------------
+        cb.stage("Composing Texture Atlas")
         # ---------------------------------------------------------------------
 
+        if self.size[0]:
+            self.atlas = _compose(self.size, arena, uniqueGlyphs, bits, dither, atlasfile)
+            self.image = _image(self.atlas)
+
+
+# number of glyphs rendered by each job
+_CHUNK = 64
+
+
+def _render(face, lock, mode, codepoints, spread):
+    """
+    Render each codepoint for a font mode, returning a list of (codepoint,
+    Render) pairs, or (codepoint, None) for codepoints the font doesn't have.
+    The face is only locked for the FreeType calls.
+    """
+    fontID, size, antialias = mode
+    renders = []
+
+    with lock:
+        size_fp = int(size * 64.0) # convert to fixed point 26.6 format
+        dpi = 72 # typographic DPI where 1pt = 1px
+        face.set_char_size(size_fp, 0, dpi, 0)
 
-def _fit(size, glyphs, cb):
-    if not glyphs: return True
+        for codepoint in codepoints:
+            if face.get_char_index(codepoint):
+                render = bf3.Render(face, codepoint, antialias, size, spread, finish=False)
+            else:
+                render = None
+            renders.append((codepoint, render))
+
+    for codepoint, render in renders:
+        if render: render.finish()
+
+    return renders
+
+
+def _pipeline(pool, jobs, depth):
+    """
+    Run each job (a function with no arguments) on a pool of threads,
+    yielding the results in order, with no more than `depth` jobs queued or
+    running at once. Without a pool, run each job in turn.
+    """
+    if pool is None:
+        for job in jobs:
+            yield job()
+        return
+
+    queue = collections.deque()
+    for job in jobs:
+        if len(queue) >= depth:
+            yield queue.popleft().result()
+        queue.append(pool.submit(job))
+
+    while queue:
+        yield queue.popleft().result()
+
+
+def _dedupe(arena, indexes):
+    """
+    Returns (unique, copies), where `unique` is the array of glyph indexes
+    (in the same order) excluding any with the same bitmap as an earlier
+    glyph, and `copies` is a (n, 2) array of (index, earlier index) pairs for
+    the rest.
+    """
+    unique = []
+    copies = []
+    seen = dict() # (width, height, pixels) => index
+
+    for index in indexes.tolist():
+        coverage = arena.coverage(index)
+        if coverage is None:
+            unique.append(index)
+            continue
+
+        key = (coverage.shape, coverage.tobytes())
+        original = seen.get(key)
+        if original is None:
+            seen[key] = index
+            unique.append(index)
+        else:
+            copies.append((index, original))
+
+    return (np.array(unique, dtype=np.int64),
+            np.array(copies, dtype=np.int64).reshape((-1, 2)))
+
+
+def _bound(dims):
+    """
+    The volume of a best-case fit with 100% packing efficiency, and the
+    smallest width and height that could hold every glyph.
+    """
+    minVolume = 0
+    minWidth = 0
+    minHeight = 0
+
+    for width, height in dims:
+        minVolume += width * height
+        minWidth = max(minWidth, width)
+        minHeight = max(minHeight, height)
+
+    return minVolume, minWidth, minHeight
+
+
+def _candidates(sizes, dims, layers, cb):
+    """Yield each size that passes the cheap checks against the lower bound"""
+    minVolume, minWidth, minHeight = _bound(dims)
+
+    for size in sizes:
+        width, height, depth = size
+        volume = width * height * depth * layers
+        if (minVolume > volume) or (minWidth > width) or (minHeight > height):
+            cb.info("Early discard for size %s" % repr(size))
+            continue # skip this size
+
+        yield size
+
+
+def _search_linear(sizes, dims, layers, cb, workers, trace):
+    """Returns (size, fits) for the first size that fits, or None"""
+    candidates = _candidates(sizes, dims, layers, cb)
+
+    if not workers or workers < 2:
+        for size in candidates:
+            fits = _traced_fit(size, dims, layers, cb, trace)
+            if fits is not None: return size, fits
+            cb.info("No fit for size %s" % repr(size))
+        return None
+
+    # try the next `workers` sizes at once, keeping the order of preference
+    with ProcessPoolExecutor(max_workers=workers) as pool:
+        while True:
+            batch = list(itertools.islice(candidates, workers))
+            if not batch: return None
+
+            cb.info("Trying sizes %s" % ", ".join(map(repr, batch)))
+            futures = [pool.submit(_timed_fit, size, dims, layers) for size in batch]
+
+            for size, future in zip(batch, futures):
+                fits = _timed_result(future, size, dims, trace)
+                if fits is not None:
+                    for other in futures: other.cancel()
+                    return size, fits
+                cb.info("No fit for size %s" % repr(size))
+
+
+def _search_bisect(sizes, dims, layers, cb, workers, trace):
+    """
+    Returns (size, fits) for the first size that fits, or None, assuming
+    that `sizes` is monotone. Works for infinite sequences by galloping
+    (probing the 1st, 2nd, 4th, 8th... candidate) until a fit is found, then
+    searching between the last miss and that fit. With several workers, each
+    round probes that many evenly spaced candidates at once.
+    """
+    candidates = _candidates(sizes, dims, layers, cb)
+    known = [] # materialised candidates
+    results = {} # index => fits or None
+    workers = max(1, workers or 1)
+
+    def materialise(n):
+        while len(known) < n:
+            try:
+                known.append(next(candidates))
+            except StopIteration:
+                return False
+        return True
+
+    def probe(pool, indexes):
+        indexes = [i for i in indexes if i not in results]
+        if not indexes: return
+        cb.info("Trying sizes %s" % ", ".join(repr(known[i]) for i in indexes))
+
+        if pool:
+            futures = [pool.submit(_timed_fit, known[i], dims, layers) for i in indexes]
+            for i, future in zip(indexes, futures):
+                results[i] = _timed_result(future, known[i], dims, trace)
+        else:
+            for i in indexes:
+                results[i] = _traced_fit(known[i], dims, layers, cb, trace)
+
+        for i in indexes:
+            if results[i] is None: cb.info("No fit for size %s" % repr(known[i]))
+
+    def search(pool):
+        # gallop: find lo, hi such that known[lo-1] misses and known[hi] fits
+        lo = 0
+        hi = None
+        step = 1
+        while hi is None:
+            exhausted = not materialise(lo + (step * workers))
+            indexes = [lo + (step * (n + 1)) - 1 for n in range(workers)]
+            indexes = [i for i in indexes if i < len(known)]
+            if exhausted and (lo < len(known)) and ((len(known) - 1) not in indexes):
+                indexes.append(len(known) - 1) # don't skip the last few
+            if not indexes: return None
+            probe(pool, indexes)
+
+            fit = [i for i in indexes if results[i] is not None]
+            if fit:
+                hi = fit[0]
+                misses = [i for i in indexes if i < hi]
+                lo = (misses[-1] + 1) if misses else lo
+            elif exhausted:
+                return None
+            else:
+                lo = indexes[-1] + 1
+                step *= 2
+
+        # bisect: narrow the range (lo, hi) in rounds of `workers` probes
+        while lo < hi:
+            span = hi - lo
+            indexes = sorted(set(lo + ((span * (n + 1)) // (workers + 1)) for n in range(workers)))
+            indexes = [i for i in indexes if lo <= i < hi]
+            if not indexes: break
+            probe(pool, indexes)
+
+            for i in indexes:
+                if results[i] is None:
+                    lo = i + 1
+                else:
+                    hi = i
+                    break
+
+        return known[hi], results[hi]
+
+    if workers < 2:
+        return search(None)
+
+    with ProcessPoolExecutor(max_workers=workers) as pool:
+        return search(pool)
+
+
+def _fit(size, dims, layers=1, cb=_default_cb()):
+    """
+    Fit glyphs of the given (width, height) dimensions, sorted by descending
+    height, into a texture atlas of the given size with `layers` glyph layers
+    per colour channel. Returns a list of (x, y, z) positions in the same
+    order as `dims` (None for an empty glyph), or None if there was no fit.
+
+    This only uses picklable arguments and results so that it can run in a
+    worker process.
+    """
+    if not dims: return []
     width, height, depth = size
 
-    cube = bf3.Cube(0, 0, 0, width, height, depth)
+    cube = bf3.Cube(0, 0, 0, width, height, depth * layers)
     spaces = bf3.TernaryTree(cube)
 
     count = 0
-    num = len(glyphs)
+    num = len(dims)
+    fits = []
 
-    for glyph in glyphs:
+    for w, h in dims:
         cb.step(count, num); count+=1
 
-        if glyph.render.width and glyph.render.height:
-            fit = spaces.fit(glyph.render)
+        if w and h:
+            fit = spaces.fit(bf3.Cube(0, 0, 0, w, h, 1))
 
-            if not fit: return False
+            if not fit: return None
+            fits.append((fit.x0, fit.y0, fit.z0))
+        else:
+            fits.append(None)
 
-            glyph.x0 = fit.x0
-            glyph.y0 = fit.y0
-            glyph.z0 = fit.z0
-            glyph.x1 = fit.x0 + glyph.render.width
-            glyph.y1 = fit.y0 + glyph.render.height
-            glyph.z1 = fit.z0 + glyph.render.depth
+    return fits
 
-            # because we don't want people to think their image is broken,
-            # make sure the alpha channel has the most information
-            # by swapping red and alpha
-            if depth == 4 and glyph.z0 == 0:
-                glyph.z0 = 3
-                glyph.z1 = 4
-            elif depth == 4 and glyph.z0 == 3:
-                glyph.z0 = 0
-                glyph.z1 = 1
 
-    return True
+def _traced_fit(size, dims, layers, cb, trace):
+    """_fit on this thread, recording the attempt in a trace"""
+    with trace.span("fit %s" % repr(size), "fit", size=repr(size), glyphs=len(dims)) as args:
+        fits = _fit(size, dims, layers, cb)
+        args['fit'] = fits is not None
+    return fits
 
 
+def _timed_fit(size, dims, layers):
+    """_fit in a worker process, returning (fits, timing) for Trace.complete"""
+    start = time.perf_counter_ns()
+    cpu = time.thread_time_ns()
+    fits = _fit(size, dims, layers)
+    timing = (start, time.perf_counter_ns(), time.thread_time_ns() - cpu,
+              os.getpid(), threading.get_ident())
+    return fits, timing
 
-def _image(size, glyphs):
+
+def _timed_result(future, size, dims, trace):
+    """The result of _timed_fit, recording the attempt in a trace"""
+    fits, timing = future.result()
+    trace.complete("fit %s" % repr(size), "fit", timing,
+                   size=repr(size), glyphs=len(dims), fit=fits is not None)
+    return fits
+
+
+def _place(size, arena, indexes, fits, layers=1):
+    """
+    Set the texture atlas position of each glyph (by arena index) from the
+    result of _fit. With more than one layer per channel, z is
+    (channel * layers) + layer.
+    """
     width, height, depth = size
+    glyphs = arena.glyphs
 
-    # create a greyscale image for each channel i.e. z-layer
+    placed = [index for index, fit in zip(indexes.tolist(), fits) if fit is not None]
+    if not placed: return
+    xyz = np.array([fit for fit in fits if fit is not None], dtype=np.int64)
+
+    # because we don't want people to think their image is broken,
+    # make sure the alpha channel has the most information
+    # by swapping red and alpha
+    channel, layer = np.divmod(xyz[:, 2], layers)
     if depth == 4:
-        mode = 'RGBA'
-        channels = [
-            Image.new("L", (width, height), 0),
-            Image.new("L", (width, height), 0),
-            Image.new("L", (width, height), 0),
-            Image.new("L", (width, height), 0),
-        ]
-    elif depth == 3:
-        mode = 'RGB'
-        channels = [
-            Image.new("L", (width, height), 0),
-            Image.new("L", (width, height), 0),
-            Image.new("L", (width, height), 0),
-        ]
-    elif depth == 1:
-        # greyscale
-        channels = [
-            Image.new("L", (width, height), 0),
-        ]
+        channel = np.choose(channel, [3, 1, 2, 0])
+
+    glyphs['x0'][placed] = xyz[:, 0]
+    glyphs['y0'][placed] = xyz[:, 1]
+    glyphs['z0'][placed] = (channel * layers) + layer
+    glyphs['depth'][placed] = 1
+
+
+# 4x4 ordered dither thresholds, scaled to 0-255
+_BAYER4 = (((np.array([
+    [ 0,  8,  2, 10],
+    [12,  4, 14,  6],
+    [ 3, 11,  1,  9],
+    [15,  7, 13,  5],
+]) * 2) + 1) * 255) // 32
+
+
+def _quantise(coverage, bits, dither=False):
+    """Quantise 0-255 coverage to the nearest of 2**bits levels (or dither)"""
+    levels = (1 << bits) - 1
+    coverage = coverage.astype(np.uint16)
+
+    if dither:
+        height, width = coverage.shape
+        threshold = np.tile(_BAYER4, ((height + 3) // 4, (width + 3) // 4))
+        threshold = threshold[:height, :width]
     else:
+        threshold = 127
+
+    return (((coverage * levels) + threshold) // 255).astype(np.uint8)
+
+
+def _compose(size, arena, indexes, bits=8, dither=False, filename=None):
+    """
+    Write the coverage of each glyph (by arena index) into one interleaved
+    (height, width, depth) array of bytes: the texture atlas. If a filename is
+    given, the array is a memory-mapped file of raw pixels instead of being
+    in memory.
+
+    With bits less than 8, each colour channel holds (8 / bits) glyph layers,
+    where a glyph with z = (channel * layers) + layer has its coverage stored
+    in bits (layer * bits) to ((layer + 1) * bits) - 1 of that channel.
+    """
+    width, height, depth = size
+    layers = 8 // bits
+
+    if depth not in (1, 3, 4):
         raise ValueError("Invalid depth for image (expected 1, 3, 4) got %d" % depth)
 
-    for g in glyphs:
-        if not g.render.image: continue
-        channels[g.z0].paste(g.render.image, (g.x0, g.y0, g.x1, g.y1))
+    if filename:
+        atlas = np.memmap(filename, dtype=np.uint8, mode='w+', shape=(height, width, depth))
+    else:
+        atlas = np.zeros((height, width, depth), dtype=np.uint8)
 
-    if depth == 1:
-        return channels[0]
-
-    # merge into a RGB or RGBA image
-    # convert each channel to a numpy array
-    img8 = [None] * depth
-    for i in range(0, depth):
-        data = channels[i].getdata()
-        img = np.fromiter(data, np.uint8)
-        img = np.reshape(img, (channels[i].height, channels[i].width))
-        img8[i] = img
-
-    # merge each channel into a RGBA image
-    if depth == 4:
-        image = np.stack((img8[0], img8[1], img8[2], img8[3]), axis=-1)
-    elif depth == 3:
-        image = np.stack((img8[0], img8[1], img8[2]), axis=-1)
+    glyphs = arena.glyphs
+
+    for index in indexes.tolist():
+        coverage = arena.coverage(index)
+        if coverage is None: continue
+
+        h, w = coverage.shape
+        x0, y0, z0 = (int(glyphs[field][index]) for field in ('x0', 'y0', 'z0'))
+
+        if bits == 8:
+            atlas[y0:y0+h, x0:x0+w, z0] = coverage
+        else:
+            channel, layer = divmod(z0, layers)
+            value = _quantise(coverage, bits, dither) << (layer * bits)
+            atlas[y0:y0+h, x0:x0+w, channel] |= value
 
-    return Image.fromarray(image, mode=mode)
+    return atlas
+
+
+def _image(atlas):
+    """A PIL image sharing memory with the atlas, where possible"""
+    height, width, depth = atlas.shape
+
+    if depth == 1:
+        return Image.frombuffer('L', (width, height), atlas, 'raw', 'L', 0, 1)
+    elif depth == 4:
+        return Image.frombuffer('RGBA', (width, height), atlas, 'raw', 'RGBA', 0, 1)
+    else:
+        # PIL stores RGB as 4 bytes per pixel, so this is a copy
+        return Image.frombuffer('RGB', (width, height), atlas, 'raw', 'RGB', 0, 1)
@@ -0,0 +1,52 @@
+import struct
+import zlib
+
+# A minimal streaming PNG encoder, so that a very large texture atlas can be
+# written out a band of rows at a time without another full copy in memory.
+
+SIGNATURE = b'\x89PNG\r\n\x1a\n'
+
+# PNG colour type for a given depth
+COLOUR_TYPE = {
+    1: 0, # greyscale
+    3: 2, # RGB
+    4: 6, # RGBA
+}
+
+
+def chunk(kind, data):
+    crc = zlib.crc32(data, zlib.crc32(kind))
+    return struct.pack('>I', len(data)) + kind + data + struct.pack('>I', crc)
+
+
+def write(fp, size, tiles, level=6):
+    """
+    :param fp:    a binary file-like object
+    :param size:  a (width, height, depth) tuple
+    :param tiles: a sequence of (y, pixels) tuples in order of y, where
+                  pixels is a (rows, width, depth) array of bytes
+    """
+    width, height, depth = size
+
+    fp.write(SIGNATURE)
+    fp.write(chunk(b'IHDR', struct.pack('>IIBBBBB',
+        width, height,
+        8,                  # bit depth
+        COLOUR_TYPE[depth],
+        0,                  # compression method (deflate)
+        0,                  # filter method
+        0,                  # no interlace
+    )))
+
+    compressor = zlib.compressobj(level)
+
+    for y, pixels in tiles:
+        rows = []
+        for row in pixels:
+            rows.append(b'\0') # filter type: none
+            rows.append(row.tobytes())
+        data = compressor.compress(b''.join(rows))
+        if data: fp.write(chunk(b'IDAT', data))
+
+    fp.write(chunk(b'IDAT', compressor.flush()))
+    fp.write(chunk(b'IEND', b''))
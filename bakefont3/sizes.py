@@ -0,0 +1,41 @@
+"""
+Generators for the `sizes` argument of `bakefont3.pack`: sequences of
+(width, height, depth) tuples in order of preference.
+
+Each of these is monotone: every size is at least as big as the size before
+it in both width and height, so it is suitable for `search="bisect"`.
+"""
+
+
+def powers_of_two(depth=4, minimum=64, maximum=16384):
+    """e.g. (64, 64), (128, 128), (256, 256), ... (maximum, maximum)"""
+    size = minimum
+    while size <= maximum:
+        yield (size, size, depth)
+        size *= 2
+
+
+def squares(depth=4, step=64, minimum=64, maximum=16384):
+    """e.g. (64, 64), (128, 128), (192, 192), ... - not just powers of two"""
+    size = minimum
+    while size <= maximum:
+        yield (size, size, depth)
+        size += step
+
+
+def rectangles(depth=4, step=64, minimum=64, maximum=16384):
+    """
+    e.g. (64, 64), (128, 64), (128, 128), (192, 128), (192, 192), ...
+
+    Grows the width and then the height by `step`, so that the result can be
+    a rectangle half a step smaller than the nearest square.
+    """
+    width = height = minimum
+    while height <= maximum:
+        yield (width, height, depth)
+        if width > height:
+            height += step
+        elif width + step <= maximum:
+            width += step
+        else:
+            height += step
@@ -0,0 +1,279 @@
+"""
+Instrumentation for `bakefont3.pack`: wall-clock and CPU time, glyph and
+kerning pair counts, fit attempts and peak memory for each stage and each
+font mode, saved as a Chrome trace (chrome://tracing, or ui.perfetto.dev) and
+summarised as a table.
+
+    trace = bakefont3.trace.Trace()
+    result = bakefont3.pack(fonts, tasks, sizes, cb=progress(), trace=trace)
+    trace.save("bake-trace.json")
+    print(trace.summary())
+"""
+
+import json
+import os
+import threading
+import time
+import tracemalloc
+
+try:
+    import resource
+except ImportError: # e.g. Windows
+    resource = None
+
+
+def _maxrss():
+    """Peak resident memory of this process in bytes, or 0 if unknown"""
+    if resource is None: return 0
+    # kilobytes on Linux, bytes on macOS
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return rss if os.uname().sysname == "Darwin" else rss * 1024
+
+
+class _Span:
+    """A context manager recording one complete event"""
+
+    __slots__ = ['trace', 'name', 'cat', 'args', 'start', 'cpu']
+
+    def __init__(self, trace, name, cat, args):
+        self.trace = trace
+        self.name = name
+        self.cat = cat
+        self.args = args
+
+    def __enter__(self):
+        self.start = time.perf_counter_ns()
+        self.cpu = time.thread_time_ns()
+        return self.args
+
+    def __exit__(self, *exc):
+        timing = (self.start, time.perf_counter_ns(), time.thread_time_ns() - self.cpu,
+                  os.getpid(), threading.get_ident())
+        self.args["maxrss MB"] = _maxrss() / 2**20
+        if self.trace.memory:
+            # the peak so far in this stage, as the peak is reset per stage
+            self.args["heap peak MB"] = tracemalloc.get_traced_memory()[1] / 2**20
+        self.trace.complete(self.name, self.cat, timing, **self.args)
+        return False
+
+
+class _TimedLock:
+    """A context manager taking a lock, adding the time waited to a span's args"""
+
+    __slots__ = ['lock', 'args']
+
+    def __init__(self, lock, args):
+        self.lock = lock
+        self.args = args
+        args.setdefault("lock wait ms", 0.0)
+
+    def __enter__(self):
+        start = time.perf_counter_ns()
+        self.lock.acquire()
+        self.args["lock wait ms"] += (time.perf_counter_ns() - start) / 1e6
+
+    def __exit__(self, *exc):
+        self.lock.release()
+        return False
+
+
+class _Callback:
+    """Passes calls through to a pack callback, timing each stage"""
+
+    def __init__(self, trace, cb):
+        self.trace = trace
+        self.cb = cb
+
+    def stage(self, msg):
+        self.trace.stage(msg)
+        self.cb.stage(msg)
+
+    def step(self, current, total):
+        self.cb.step(current, total)
+
+    def info(self, msg):
+        self.cb.info(msg)
+
+
+class Trace:
+    """
+    Records trace events. Stages are timed from the `stage` calls pack makes
+    on its callback. Worker threads record their own events, with the CPU time
+    of that thread; a stage's CPU time is for the whole process. Every event
+    and stage also samples the peak memory use so far.
+
+    :param memory: if True, also measure the peak Python heap in each stage
+                   with tracemalloc (slower)
+    """
+
+    def __init__(self, memory=False):
+        self.events = []
+        self.lock = threading.Lock()
+        self.origin = time.perf_counter_ns()
+        self.memory = memory
+        self.current = None # (name, start, process cpu)
+        self.stages = [] # (name, wall ns, cpu ns, maxrss, heap peak)
+        self.threads = set() # (pid, thread id) pairs that have a name
+
+        if memory and not tracemalloc.is_tracing():
+            tracemalloc.start()
+
+        self._thread_name(os.getpid(), threading.get_ident(), "main")
+
+    def _thread_name(self, pid, tid, name):
+        self.threads.add((pid, tid))
+        self.events.append({"name": "thread_name", "ph": "M", "pid": pid, "tid": tid,
+                            "args": {"name": name}})
+
+    def callback(self, cb):
+        """Wrap a pack callback so that its stages are timed"""
+        return _Callback(self, cb)
+
+    def stage(self, name):
+        """End the current stage, if any, and start the next one"""
+        self.end()
+        if self.memory: tracemalloc.reset_peak()
+        self.current = (name, time.perf_counter_ns(), time.process_time_ns())
+
+    def end(self):
+        """End the current stage"""
+        if self.current is None: return
+        name, start, cpu = self.current
+        self.current = None
+
+        end = time.perf_counter_ns()
+        cpu = time.process_time_ns() - cpu
+        maxrss = _maxrss()
+        heap = tracemalloc.get_traced_memory()[1] if self.memory else 0
+        self.stages.append((name, end - start, cpu, maxrss, heap))
+
+        args = {"cpu ms": cpu / 1e6, "maxrss MB": maxrss / 2**20}
+        if self.memory: args["heap peak MB"] = heap / 2**20
+        self.complete(name, "stage", (start, end, cpu, os.getpid(), threading.get_ident()), **args)
+
+        memory = {"maxrss MB": maxrss / 2**20}
+        if self.memory: memory["heap peak MB"] = heap / 2**20
+        with self.lock:
+            self.events.append({"name": "memory", "ph": "C", "pid": os.getpid(),
+                                "ts": (end - self.origin) / 1e3, "args": memory})
+
+    def span(self, name, cat, **args):
+        """
+        A context manager timing a block on the current thread. It yields the
+        dict of `args`, so counts can be added once they are known.
+        """
+        return _Span(self, name, cat, args)
+
+    def timed_lock(self, lock, args):
+        """
+        Wrap a lock taken inside a span, so that the time spent waiting for it
+        is recorded in the span's `args` as "lock wait ms" (and left out of
+        the per font mode times in the summary).
+        """
+        return _TimedLock(lock, args)
+
+    def complete(self, name, cat, timing, **args):
+        """
+        Record an event that has already happened, where `timing` is
+        (start ns, end ns, cpu ns, pid, thread id) from time.perf_counter_ns
+        and time.thread_time_ns (e.g. measured in a worker process).
+        """
+        start, end, cpu, pid, tid = timing
+        args = dict(args)
+        args.setdefault("cpu ms", cpu / 1e6)
+        with self.lock:
+            if (pid, tid) not in self.threads:
+                self._thread_name(pid, tid, "worker" if pid == os.getpid() else "fit worker")
+            self.events.append({
+                "name": name, "cat": cat, "ph": "X", "pid": pid, "tid": tid,
+                "ts": (start - self.origin) / 1e3, "dur": (end - start) / 1e3,
+                "args": args,
+            })
+
+    def json(self):
+        """The Chrome trace-event JSON, as a str"""
+        with self.lock:
+            events = list(self.events)
+        return json.dumps({"traceEvents": events, "displayTimeUnit": "ms"}, default=str)
+
+    def save(self, filename):
+        with open(filename, 'w') as fp:
+            fp.write(self.json())
+
+    def summary(self):
+        """A plain text table of each stage, font mode, and fit attempt"""
+        with self.lock:
+            events = [event for event in self.events if event["ph"] == "X"]
+
+        lines = []
+        heap = " heap MB" if self.memory else ""
+        lines.append("%-60s %10s %10s %10s%s" % ("stage", "wall ms", "cpu ms", "maxrss MB", heap))
+        for name, wall, cpu, maxrss, peak in self.stages:
+            heap = (" %8.1f" % (peak / 2**20)) if self.memory else ""
+            lines.append("%-60s %10.1f %10.1f %10.1f%s" % (name[:60], wall / 1e6, cpu / 1e6, maxrss / 2**20, heap))
+
+        # per font mode (summed over every job for that mode)
+        modes = dict()
+        for event in events:
+            args = event["args"]
+            if event["cat"] not in ("render", "kerning"): continue
+            mode = modes.setdefault(args["mode"], {
+                "glyphs": 0, "render ms": 0.0, "render cpu ms": 0.0,
+                "pairs": 0, "records": 0, "kerning ms": 0.0, "kerning cpu ms": 0.0})
+            # not counting time spent waiting for another thread to finish
+            # with the same face
+            wall = (event["dur"] / 1e3) - args.get("lock wait ms", 0.0)
+            if event["cat"] == "render":
+                mode["glyphs"] += args["glyphs"]
+                mode["render ms"] += wall
+                mode["render cpu ms"] += args["cpu ms"]
+            else:
+                mode["pairs"] += args["pairs"]
+                mode["records"] += args["records"]
+                mode["kerning ms"] += wall
+                mode["kerning cpu ms"] += args["cpu ms"]
+
+        if modes:
+            lines.append("")
+            lines.append("%-32s %7s %10s %10s %10s %8s %10s %10s" % (
+                "font mode", "glyphs", "render ms", "cpu ms", "pairs", "kerned", "kerning ms", "cpu ms"))
+            for name, mode in modes.items():
+                lines.append("%-32s %7d %10.1f %10.1f %10d %8d %10.1f %10.1f" % (
+                    str(name)[:32], mode["glyphs"], mode["render ms"], mode["render cpu ms"],
+                    mode["pairs"], mode["records"], mode["kerning ms"], mode["kerning cpu ms"]))
+
+        fits = [event for event in events if event["cat"] == "fit"]
+        if fits:
+            lines.append("")
+            lines.append("%-24s %7s %6s %10s %10s" % ("fit attempt", "glyphs", "fit", "wall ms", "cpu ms"))
+            for event in fits:
+                args = event["args"]
+                lines.append("%-24s %7d %6s %10.1f %10.1f" % (
+                    args["size"], args["glyphs"], "yes" if args["fit"] else "no",
+                    event["dur"] / 1e3, args["cpu ms"]))
+
+        return "\n".join(lines)
+
+
+class _NullSpan:
+    def __enter__(self):
+        return dict()
+    def __exit__(self, *exc):
+        return False
+
+
+class NoTrace:
+    """The default for pack: records nothing"""
+
+    def callback(self, cb):
+        return cb
+    def stage(self, name):
+        pass
+    def end(self):
+        pass
+    def span(self, name, cat, **args):
+        return _NullSpan()
+    def timed_lock(self, lock, args):
+        return lock
+    def complete(self, name, cat, timing, **args):
+        pass
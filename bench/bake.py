@@ -0,0 +1,388 @@
+#!/usr/bin/env python3
+"""
+Benchmark of the bake pipelines: bakefont3.pack (Python) and bf3-bake (C).
+
+Bakes a font with thousands of glyphs (DejaVu Sans, or any font given with
+--font) in several configurations, and records for each one:
+
+    * the wall and CPU time of every stage, and the peak memory (Python only)
+    * the texture atlas size chosen, its index in the list of suitable sizes,
+      and the number of sizes tried
+    * atlas occupancy - the fraction of the atlas (every channel and layer)
+      covered by glyphs
+    * the number of glyphs and kerning pairs, and the size of each output file
+
+Results are written as JSON, so that the effect of a change to packing,
+kerning or rendering can be compared directly:
+
+    $ python3 bench/bake.py --output before.json
+    $ # ... change something ...
+    $ python3 bench/bake.py --output after.json
+    $ python3 bench/bake.py --compare before.json after.json
+
+Occupancy, glyph and kerning pair counts are read back from the .bf3 file, so
+they are measured the same way for both pipelines.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import resource
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import freetype
+import numpy as np
+import bakefont3
+from bakefont3.encode import GSET_RECORD
+
+
+FONTS = [
+    "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+    "/usr/share/fonts/dejavu/DejaVuSans.ttf",
+    "/usr/share/fonts/TTF/DejaVuSans.ttf",
+    "/usr/local/share/fonts/DejaVuSans.ttf",
+    "/Library/Fonts/DejaVuSans.ttf",
+]
+
+NATIVE = [
+    os.path.join(ROOT, "bf3-bake"),
+    os.path.join(ROOT, "build", "bf3-bake"),
+    os.path.join(ROOT, "cmake-build-release", "bf3-bake"),
+    os.path.join(ROOT, "cmake-build-debug", "bf3-bake"),
+]
+
+# name => font modes (size, antialias), atlas sizes, search, bits
+#
+# Sizes are given as bf3-bake manifest arguments, and made into the same
+# sequence for pack with bakefont3.sizes.
+CASES = {
+    "aa16":     ([(16, True)],               ("powers-of-two", 4, 64, 16384), "linear", 8),
+    "aa12+24":  ([(12, True), (24, True)],   ("squares", 4, 64, 64, 16384),   "bisect", 8),
+    "mono-1bit":([(12, False), (16, False)], ("powers-of-two", 4, 64, 16384), "bisect", 1),
+    "sdf32":    ([(32, bakefont3.SDF)],      ("powers-of-two", 4, 64, 16384), "bisect", 8),
+}
+
+
+class _quiet:
+    def stage(self, msg): pass
+    def step(self, current, total): pass
+    def info(self, msg): pass
+
+
+def _sizes(spec):
+    kind, args = spec[0], spec[1:]
+    if kind == "powers-of-two":
+        return list(bakefont3.sizes.powers_of_two(*args))
+    elif kind == "squares":
+        return list(bakefont3.sizes.squares(*args))
+    elif kind == "rectangles":
+        return list(bakefont3.sizes.rectangles(*args))
+    raise ValueError("unknown sizes %s" % repr(kind))
+
+
+def _mode_name(antialias):
+    if antialias == bakefont3.SDF: return "sdf"
+    return "aa" if antialias else "mono"
+
+
+def analyse(bf3file, pngfile):
+    """Read the atlas size, glyph and kerning counts and occupancy from a .bf3 file"""
+    with open(bf3file, 'rb') as fp:
+        data = fp.read()
+
+    width, height, depth = struct.unpack_from('<HHH', data, 12)
+    bits = data[20] or 8
+
+    # skip the font and mode tables to reach the glyph table
+    r = 24
+    num_fonts, = struct.unpack_from('<H', data, r + 4)
+    r += 8 + (48 * num_fonts)
+    num_modes, = struct.unpack_from('<H', data, r + 4)
+    r += 8 + (32 * num_modes)
+    num_tables, = struct.unpack_from('<H', data, r + 4)
+    r += 8
+
+    glyphs = 0
+    pairs = 0
+    placed = set() # (x, y, z, width, height) - shared bitmaps count once
+    for i in range(num_tables):
+        _, metrics_offset, metrics_size, kerning_offset, kerning_size = \
+            struct.unpack_from('<H2xIIII', data, r + (40 * i))
+        records = np.frombuffer(data, dtype=GSET_RECORD,
+                                count=(metrics_size - 4) // 40, offset=metrics_offset + 4)
+        glyphs += len(records)
+        pairs += (kerning_size - 4) // 16
+        for record in records[records['depth'] > 0]:
+            placed.add((int(record['x']), int(record['y']), int(record['z']),
+                        int(record['width']), int(record['height'])))
+
+    area = sum(w * h for _, _, _, w, h in placed)
+    capacity = width * height * depth * (8 // bits)
+
+    return {
+        "size": [width, height, depth],
+        "bits": bits,
+        "glyphs": glyphs,
+        "unique bitmaps": len(placed),
+        "kerning pairs": pairs,
+        "occupancy": (area / capacity) if capacity else 0.0,
+        "bf3 bytes": len(data),
+        "png bytes": os.path.getsize(pngfile),
+    }
+
+
+def bake_python(fontpath, charset, case, outdir):
+    modes, sizespec, search, bits = CASES[case]
+    sizes = _sizes(sizespec)
+
+    face = freetype.Face(fontpath)
+    tasks = [(("Font", size, antialias), "ALL", charset) for size, antialias in modes]
+
+    trace = bakefont3.trace.Trace()
+    cpu = time.process_time()
+    start = time.perf_counter()
+
+    result = bakefont3.pack({"Font": face}, tasks, sizes, cb=_quiet(), search=search,
+                            bits=bits, trace=trace)
+    if not result.image:
+        return {"error": "no fit"}
+
+    # the file was encoded in the "Generating binary" stage, so this only
+    # copies it (the wall and CPU totals include it, and the PNG)
+    bf3file = os.path.join(outdir, "python.bf3")
+    pngfile = os.path.join(outdir, "python.png")
+    result.data.save(bf3file)
+    result.save_png(pngfile)
+
+    wall = time.perf_counter() - start
+    cpu = time.process_time() - cpu
+
+    fits = [event for event in json.loads(trace.json())["traceEvents"] if event.get("cat") == "fit"]
+
+    stats = {
+        "stages": [{"name": name, "wall ms": wall_ns / 1e6, "cpu ms": cpu_ns / 1e6,
+                    "maxrss MB": maxrss / 2**20}
+                   for name, wall_ns, cpu_ns, maxrss, _ in trace.stages],
+        "wall ms": wall * 1e3,
+        "cpu ms": cpu * 1e3,
+        "maxrss MB": max(maxrss for _, _, _, maxrss, _ in trace.stages) / 2**20,
+        "size index": sizes.index(tuple(result.size)),
+        "sizes tried": len(fits),
+    }
+    stats.update(analyse(bf3file, pngfile))
+    return stats
+
+
+def _ranges(charset):
+    """The charset as bf3-bake manifest values, merging runs into U+XXXX-U+YYYY"""
+    codepoints = sorted(set(ord(c) for c in charset))
+    values = []
+    start = 0
+    for i in range(1, len(codepoints) + 1):
+        if i < len(codepoints) and codepoints[i] == codepoints[i - 1] + 1: continue
+        first, last = codepoints[start], codepoints[i - 1]
+        values.append(("U+%04X" % first) if first == last else ("U+%04X-U+%04X" % (first, last)))
+        start = i
+    return " ".join(values)
+
+
+def bake_native(native, fontpath, charset, case, outdir):
+    modes, sizespec, search, bits = CASES[case]
+    sizes = _sizes(sizespec)
+
+    bf3file = os.path.join(outdir, "native.bf3")
+    pngfile = os.path.join(outdir, "native.png")
+    manifest = os.path.join(outdir, "bench.manifest")
+
+    chars = _ranges(charset)
+    with open(manifest, 'w') as fp:
+        fp.write('font "Font" "%s"\n' % fontpath)
+        for size, antialias in modes:
+            fp.write('table "Font" %s %s ALL %s\n' % (size, _mode_name(antialias), chars))
+        fp.write('sizes %s\n' % " ".join(str(arg) for arg in sizespec))
+        fp.write('search %s\n' % search)
+        fp.write('bits %d\n' % bits)
+        fp.write('output %s\n' % bf3file)
+        fp.write('atlas %s\n' % pngfile)
+
+    # stages are timed from when bf3-bake reports them
+    stages = []
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.perf_counter()
+
+    # stderr goes to a file rather than a pipe, so that many notices about
+    # missing characters can't fill it while stdout is being read
+    errors = tempfile.TemporaryFile(mode='w+')
+    process = subprocess.Popen([native, manifest], stdout=subprocess.PIPE,
+                               stderr=errors, universal_newlines=True)
+    for line in process.stdout:
+        now = time.perf_counter()
+        match = re.match(r'^(\S.*)\.\.\.$', line.rstrip('\n'))
+        if not match: continue
+        if stages: stages[-1]["wall ms"] = (now - stages[-1].pop("start")) * 1e3
+        stages.append({"name": match.group(1), "start": now})
+    process.wait()
+
+    wall = time.perf_counter() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    if stages: stages[-1]["wall ms"] = (time.perf_counter() - stages[-1].pop("start")) * 1e3
+
+    if process.returncode != 0 or not os.path.exists(bf3file):
+        errors.seek(0)
+        lines = [line for line in errors.read().splitlines() if not line.startswith("notice:")]
+        errors.close()
+        return {"error": "bf3-bake exited with %d: %s" % (process.returncode, " ".join(lines[-3:]))}
+    errors.close()
+
+    stats = {
+        "stages": stages,
+        "wall ms": wall * 1e3,
+        "cpu ms": ((after.ru_utime - usage.ru_utime) + (after.ru_stime - usage.ru_stime)) * 1e3,
+        # not measured: a child's peak memory includes this process's, as it
+        # is kept across fork and exec
+        "maxrss MB": None,
+    }
+    stats.update(analyse(bf3file, pngfile))
+    stats["size index"] = sizes.index(tuple(stats["size"]))
+    return stats
+
+
+def _revision():
+    try:
+        return subprocess.check_output(["git", "-C", ROOT, "describe", "--always", "--dirty"],
+                                       stderr=subprocess.DEVNULL, universal_newlines=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def _print_run(run):
+    for case, pipelines in run["results"].items():
+        for pipeline, stats in pipelines.items():
+            if "error" in stats:
+                print("%-10s %-7s %s" % (case, pipeline, stats["error"]))
+                continue
+            maxrss = "-" if stats["maxrss MB"] is None else "%.1f" % stats["maxrss MB"]
+            print("%-10s %-7s %10.1f %10.1f %8s %-18s %6d %9.1f%% %8d %10d %10d" % (
+                case, pipeline, stats["wall ms"], stats["cpu ms"], maxrss,
+                "%dx%dx%d (#%d)" % (tuple(stats["size"]) + (stats["size index"],)),
+                stats["glyphs"], 100 * stats["occupancy"], stats["kerning pairs"],
+                stats["bf3 bytes"], stats["png bytes"]))
+
+
+def _print_header():
+    print("%-10s %-7s %10s %10s %8s %-18s %6s %10s %8s %10s %10s" % (
+        "case", "bake", "wall ms", "cpu ms", "rss MB", "atlas", "glyphs", "occupied",
+        "kerning", "bf3 bytes", "png bytes"))
+
+
+def compare(before, after):
+    """Print the change in each measurement between two saved runs"""
+    with open(before) as fp: a = json.load(fp)
+    with open(after) as fp: b = json.load(fp)
+
+    print("before: %s (%s)" % (before, a.get("revision")))
+    print("after:  %s (%s)" % (after, b.get("revision")))
+    print()
+    print("%-10s %-7s %-24s %14s %14s %9s" % ("case", "bake", "measure", "before", "after", "change"))
+
+    keys = ["wall ms", "cpu ms", "maxrss MB", "occupancy", "kerning pairs", "bf3 bytes", "png bytes"]
+    for case, pipelines in b["results"].items():
+        for pipeline, new in pipelines.items():
+            old = a["results"].get(case, {}).get(pipeline)
+            if not old or "error" in old or "error" in new: continue
+
+            if old["size"] != new["size"]:
+                print("%-10s %-7s %-24s %14s %14s" % (case, pipeline, "atlas",
+                    "x".join(map(str, old["size"])), "x".join(map(str, new["size"]))))
+
+            for key in keys:
+                if old[key] is None or new[key] is None: continue
+                change = ((new[key] - old[key]) / old[key] * 100) if old[key] else 0.0
+                print("%-10s %-7s %-24s %14.2f %14.2f %+8.1f%%" % (case, pipeline, key, old[key], new[key], change))
+
+            # stages in both runs, by name
+            stages = {stage["name"]: stage["wall ms"] for stage in old["stages"]}
+            for stage in new["stages"]:
+                if stage["name"] not in stages: continue
+                was = stages[stage["name"]]
+                change = ((stage["wall ms"] - was) / was * 100) if was else 0.0
+                print("%-10s %-7s %-24s %14.2f %14.2f %+8.1f%%" % (case, pipeline,
+                    stage["name"][:24], was, stage["wall ms"], change))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("--font", help="font file (default: DejaVu Sans)")
+    parser.add_argument("--glyphs", type=int, default=2000,
+                        help="bake the first N characters of the font, or 0 for all (default: 2000)")
+    parser.add_argument("--case", action="append", choices=sorted(CASES),
+                        help="configuration to bake (default: all)")
+    parser.add_argument("--native", help="bf3-bake executable (default: look in the source tree)")
+    parser.add_argument("--no-python", action="store_true", help="skip bakefont3.pack")
+    parser.add_argument("--no-native", action="store_true", help="skip bf3-bake")
+    parser.add_argument("--output", default="bake-bench.json", help="JSON results file")
+    parser.add_argument("--compare", nargs=2, metavar=("BEFORE", "AFTER"),
+                        help="compare two results files instead of baking")
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(*args.compare)
+        return
+
+    fontpath = args.font or next((path for path in FONTS if os.path.exists(path)), None)
+    if not fontpath:
+        sys.exit("Couldn't find DejaVu Sans: use --font to choose a font with thousands of glyphs")
+
+    native = None
+    if not args.no_native:
+        native = args.native or next((path for path in NATIVE if os.access(path, os.X_OK)), None) \
+            or shutil.which("bf3-bake")
+        if not native:
+            print("(bf3-bake not found: use --native to choose it, or --no-native)")
+
+    face = freetype.Face(fontpath)
+    charset = [chr(charcode) for charcode, _ in face.get_chars()]
+    if args.glyphs: charset = charset[:args.glyphs]
+
+    run = {
+        "date": datetime.datetime.now().isoformat(timespec='seconds'),
+        "revision": _revision(),
+        "machine": {"platform": platform.platform(), "python": platform.python_version(),
+                    "cpus": os.cpu_count()},
+        "font": fontpath,
+        "characters": len(charset),
+        "native": native,
+        "results": dict(),
+    }
+
+    print("%s, %d characters" % (fontpath, len(charset)))
+    with tempfile.TemporaryDirectory() as outdir:
+        for case in (args.case or CASES):
+            results = run["results"][case] = dict()
+            if not args.no_python:
+                results["python"] = bake_python(fontpath, charset, case, outdir)
+            if native:
+                results["native"] = bake_native(native, fontpath, charset, case, outdir)
+
+    with open(args.output, 'w') as fp:
+        json.dump(run, fp, indent=2)
+
+    print()
+    _print_header()
+    _print_run(run)
+    print("\n(saved to %s)" % args.output)
+
+
+if __name__ == "__main__":
+    main()
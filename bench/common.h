@@ -0,0 +1,131 @@
+// Helpers shared by the benchmarks and tests: reading a whole file into
+// memory, reading a .bf3 file from memory with bf3_filelike, visiting each
+// table of a .bf3 file, and seeded random numbers.
+
+#ifndef BAKEFONT3_BENCH_COMMON_H
+#define BAKEFONT3_BENCH_COMMON_H
+
+#include "bakefont3.h"
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy
+#include <stdio.h>
+
+
+// Read a whole file into a new buffer (with a '\0' after the end, so that a
+// text file is also a C string), or return NULL. Free the buffer with free.
+static inline char *read_file(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { return NULL; }
+
+    char *data = NULL;
+    if (0 != fseek(fp, 0, SEEK_END)) { goto done; }
+    long len = ftell(fp);
+    if ((len < 0) || (0 != fseek(fp, 0, SEEK_SET))) { goto done; }
+
+    data = malloc((size_t) len + 1);
+    if (!data) { goto done; }
+    if ((size_t) len != fread(data, 1, (size_t) len, fp)) { free(data); data = NULL; goto done; }
+    data[len] = '\0';
+    *size = (size_t) len;
+
+    done:
+        fclose(fp);
+        return data;
+}
+
+
+// a whole file in memory, read with bf3_filelike
+
+typedef struct memfile memfile;
+
+struct memfile
+{
+    const char *data;
+    size_t size;
+};
+
+static inline size_t (read_memfile)(char *dest, bf3_filelike *filelike, size_t offset, size_t numbytes)
+{
+    const memfile *src = filelike->ptr;
+
+    if (offset >= src->size) { return 0; }
+    if (numbytes > src->size - offset) { numbytes = src->size - offset; }
+    memcpy(dest, src->data + offset, numbytes);
+
+    return numbytes;
+}
+
+
+// Tests and benchmarks of one table at a time: called with everything needed
+// to lay out text with the table, returning a number of failures.
+typedef size_t (*table_fn)(const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning, void *arg);
+
+// Read the .bf3 file at `path` and call `fn` for each of its tables in turn.
+// Returns the total number of failures, counting one for the file or a table
+// that couldn't be read.
+static inline size_t for_each_table(const char *path, table_fn fn, void *arg)
+{
+    size_t failures = 0;
+    memfile file;
+    char *data = read_file(path, &file.size);
+    if (!data) { fprintf(stderr, "Could not open %s\n", path); return 1; }
+    file.data = data;
+
+    bf3_filelike reader = {(void *) &file, read_memfile};
+    char *hdr = NULL;
+
+    size_t header_size = bf3_header_peek(&reader);
+    if (!header_size) { fprintf(stderr, "Not a bf3 file %s\n", path); failures = 1; goto done; }
+
+    hdr = malloc(header_size);
+    if (!hdr) { fprintf(stderr, "Malloc error (header)\n"); failures = 1; goto done; }
+
+    bf3_info info;
+    if (!bf3_header_load(&info, hdr, &reader, header_size))
+        { fprintf(stderr, "Error reading header\n"); failures = 1; goto done; }
+
+    for (int i = 0; i < info.num_tables; i++)
+    {
+        bf3_table table;
+        bf3_mode mode;
+        bf3_table_get(&table, hdr, i);
+        bf3_mode_get(&mode, hdr, table.mode_id);
+
+        printf("%s: table %d \"%s\"\n", path, table.table_id, table.name);
+
+        char *metrics = malloc(table.metrics_size);
+        char *kerning = malloc(table.kerning_size);
+        if (!metrics || !kerning)
+            { fprintf(stderr, "Malloc error (tables)\n"); failures++; }
+        else if (!bf3_metrics_load(metrics, &reader, &table) || !bf3_kerning_load(kerning, &reader, &table))
+            { fprintf(stderr, "Error reading table %d\n", table.table_id); failures++; }
+        else
+            { failures += fn(&info, &mode, metrics, kerning, arg); }
+
+        free(kerning);
+        free(metrics);
+    }
+
+    done:
+        free(hdr);
+        free(data);
+        return failures;
+}
+
+
+// A small seeded pseudo-random number generator (xorshift32), so that a test
+// makes the same "random" choices on every platform. The seed must not be 0.
+static inline uint32_t test_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+
+#endif // BAKEFONT3_BENCH_COMMON_H
@@ -0,0 +1,547 @@
+// Benchmark of text layout throughput, without a window
+
+// COMPILE:
+//     gcc -std=c99 -O2 bench/layout.c bakefont3.c lib/utf8.c -I. -lm -Wall -Wextra -o bench-layout.bin
+// USAGE:
+//     ./bench-layout.bin [data.bf3 [corpus.txt ...]]
+//     (default: example/test.bf3 and every text in bench/corpus)
+//
+// Runs the layout loop from example-gl.c over each corpus - UTF-8 decoding,
+// glyph metric lookup, kerning and writing six vertices per glyph - but
+// writes the vertices to memory instead of uploading them to a GL buffer.
+// Then the same with bf3_layout, which writes a bf3_quad per glyph, and
+// bf3_layout followed by each of the bf3_emit vertex layouts (build with
+// -DBF3_NO_SIMD to compare with the plain C version), then the same fused
+// into one pass with bf3_layout_triangles_utf8 and bf3_layout_instances_utf8.
+// Finally, only the UTF-8 decoding, with lib/utf8.c one codepoint at a time
+// and in bulk (build with -DUTF8_NO_SIMD to compare with the plain C version).
+//
+// Then all of it again, for every corpus one after another, repeated to
+// LONG_BYTES, where the quads for the whole text no longer fit in the cache.
+//
+// Uses the table named "ALL" with the most glyphs. Each corpus is laid out
+// repeatedly for at least MIN_NS, five times, and the fastest run is
+// reported as glyphs (decoded codepoints) per second, quads per second, and
+// megabytes of output (vertices, or bf3_quads) per second.
+
+
+#define _GNU_SOURCE // clock_gettime
+
+#include "bakefont3.h"
+#include "bench/common.h" // read_file, memfile
+#include "lib/utf8.h"
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, strcmp
+#include <stdio.h>
+#include <time.h>
+
+
+#define MIN_NS  20000000 // 20ms per run
+#define LONG_BYTES (4 * 1024 * 1024)
+#define RUNS    5
+
+#ifndef BENCH_DEFAULT_FILE
+#   define BENCH_DEFAULT_FILE "example/test.bf3"
+#endif
+#ifndef BENCH_CORPUS_DIR
+#   define BENCH_CORPUS_DIR "bench/corpus"
+#endif
+
+static const char *default_corpora[] =
+    {"english.txt", "german.txt", "greek.txt", "cyrillic.txt", "cjk.txt", "code.txt"};
+
+
+// Anything written here is observed, so the compiler can't throw away the
+// vertices being benchmarked.
+static volatile float sink;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000u) + (uint64_t) ts.tv_nsec;
+}
+
+
+// ----------------------------------------------------------------------------
+// Layout
+
+// everything a layout needs to know about the font
+typedef struct font font;
+
+struct font
+{
+    bf3_info info;
+    bf3_mode mode;
+    bf3_table table;
+    char *metrics;
+    char *kerning;
+    bf3_emitter emitter;
+};
+
+
+// a corpus and room to lay it out
+typedef struct corpus corpus;
+
+struct corpus
+{
+    const char *name;
+    const char *utf8;
+    size_t len;         // bytes
+    uint32_t *utf32;    // room for len codepoints
+    size_t codepoints;  // after decoding
+    float *vertices;    // room for 6 vertices of 6 floats per codepoint
+    bf3_quad *quads;    // room for a quad per codepoint
+};
+
+#define VERTEX_BYTES (6 * sizeof(float)) // XY, UV, MASK, COLOUR
+
+
+// The layout loop from example-gl.c, writing vertices to memory.
+// Returns the number of glyphs drawn.
+static size_t layout_example_gl(const font *f, corpus *c)
+{
+    // convert utf8 into a Unicode string
+    utf8_decode_init(c->utf8, (int) c->len);
+    size_t index = 0;
+    while (index < c->len)
+    {
+        int scodepoint = utf8_decode_next();
+        if (scodepoint < 0) { break; }
+
+        c->utf32[index] = (uint32_t) scodepoint;
+
+        index++;
+    }
+    c->codepoints = index;
+
+    size_t vertexes = 0;
+
+    int xoffset = 20;
+    int yoffset = 20;
+    int wordspacing = 6;
+
+    // get the lineheight and round up to the nearest pixel
+    int lineheight = BF3_DECODE_FP26_NEAREST(f->mode.lineheight);
+    yoffset += lineheight;
+
+    float *p = c->vertices;
+
+    for (size_t i = 0; i < c->codepoints; i++)
+    {
+        // look up the glyph metrics
+        bf3_metric metric;
+        uint32_t codepoint = c->utf32[i];
+
+        if (codepoint == '\n') { yoffset += lineheight; xoffset = 20; continue; }
+
+        if (!bf3_metric_get(&metric, f->metrics, codepoint)) { continue; }
+
+        // nothing to render? e.g. space
+        if (!metric.tex_d) { xoffset += wordspacing; continue; }
+
+        // based on the layer (metric.tex_z),
+        // choose a mask colour that will extract from the channel we want
+        unsigned char mask[4] = {0, 0, 0, 0};
+        switch (metric.tex_z)
+        {
+            case 0: mask[0] = 255; break; // red
+            case 1: mask[1] = 255; break; // green
+            case 2: mask[2] = 255; break; // blue
+            case 3: mask[3] = 255; break; // alpha
+        }
+
+        int advance = BF3_DECODE_FP26_NEAREST(metric.hadvance);
+        int lsb = BF3_DECODE_FP26_NEAREST(metric.hbx);
+        int tsb = BF3_DECODE_FP26_NEAREST(metric.hby);
+
+        // kerning
+        int xkern = 0;
+        if (i > 0) // don't kern the first letter
+        {
+            uint32_t last_codepoint = c->utf32[i-1];
+            bf3_kpair kpair;
+
+            // not all fonts have kerning information
+            if (bf3_kpair_get(&kpair, f->kerning, last_codepoint, codepoint))
+            {
+                xkern = kpair.x;
+            }
+        }
+
+        // compute x/y, size, and texture u/v
+        float x0 = ((float) xoffset + lsb + xkern);
+        float y0 = ((float) yoffset - tsb); // realtive to baseline
+        float x1 = x0 + metric.tex_w;
+        float y1 = y0 + metric.tex_h;
+        float u0 = ((float) metric.tex_x) / ((float)f->info.width);
+        float v0 = ((float) metric.tex_y) / ((float)f->info.height);
+        float u1 = ((float) (metric.tex_x + metric.tex_w)) / ((float)f->info.width);
+        float v1 = ((float) (metric.tex_y + metric.tex_h)) / ((float)f->info.height);
+
+        unsigned char color_top[4] = {255, 255, 0, 255};
+        unsigned char color_bottom[4] = {255, 0, 255, 255};
+
+        // move the cursor across
+        xoffset += advance + xkern;
+
+        #define P(x) (*p++) = (x)
+        #define B(x) memcpy(p++, &(x), 4);
+
+        // triangle 1
+        P(x0); P(y0); P(u0); P(v0); B(mask); B(color_top);
+        P(x0); P(y1); P(u0); P(v1); B(mask); B(color_bottom);
+        P(x1); P(y1); P(u1); P(v1); B(mask); B(color_bottom);
+
+        // triangle 2
+        P(x0); P(y0); P(u0); P(v0); B(mask); B(color_top);
+        P(x1); P(y1); P(u1); P(v1); B(mask); B(color_bottom);
+        P(x1); P(y0); P(u1); P(v0); B(mask); B(color_top);
+
+        #undef P
+        #undef B
+
+        vertexes += 6;
+    }
+
+    if (vertexes) { sink = c->vertices[(vertexes * 6) - 1]; }
+    return vertexes / 6;
+}
+
+
+// bf3_layout, straight from UTF-8 to a bf3_quad per glyph
+static size_t layout_bf3(const font *f, corpus *c)
+{
+    bf3_layout layout;
+    bf3_layout_init(&layout, &f->mode, f->metrics, f->kerning, 20, 20 + BF3_DECODE_FP26_NEAREST(f->mode.lineheight));
+
+    size_t quads = bf3_layout_utf8(&layout, c->quads, c->len, c->utf8, c->len, NULL);
+
+    if (quads) { sink = (float) c->quads[quads - 1].x; }
+    return quads;
+}
+
+
+// bf3_layout, then six vertices per quad (the same as example-gl)
+static size_t layout_bf3_triangles(const font *f, corpus *c)
+{
+    size_t quads = layout_bf3(f, c);
+    bf3_vertex *vertices = (bf3_vertex *) c->vertices;
+    size_t vertexes = bf3_emit_triangles(&f->emitter, vertices, c->quads, quads);
+
+    if (vertexes) { sink = vertices[vertexes - 1].v; }
+    return quads;
+}
+
+
+// bf3_layout, then four vertices per quad (the index buffer is only written
+// once, so isn't counted)
+static size_t layout_bf3_quads(const font *f, corpus *c)
+{
+    size_t quads = layout_bf3(f, c);
+    bf3_vertex *vertices = (bf3_vertex *) c->vertices;
+    size_t vertexes = bf3_emit_quads(&f->emitter, vertices, c->quads, quads);
+
+    if (vertexes) { sink = vertices[vertexes - 1].v; }
+    return quads;
+}
+
+
+// bf3_layout, then one instance per quad
+static size_t layout_bf3_instances(const font *f, corpus *c)
+{
+    size_t quads = layout_bf3(f, c);
+    bf3_instance *instances = (bf3_instance *) c->vertices;
+    bf3_emit_instances(&f->emitter, instances, c->quads, quads);
+
+    if (quads) { sink = instances[quads - 1].v1; }
+    return quads;
+}
+
+
+// bf3_layout and bf3_emit_triangles fused into one pass
+static size_t layout_bf3_fused_triangles(const font *f, corpus *c)
+{
+    bf3_layout layout;
+    bf3_layout_init(&layout, &f->mode, f->metrics, f->kerning, 20, 20 + BF3_DECODE_FP26_NEAREST(f->mode.lineheight));
+
+    bf3_vertex *vertices = (bf3_vertex *) c->vertices;
+    size_t quads = bf3_layout_triangles_utf8(&layout, &f->emitter, vertices, c->len, c->utf8, c->len, NULL);
+
+    if (quads) { sink = vertices[(6 * quads) - 1].v; }
+    return quads;
+}
+
+
+// bf3_layout and bf3_emit_instances fused into one pass
+static size_t layout_bf3_fused_instances(const font *f, corpus *c)
+{
+    bf3_layout layout;
+    bf3_layout_init(&layout, &f->mode, f->metrics, f->kerning, 20, 20 + BF3_DECODE_FP26_NEAREST(f->mode.lineheight));
+
+    bf3_instance *instances = (bf3_instance *) c->vertices;
+    size_t quads = bf3_layout_instances_utf8(&layout, &f->emitter, instances, c->len, c->utf8, c->len, NULL);
+
+    if (quads) { sink = instances[quads - 1].v1; }
+    return quads;
+}
+
+
+// Only decode the UTF-8, one codepoint at a time (the first step of
+// example-gl). Draws nothing.
+static size_t decode_utf8(const font *f, corpus *c)
+{
+    (void) f;
+
+    utf8_decode_init(c->utf8, (int) c->len);
+    size_t index = 0;
+    for (int codepoint = utf8_decode_next(); codepoint >= 0; codepoint = utf8_decode_next())
+        { c->utf32[index++] = (uint32_t) codepoint; }
+    c->codepoints = index;
+
+    if (index) { sink = (float) c->utf32[index - 1]; }
+    return 0;
+}
+
+
+// Only decode the UTF-8, in bulk. Draws nothing.
+static size_t decode_utf8_bulk(const font *f, corpus *c)
+{
+    (void) f;
+
+    c->codepoints = utf8_decode_bulk(c->utf8, c->len, c->utf32, c->len, NULL);
+
+    if (c->codepoints) { sink = (float) c->utf32[c->codepoints - 1]; }
+    return 0;
+}
+
+
+typedef size_t (*layout_fn)(const font *f, corpus *c);
+
+typedef struct layout layout;
+
+struct layout
+{
+    const char *name;
+    layout_fn fn;
+    size_t quad_bytes; // output per glyph drawn
+};
+
+static const layout layouts[] = {
+    {"example-gl", layout_example_gl, 6 * VERTEX_BYTES},
+    {"bf3_layout", layout_bf3,        sizeof(bf3_quad)},
+    {"+triangles", layout_bf3_triangles, 6 * sizeof(bf3_vertex)},
+    {"+quads",     layout_bf3_quads,     4 * sizeof(bf3_vertex)},
+    {"+instances", layout_bf3_instances, sizeof(bf3_instance)},
+    {"fused tris", layout_bf3_fused_triangles, 6 * sizeof(bf3_vertex)},
+    {"fused inst", layout_bf3_fused_instances, sizeof(bf3_instance)},
+    {"utf8_decode", decode_utf8,      0},
+    {"utf8_bulk",  decode_utf8_bulk,  0},
+};
+
+
+// ----------------------------------------------------------------------------
+
+static void run(const layout *l, const font *f, corpus *c)
+{
+    // warm up, and find how many passes take at least MIN_NS
+    size_t iterations = 1;
+    size_t quads = 0;
+    for (;;)
+    {
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < iterations; i++) { quads = l->fn(f, c); }
+        if ((now_ns() - start) >= MIN_NS) { break; }
+        iterations *= 2;
+    }
+
+    uint64_t best = 0;
+    for (int r = 0; r < RUNS; r++)
+    {
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < iterations; i++) { l->fn(f, c); }
+        uint64_t elapsed = now_ns() - start;
+        if ((r == 0) || (elapsed < best)) { best = elapsed; }
+    }
+
+    double seconds = (double) best / 1e9 / (double) iterations;
+
+    printf("%-12s %-12s %8zu %8zu %8zu %12.2f %12.2f %12.1f\n",
+        c->name, l->name, c->len, c->codepoints, quads,
+        (double) c->codepoints / seconds / 1e6,
+        (double) quads / seconds / 1e6,
+        (double) (quads * l->quad_bytes) / seconds / (1024.0 * 1024.0));
+}
+
+
+static bool load_font(font *f, const char *path)
+{
+    memfile file;
+    char *data = read_file(path, &file.size);
+    if (!data) { fprintf(stderr, "Could not open %s\n", path); return false; }
+    file.data = data;
+
+    bf3_filelike reader = {(void *) &file, read_memfile};
+    char *hdr = NULL;
+    f->metrics = NULL;
+    f->kerning = NULL;
+
+    size_t header_size = bf3_header_peek(&reader);
+    if (!header_size) { fprintf(stderr, "Not a bf3 file %s\n", path); goto fail; }
+
+    hdr = malloc(header_size);
+    if (!hdr) { fprintf(stderr, "Malloc error (header)\n"); goto fail; }
+
+    if (!bf3_header_load(&f->info, hdr, &reader, header_size))
+        { fprintf(stderr, "Error reading header\n"); goto fail; }
+
+    // the "ALL" table with the most glyphs
+    bool found = false;
+    for (int i = 0; i < f->info.num_tables; i++)
+    {
+        bf3_table table;
+        bf3_table_get(&table, hdr, i);
+        if (0 != strcmp(table.name, "ALL")) { continue; }
+        if (found && (table.metrics_size <= f->table.metrics_size)) { continue; }
+        f->table = table;
+        found = true;
+    }
+    if (!found) { fprintf(stderr, "Couldn't find a table named ALL in %s\n", path); goto fail; }
+
+    bf3_mode_get(&f->mode, hdr, f->table.mode_id);
+    bf3_emitter_init(&f->emitter, &f->info);
+
+    bf3_font font;
+    bf3_font_get(&font, hdr, f->mode.font_id);
+    printf("%s: font \"%s\" size %.2f, table %d (%u glyphs, %u kerning pairs)\n\n",
+        path, font.name, BF3_DECODE_FP26(f->mode.size), f->table.table_id,
+        (unsigned int) ((f->table.metrics_size - 4) / 40),
+        (unsigned int) ((f->table.kerning_size - 4) / 16));
+
+    f->metrics = malloc(f->table.metrics_size);
+    f->kerning = malloc(f->table.kerning_size);
+    if (!f->metrics || !f->kerning) { fprintf(stderr, "Malloc error (tables)\n"); goto fail; }
+
+    if (!bf3_metrics_load(f->metrics, &reader, &f->table))
+        { fprintf(stderr, "Error reading font metrics\n"); goto fail; }
+    if (!bf3_kerning_load(f->kerning, &reader, &f->table))
+        { fprintf(stderr, "Error reading font kerning information\n"); goto fail; }
+
+    // the table name points into the header
+    f->table.name = "ALL";
+    free(hdr);
+    free(data);
+    return true;
+
+    fail:
+        free(f->kerning);
+        free(f->metrics);
+        free(hdr);
+        free(data);
+        return false;
+}
+
+
+static bool load_corpus(corpus *c, const char *path)
+{
+    c->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    c->utf8 = read_file(path, &c->len);
+    if (!c->utf8) { fprintf(stderr, "Could not open %s\n", path); return false; }
+
+    c->utf32 = malloc((c->len + 1) * sizeof(uint32_t));
+    c->vertices = malloc((c->len + 1) * 6 * VERTEX_BYTES);
+    c->quads = malloc((c->len + 1) * sizeof(bf3_quad));
+    if (!c->utf32 || !c->vertices || !c->quads) { fprintf(stderr, "Malloc error (corpus)\n"); return false; }
+
+    // count the codepoints
+    utf8_decode_init(c->utf8, (int) c->len);
+    for (c->codepoints = 0; utf8_decode_next() >= 0; c->codepoints++) {}
+
+    return true;
+}
+
+
+// Every corpus, one after another, repeated to LONG_BYTES
+static bool load_long_corpus(corpus *c, const char *text, size_t len)
+{
+    c->name = "(all, long)";
+    if (!len) { return false; }
+
+    size_t repeats = (LONG_BYTES + len - 1) / len;
+    char *utf8 = malloc(repeats * len);
+    if (!utf8) { fprintf(stderr, "Malloc error (corpus)\n"); return false; }
+    for (size_t i = 0; i < repeats; i++) { memcpy(utf8 + (i * len), text, len); }
+    c->utf8 = utf8;
+    c->len = repeats * len;
+
+    c->utf32 = malloc((c->len + 1) * sizeof(uint32_t));
+    c->vertices = malloc((c->len + 1) * 6 * VERTEX_BYTES);
+    c->quads = malloc((c->len + 1) * sizeof(bf3_quad));
+    if (!c->utf32 || !c->vertices || !c->quads) { fprintf(stderr, "Malloc error (corpus)\n"); return false; }
+
+    c->codepoints = utf8_decode_bulk(c->utf8, c->len, c->utf32, c->len, NULL);
+    return true;
+}
+
+
+static void free_corpus(corpus *c)
+{
+    free((char *) c->utf8);
+    free(c->utf32);
+    free(c->vertices);
+    free(c->quads);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *path = (argc > 1) ? argv[1] : BENCH_DEFAULT_FILE;
+
+    font f;
+    if (!load_font(&f, path)) { return -1; }
+
+    printf("%-12s %-12s %8s %8s %8s %12s %12s %12s\n",
+        "corpus", "layout", "bytes", "glyphs", "quads", "Mglyphs/s", "Mquads/s", "output MB/s");
+
+    int num_corpora = (argc > 2) ? (argc - 2) : (int) (sizeof(default_corpora) / sizeof(default_corpora[0]));
+    int result = 0;
+    char *all_text = NULL;
+    size_t all_len = 0;
+
+    for (int i = 0; i < num_corpora; i++)
+    {
+        char buf[4096];
+        if (argc > 2) { snprintf(buf, sizeof(buf), "%s", argv[i + 2]); }
+        else { snprintf(buf, sizeof(buf), "%s/%s", BENCH_CORPUS_DIR, default_corpora[i]); }
+
+        corpus c;
+        memset(&c, 0, sizeof(c));
+        if (!load_corpus(&c, buf)) { free_corpus(&c); result = -1; continue; }
+
+        for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+            { run(&layouts[l], &f, &c); }
+
+        // keep a copy for the long corpus
+        char *all = realloc(all_text, all_len + c.len);
+        if (all) { memcpy(all + all_len, c.utf8, c.len); all_text = all; all_len += c.len; }
+
+        free_corpus(&c);
+    }
+
+    // and all of them, long enough that the quads don't fit in the cache
+    corpus c;
+    memset(&c, 0, sizeof(c));
+    if (load_long_corpus(&c, all_text, all_len))
+    {
+        for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+            { run(&layouts[l], &f, &c); }
+    }
+    free_corpus(&c);
+    free(all_text);
+
+    free(f.kerning);
+    free(f.metrics);
+
+    return result;
+}
@@ -0,0 +1,626 @@
+// Micro-benchmark of the bakefont3 loader
+
+// COMPILE:
+//     gcc -std=c99 -O2 bench/loader.c bakefont3.c lib/utf8.c -I. -lm -Wall -Wextra -o bench-loader.bin
+// USAGE:
+//     ./bench-loader.bin [data.bf3 ...]   (default: example/test.bf3)
+//
+// For each file, times bf3_header_load, bf3_metrics_load and bf3_kerning_load
+// for every table, then bf3_metric_get and bf3_kpair_get for each codepoint
+// (or adjacent pair of codepoints) of English, mixed European, CJK and random
+// text, and the FP26 rounding helpers over every metric in the largest table.
+//
+// The file is read into memory first, so the loads measure parsing and
+// copying, not the disk. Each benchmark is run for at least MIN_NS, five
+// times, and the fastest run is reported in nanoseconds per operation.
+//
+// On Linux, each run is also counted with perf_event_open: cycles,
+// instructions, cache misses and branch misses per operation. These show
+// "n/a" if the kernel doesn't allow it (e.g. in a container, or when
+// /proc/sys/kernel/perf_event_paranoid is 3 or more).
+
+
+#define _GNU_SOURCE // clock_gettime, syscall
+
+#include "bakefont3.h"
+#include "bench/common.h" // read_file, memfile
+#include "lib/utf8.h"
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, strerror
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+#   include <linux/perf_event.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#endif
+
+
+#define MIN_NS  20000000 // 20ms per run
+#define RUNS    5
+#define STREAM  65536    // codepoints in each stream
+
+
+// Anything written here is observed, so the compiler can't throw away the
+// result of a lookup being benchmarked.
+static volatile uint32_t sink;
+
+
+// ----------------------------------------------------------------------------
+// Codepoint streams
+
+// Each sample is repeated to fill a stream of STREAM codepoints
+
+static const char *sample_english =
+    "It was the best of times, it was the worst of times, it was the age of "
+    "wisdom, it was the age of foolishness, it was the epoch of belief, it was "
+    "the epoch of incredulity, it was the season of Light, it was the season "
+    "of Darkness, it was the spring of hope, it was the winter of despair. "
+    "\"AVAST!\" cried Mr. Watt; \"Yo, Tom - you've 42 W.T. forms to file (today).\" ";
+
+static const char *sample_european =
+    "Größere Änderungen über Straßen und Brücken müssen öffentlich erklärt "
+    "werden. Le cœur a ses raisons que la raison ne connaît point; ça, "
+    "c'était déjà évident à l'époque. ¿Dónde está la estación? Mañana, señor. "
+    "Zażółć gęślą jaźń. Příliš žluťoučký kůň úpěl ďábelské ódy. Þú færð "
+    "ekki að sjá. Τάχιστη αλώπηξ βαφής ψημένη γη, δρασκελίζει υπέρ νωθρού "
+    "κυνός. Съешь же ещё этих мягких французских булок, да выпей чаю. ";
+
+static const char *sample_cjk =
+    "天地玄黄，宇宙洪荒。日月盈昃，辰宿列张。寒来暑往，秋收冬藏。"
+    "吾輩は猫である。名前はまだ無い。どこで生れたかとんと見当がつかぬ。"
+    "何でも薄暗いじめじめした所でニャーニャー泣いていた事だけは記憶している。"
+    "모든 인간은 태어날 때부터 자유로우며 그 존엄과 권리에 있어 동등하다. ";
+
+
+static uint32_t *stream_from_text(const char *text)
+{
+    uint32_t *stream = malloc(STREAM * sizeof(uint32_t));
+    if (!stream) { return NULL; }
+
+    size_t n = 0;
+    while (n < STREAM)
+    {
+        utf8_decode_init(text, (int) strlen(text));
+        for (int c = utf8_decode_next(); (c >= 0) && (n < STREAM); c = utf8_decode_next())
+            { stream[n++] = (uint32_t) c; }
+    }
+
+    return stream;
+}
+
+
+// any codepoint in the Basic Multilingual Plane, except surrogates
+static uint32_t *stream_random(void)
+{
+    uint32_t *stream = malloc(STREAM * sizeof(uint32_t));
+    if (!stream) { return NULL; }
+
+    uint32_t x = 2463534242u; // xorshift32
+    for (size_t n = 0; n < STREAM; )
+    {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        uint32_t c = x & 0xFFFF;
+        if ((c >= 0xD800) && (c <= 0xDFFF)) { continue; }
+        if (c < 0x20) { continue; }
+        stream[n++] = c;
+    }
+
+    return stream;
+}
+
+
+// ----------------------------------------------------------------------------
+// Hardware counters
+
+enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, NUM_COUNTERS };
+
+static const char *counter_names[NUM_COUNTERS] =
+    {"cycles", "instr", "cache-miss", "branch-miss"};
+
+typedef struct counters counters;
+
+struct counters
+{
+    int fd[NUM_COUNTERS]; // -1 if unavailable
+    uint64_t value[NUM_COUNTERS];
+};
+
+
+static void counters_open(counters *c)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++) { c->fd[i] = -1; }
+
+#ifdef __linux__
+    static const uint64_t config[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        c->fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (c->fd[i] < 0 && i == 0)
+        {
+            fprintf(stderr, "hardware counters unavailable: %s\n", strerror(errno));
+        }
+    }
+#endif
+}
+
+
+static void counters_close(counters *c)
+{
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        { if (c->fd[i] >= 0) { close(c->fd[i]); } }
+#endif
+    (void) c;
+}
+
+
+static void counters_start(counters *c)
+{
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (c->fd[i] < 0) { continue; }
+        ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    (void) c;
+}
+
+
+static void counters_stop(counters *c)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        c->value[i] = 0;
+#ifdef __linux__
+        if (c->fd[i] < 0) { continue; }
+        ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (sizeof(uint64_t) != read(c->fd[i], &c->value[i], sizeof(uint64_t)))
+            { c->value[i] = 0; }
+#endif
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Benchmark runner
+
+static counters hw;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000u) + (uint64_t) ts.tv_nsec;
+}
+
+
+// A benchmark does `iterations` passes of some work and returns the number of
+// operations it did in one pass
+typedef size_t (*bench_fn)(void *arg, size_t iterations);
+
+
+static void print_header(void)
+{
+    printf("%-36s %10s %9s", "benchmark", "ops", "ns/op");
+    for (int i = 0; i < NUM_COUNTERS; i++) { printf(" %11s", counter_names[i]); }
+    printf("  %s\n", "note");
+}
+
+
+static void run(const char *name, const char *note, bench_fn fn, void *arg)
+{
+    // warm up, and find how many passes take at least MIN_NS
+    size_t iterations = 1;
+    for (;;)
+    {
+        uint64_t start = now_ns();
+        fn(arg, iterations);
+        if ((now_ns() - start) >= MIN_NS) { break; }
+        iterations *= 2;
+    }
+
+    double best = 0.0;
+    uint64_t best_counts[NUM_COUNTERS] = {0};
+    size_t ops = 0;
+
+    for (int r = 0; r < RUNS; r++)
+    {
+        counters_start(&hw);
+        uint64_t start = now_ns();
+        size_t per_pass = fn(arg, iterations);
+        uint64_t elapsed = now_ns() - start;
+        counters_stop(&hw);
+
+        ops = per_pass * iterations;
+        if (!ops) { break; }
+        double ns = (double) elapsed / (double) ops;
+        if ((r == 0) || (ns < best))
+        {
+            best = ns;
+            memcpy(best_counts, hw.value, sizeof(best_counts));
+        }
+    }
+
+    printf("%-36s %10zu %9.2f", name, ops, best);
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if ((hw.fd[i] < 0) || !ops) { printf(" %11s", "n/a"); }
+        else { printf(" %11.2f", (double) best_counts[i] / (double) ops); }
+    }
+    printf("  %s\n", note ? note : "");
+}
+
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+
+typedef struct bench_load bench_load;
+
+struct bench_load
+{
+    bf3_filelike *reader;
+    char *hdr;
+    bf3_table *table;
+    char *buf;
+};
+
+
+static size_t bench_header_load(void *arg, size_t iterations)
+{
+    bench_load *b = arg;
+    bf3_info info;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t header_size = bf3_header_peek(b->reader);
+        sink = bf3_header_load(&info, b->hdr, b->reader, header_size);
+        sink = (uint32_t) info.num_tables;
+    }
+
+    return 1;
+}
+
+
+static size_t bench_metrics_load(void *arg, size_t iterations)
+{
+    bench_load *b = arg;
+
+    for (size_t i = 0; i < iterations; i++)
+        { sink = bf3_metrics_load(b->buf, b->reader, b->table); }
+
+    return 1;
+}
+
+
+static size_t bench_kerning_load(void *arg, size_t iterations)
+{
+    bench_load *b = arg;
+
+    for (size_t i = 0; i < iterations; i++)
+        { sink = bf3_kerning_load(b->buf, b->reader, b->table); }
+
+    return 1;
+}
+
+
+typedef struct bench_lookup bench_lookup;
+
+struct bench_lookup
+{
+    const char *buf; // metrics or kerning
+    const uint32_t *stream;
+    size_t hits;
+};
+
+
+static size_t bench_metric_get(void *arg, size_t iterations)
+{
+    bench_lookup *b = arg;
+    bf3_metric metric;
+    size_t hits = 0;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        for (size_t n = 0; n < STREAM; n++)
+        {
+            if (bf3_metric_get(&metric, b->buf, b->stream[n]))
+                { hits++; sink = (uint32_t) metric.hadvance; }
+        }
+    }
+
+    b->hits = hits / iterations;
+    return STREAM;
+}
+
+
+static size_t bench_kpair_get(void *arg, size_t iterations)
+{
+    bench_lookup *b = arg;
+    bf3_kpair kpair;
+    size_t hits = 0;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        for (size_t n = 1; n < STREAM; n++)
+        {
+            if (bf3_kpair_get(&kpair, b->buf, b->stream[n-1], b->stream[n]))
+                { hits++; sink = (uint32_t) kpair.x; }
+        }
+    }
+
+    b->hits = hits / iterations;
+    return STREAM - 1;
+}
+
+
+typedef struct bench_fp26 bench_fp26;
+
+struct bench_fp26
+{
+    const bf3_fp26 *values;
+    size_t count;
+};
+
+
+static size_t bench_fp26_nearest(void *arg, size_t iterations)
+{
+    bench_fp26 *b = arg;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        int total = 0;
+        for (size_t n = 0; n < b->count; n++)
+            { total += BF3_DECODE_FP26_NEAREST(b->values[n]); }
+        sink = (uint32_t) total;
+    }
+
+    return b->count;
+}
+
+
+static size_t bench_fp26_ceil(void *arg, size_t iterations)
+{
+    bench_fp26 *b = arg;
+    const bf3_fp26 tolerance = BF3_ENCODE_FP26(12.0f/64.0f);
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        int total = 0;
+        for (size_t n = 0; n < b->count; n++)
+            { total += BF3_DECODE_FP26_CEIL(b->values[n], tolerance); }
+        sink = (uint32_t) total;
+    }
+
+    return b->count;
+}
+
+
+static size_t bench_fp26_floor(void *arg, size_t iterations)
+{
+    bench_fp26 *b = arg;
+    const bf3_fp26 tolerance = BF3_ENCODE_FP26(12.0f/64.0f);
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        int total = 0;
+        for (size_t n = 0; n < b->count; n++)
+            { total += BF3_DECODE_FP26_FLOOR(b->values[n], tolerance); }
+        sink = (uint32_t) total;
+    }
+
+    return b->count;
+}
+
+
+// ----------------------------------------------------------------------------
+
+typedef struct stream stream;
+
+struct stream
+{
+    const char *name;
+    uint32_t *codepoints;
+};
+
+
+static bool bench_file(const char *path, stream *streams, int num_streams)
+{
+    memfile file;
+    char *data = read_file(path, &file.size);
+    if (!data) { fprintf(stderr, "Could not open %s\n", path); return false; }
+    file.data = data;
+
+    bf3_filelike reader = {(void *) &file, read_memfile};
+
+    size_t header_size = bf3_header_peek(&reader);
+    if (!header_size) { fprintf(stderr, "Not a bf3 file %s\n", path); free(data); return false; }
+
+    char *hdr = malloc(header_size);
+    if (!hdr) { fprintf(stderr, "Malloc error (header)\n"); free(data); return false; }
+
+    bf3_info info;
+    if (!bf3_header_load(&info, hdr, &reader, header_size))
+        { fprintf(stderr, "Error reading header\n"); free(hdr); free(data); return false; }
+
+    printf("\n%s: %zu bytes, %dx%dx%d, %d fonts, %d modes, %d tables\n\n", path,
+        file.size, info.width, info.height, info.depth,
+        info.num_fonts, info.num_modes, info.num_tables);
+    print_header();
+
+    char name[80], note[80];
+    bench_load load = {&reader, hdr, NULL, NULL};
+    run("header_load", NULL, bench_header_load, &load);
+
+    // find the largest metrics and kerning tables to look up into
+    bf3_table metrics_table, kerning_table;
+    bf3_table_get(&metrics_table, hdr, 0);
+    bf3_table_get(&kerning_table, hdr, 0);
+
+    size_t max_size = 0;
+    for (int i = 0; i < info.num_tables; i++)
+    {
+        bf3_table table;
+        bf3_table_get(&table, hdr, i);
+        if (table.metrics_size > max_size) { max_size = table.metrics_size; }
+        if (table.kerning_size > max_size) { max_size = table.kerning_size; }
+        if (table.metrics_size > metrics_table.metrics_size) { metrics_table = table; }
+        if (table.kerning_size > kerning_table.kerning_size) { kerning_table = table; }
+    }
+
+    char *buf = malloc(max_size);
+    if (!buf) { fprintf(stderr, "Malloc error (tables)\n"); free(hdr); free(data); return false; }
+    load.buf = buf;
+
+    for (int i = 0; i < info.num_tables; i++)
+    {
+        bf3_table table;
+        bf3_table_get(&table, hdr, i);
+        load.table = &table;
+
+        snprintf(note, sizeof(note), "%u glyphs", (unsigned int) ((table.metrics_size - 4) / 40));
+        snprintf(name, sizeof(name), "metrics_load[%d %.20s]", table.mode_id, table.name);
+        run(name, note, bench_metrics_load, &load);
+
+        snprintf(note, sizeof(note), "%u pairs", (unsigned int) ((table.kerning_size - 4) / 16));
+        snprintf(name, sizeof(name), "kerning_load[%d %.20s]", table.mode_id, table.name);
+        run(name, note, bench_kerning_load, &load);
+    }
+
+    char *metrics = malloc(metrics_table.metrics_size);
+    char *kerning = malloc(kerning_table.kerning_size);
+    if (!metrics || !kerning) { fprintf(stderr, "Malloc error (tables)\n"); goto fail; }
+    if (!bf3_metrics_load(metrics, &reader, &metrics_table))
+        { fprintf(stderr, "Error reading metrics\n"); goto fail; }
+    if (!bf3_kerning_load(kerning, &reader, &kerning_table))
+        { fprintf(stderr, "Error reading kerning\n"); goto fail; }
+
+    printf("\nlookups: metrics in table %d (%u glyphs), kerning in table %d (%u pairs)\n\n",
+        metrics_table.table_id, (unsigned int) ((metrics_table.metrics_size - 4) / 40),
+        kerning_table.table_id, (unsigned int) ((kerning_table.kerning_size - 4) / 16));
+    print_header();
+
+    for (int i = 0; i < num_streams; i++)
+    {
+        bench_lookup lookup = {metrics, streams[i].codepoints, 0};
+        bench_metric_get(&lookup, 1);
+        snprintf(note, sizeof(note), "%.1f%% found", 100.0 * (double) lookup.hits / STREAM);
+        snprintf(name, sizeof(name), "metric_get[%s]", streams[i].name);
+        run(name, note, bench_metric_get, &lookup);
+    }
+
+    for (int i = 0; i < num_streams; i++)
+    {
+        bench_lookup lookup = {kerning, streams[i].codepoints, 0};
+        bench_kpair_get(&lookup, 1);
+        snprintf(note, sizeof(note), "%.1f%% found", 100.0 * (double) lookup.hits / (STREAM - 1));
+        snprintf(name, sizeof(name), "kpair_get[%s]", streams[i].name);
+        run(name, note, bench_kpair_get, &lookup);
+    }
+
+    // every FP26 value of every metric in the largest table
+    {
+        uint32_t nmemb;
+        memcpy(&nmemb, metrics, 4);
+
+        bench_fp26 fp26 = {NULL, (size_t) nmemb * 6};
+        bf3_fp26 *values = malloc((fp26.count ? fp26.count : 1) * sizeof(bf3_fp26));
+        if (!values) { fprintf(stderr, "Malloc error (fp26)\n"); goto fail; }
+
+        for (uint32_t n = 0; n < nmemb; n++)
+        {
+            uint32_t codepoint;
+            bf3_metric metric;
+            memcpy(&codepoint, metrics + 4 + (40 * n), 4);
+            bf3_metric_get(&metric, metrics, codepoint);
+
+            bf3_fp26 *v = values + (6 * n);
+            v[0] = metric.hbx; v[1] = metric.hby; v[2] = metric.hadvance;
+            v[3] = metric.vbx; v[4] = metric.vby; v[5] = metric.vadvance;
+        }
+        fp26.values = values;
+
+        printf("\n");
+        print_header();
+        snprintf(note, sizeof(note), "%zu values", fp26.count);
+        run("fp26_nearest", note, bench_fp26_nearest, &fp26);
+        run("fp26_ceil", note, bench_fp26_ceil, &fp26);
+        run("fp26_floor", note, bench_fp26_floor, &fp26);
+
+        free(values);
+    }
+
+    free(kerning);
+    free(metrics);
+    free(buf);
+    free(hdr);
+    free(data);
+    return true;
+
+    fail:
+        free(kerning);
+        free(metrics);
+        free(buf);
+        free(hdr);
+        free(data);
+        return false;
+}
+
+
+#ifndef BENCH_DEFAULT_FILE
+#   define BENCH_DEFAULT_FILE "example/test.bf3"
+#endif
+
+int main(int argc, char *argv[])
+{
+    stream streams[] = {
+        {"english",  stream_from_text(sample_english)},
+        {"european", stream_from_text(sample_european)},
+        {"cjk",      stream_from_text(sample_cjk)},
+        {"random",   stream_random()},
+    };
+    const int num_streams = sizeof(streams) / sizeof(streams[0]);
+
+    for (int i = 0; i < num_streams; i++)
+    {
+        if (!streams[i].codepoints) { fprintf(stderr, "Malloc error (streams)\n"); return -1; }
+    }
+
+    counters_open(&hw);
+
+    int result = 0;
+    if (argc < 2)
+    {
+        if (!bench_file(BENCH_DEFAULT_FILE, streams, num_streams)) { result = -1; }
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!bench_file(argv[i], streams, num_streams)) { result = -1; }
+    }
+
+    counters_close(&hw);
+    for (int i = 0; i < num_streams; i++) { free(streams[i].codepoints); }
+
+    return result;
+}
@@ -0,0 +1,1657 @@
+// bf3-bake - native bakefont3 generator
+
+// Rasterises, packs and encodes font glyphs into a .bf3 file and a PNG texture
+// atlas, like bakefont3.pack in Python, but configured by a manifest file and
+// using FreeType and libpng directly. Rendering and kerning run on a pool of
+// threads (each with its own FreeType faces), overlapping with packing.
+
+// COMPILE:
+//     gcc -std=c99 -O2 bf3-bake.c lib/utf8.c -Wall -Wextra -o bf3-bake
+//         $(pkg-config --cflags --libs freetype2 libpng) -lpthread -lm
+// USAGE:
+//     ./bf3-bake [-q] [-j threads] example.manifest
+//         -q: no progress messages or notices about missing characters
+
+// MANIFEST:
+//
+// One directive per line. Anything after a '#' is a comment, and a "quoted
+// string" may contain spaces.
+//
+//     font   NAME PATH                  # a font file (~/ is $HOME/), looked
+//                                       # up by NAME in the .bf3 file
+//     table  FONT SIZE MODE NAME CHARS  # a table NAME of the characters CHARS
+//                                       # for the font mode (FONT, SIZE, MODE)
+//                                       # where MODE is `aa`, `mono` or `sdf`
+//     sizes  WxHxD WxHxD ...            # texture atlas sizes, in order of
+//                                       # preference, or one of:
+//     sizes  powers-of-two DEPTH [MINIMUM MAXIMUM]
+//     sizes  squares DEPTH STEP [MINIMUM MAXIMUM]
+//     sizes  rectangles DEPTH STEP [MINIMUM MAXIMUM]
+//     search linear|bisect              # (default linear)
+//     bits   8|4|1                      # bits per glyph in the atlas (8)
+//     dither yes|no                     # ordered dither for bits 4 (no)
+//     dedupe yes|no                     # share identical bitmaps (yes)
+//     spread PIXELS                     # for sdf font modes (4)
+//     threads N                         # (default: one per CPU)
+//     output FILE.bf3                   # (default test.bf3)
+//     atlas  FILE.png                   # (default test.png)
+//
+// CHARS is any number of "literal strings" (UTF-8), codepoints like U+1EFA,
+// ranges like U+0020-U+007E, or `all` for every character in the font. There
+// is no limit on the length of a line.
+//
+// The parameters mean the same as the arguments of bakefont3.pack, and the
+// output is the same format, so bakefont3.c loads it just the same.
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <png.h>
+#include <pthread.h>
+#include <unistd.h> // sysconf
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h> // malloc, free, qsort
+#include <string.h> // memcpy, memcmp, strcmp
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include "lib/utf8.h"
+
+
+#define ENCODER "Bakefont 3.0.2 bf3-bake (https://github.com/golightlyb/bakefont3)"
+
+// a SDF is computed from a bitmap rendered at this many times the mode size
+#define SDF_OVERSAMPLE 4
+
+// number of glyphs rendered by each job
+#define CHUNK 64
+
+enum { MODE_MONO = 0, MODE_AA = 1, MODE_SDF = 2 }; // in file order
+
+
+static bool quiet = false;
+
+static void die(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "bf3-bake: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+static void stage(const char *msg)
+{
+    if (!quiet) { printf("%s...\n", msg); fflush(stdout); }
+}
+
+static void info(const char *fmt, ...)
+{
+    if (quiet) { return; }
+    va_list args;
+    va_start(args, fmt);
+    printf("    (");
+    vprintf(fmt, args);
+    printf(")\n");
+    va_end(args);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) { die("out of memory"); }
+    return ptr;
+}
+
+static void *xcalloc(size_t num, size_t size)
+{
+    void *ptr = calloc(num ? num : 1, size ? size : 1);
+    if (!ptr) { die("out of memory"); }
+    return ptr;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size ? size : 1);
+    if (!ptr) { die("out of memory"); }
+    return ptr;
+}
+
+// Python-style division, rounding towards -ve infinity
+static int floordiv(int a, int b)
+{
+    int q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) { q--; }
+    return q;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// sort and remove duplicates, returning the new count
+static size_t unique_uint32(uint32_t *values, size_t count)
+{
+    if (!count) { return 0; }
+    qsort(values, count, sizeof(uint32_t), cmp_uint32);
+    size_t n = 1;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (values[i] != values[n - 1]) { values[n++] = values[i]; }
+    }
+    return n;
+}
+
+
+// -----------------------------------------------------------------------------
+// The bake: everything read from the manifest, and everything produced
+// -----------------------------------------------------------------------------
+
+typedef struct font font;
+struct font
+{
+    char name[44];
+    char *path;
+    FT_Face face; // owned by the main thread, for font-wide information
+};
+
+typedef struct glyph glyph;
+struct glyph
+{
+    uint32_t codepoint;
+    bool present; // false if the font doesn't have this codepoint
+    unsigned char *coverage; // width * height bytes, or NULL
+    int width, height;
+    int bitmap_left, bitmap_top;
+    FT_Pos horiBearingX, horiBearingY, horiAdvance;
+    FT_Pos vertBearingX, vertBearingY, vertAdvance;
+    int x0, y0, z0, depth; // position in the texture atlas, once fitted
+    size_t rank; // mode order, then codepoint order (for a stable sort)
+};
+
+typedef struct mode mode;
+struct mode
+{
+    int font;
+    double size;
+    int antialias; // MODE_MONO, MODE_AA, MODE_SDF
+    uint32_t *codepoints; // superset of every table using this mode (sorted)
+    size_t count;
+    glyph *glyphs; // one per codepoint, in the same order
+};
+
+typedef struct table table;
+struct table
+{
+    int mode; // index into bake.modes, once sorted
+    char name[20];
+    uint32_t *codepoints; // sorted
+    size_t count;
+    unsigned char *kerning; // KERN records, gathered by a worker
+    size_t kerning_size;
+
+    // (only while reading the manifest)
+    int font, antialias; double size;
+};
+
+typedef struct size3 size3;
+struct size3 { int width, height, depth; };
+
+static struct
+{
+    font *fonts; int num_fonts;
+    mode *modes; int num_modes;
+    table *tables; int num_tables;
+    size3 *sizes; int num_sizes;
+
+    bool bisect;
+    int bits;
+    bool dither;
+    bool dedupe;
+    int spread;
+    int threads;
+    const char *output;
+    const char *atlas;
+
+    size3 size; // chosen texture atlas size, or zero
+    unsigned char *pixels; // the texture atlas (height, width, depth)
+} bake;
+
+static FT_Library library; // for the main thread
+
+
+// -----------------------------------------------------------------------------
+// Reading the manifest
+// -----------------------------------------------------------------------------
+
+static int find_font(const char *name)
+{
+    for (int i = 0; i < bake.num_fonts; i++)
+    {
+        if (0 == strcmp(bake.fonts[i].name, name)) { return i; }
+    }
+    return -1;
+}
+
+// split a line into whitespace-separated tokens, in-place, with "quoted
+// strings" as one token, growing the arrays of tokens as needed. Returns the
+// number of tokens.
+static int tokenise(char *line, char ***tokens_, bool **quoted_, int *capacity, int lineno)
+{
+    int n = 0;
+    char *p = line;
+
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { p++; }
+        if (!*p || *p == '#') { break; }
+        if (n == *capacity)
+        {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *tokens_ = xrealloc(*tokens_, (size_t) *capacity * sizeof(char *));
+            *quoted_ = xrealloc(*quoted_, (size_t) *capacity * sizeof(bool));
+        }
+        char **tokens = *tokens_;
+        bool *quoted = *quoted_;
+
+        if (*p == '"')
+        {
+            char *end = strchr(p + 1, '"');
+            if (!end) { die("line %d: missing closing quote", lineno); }
+            *end = '\0';
+            quoted[n] = true;
+            tokens[n++] = p + 1;
+            p = end + 1;
+        }
+        else
+        {
+            quoted[n] = false;
+            tokens[n++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') { p++; }
+            if (*p) { *p++ = '\0'; }
+        }
+    }
+
+    return n;
+}
+
+static long parse_int(const char *s, int lineno)
+{
+    char *end;
+    long value = strtol(s, &end, 10);
+    if (end == s || *end) { die("line %d: expected a number, got %s", lineno, s); }
+    return value;
+}
+
+static bool parse_bool(const char *s, int lineno)
+{
+    if (0 == strcmp(s, "yes")) { return true; }
+    if (0 == strcmp(s, "no"))  { return false; }
+    die("line %d: expected yes or no, got %s", lineno, s);
+    return false;
+}
+
+static uint32_t parse_codepoint(const char *s, const char **end, int lineno)
+{
+    if (s[0] != 'U' || s[1] != '+') { die("line %d: expected U+XXXX, got %s", lineno, s); }
+    char *stop;
+    unsigned long value = strtoul(s + 2, &stop, 16);
+    if (stop == s + 2 || value > 0x10FFFF) { die("line %d: invalid codepoint %s", lineno, s); }
+    *end = stop;
+    return (uint32_t) value;
+}
+
+static void push_codepoint(table *t, size_t *capacity, uint32_t codepoint)
+{
+    if (t->count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        t->codepoints = xrealloc(t->codepoints, *capacity * sizeof(uint32_t));
+    }
+    t->codepoints[t->count++] = codepoint;
+}
+
+static void add_size(int width, int height, int depth, int *capacity)
+{
+    if (bake.num_sizes == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        bake.sizes = xrealloc(bake.sizes, (size_t) *capacity * sizeof(size3));
+    }
+    bake.sizes[bake.num_sizes++] = (size3) {width, height, depth};
+}
+
+static void parse_sizes(char **tokens, int n, int lineno, int *capacity)
+{
+    const char *kind = tokens[1];
+    bake.num_sizes = 0;
+
+    if (0 == strcmp(kind, "powers-of-two"))
+    {
+        if (n != 3 && n != 5) { die("line %d: sizes powers-of-two DEPTH [MINIMUM MAXIMUM]", lineno); }
+        int depth = parse_int(tokens[2], lineno);
+        long minimum = (n == 5) ? parse_int(tokens[3], lineno) : 64;
+        long maximum = (n == 5) ? parse_int(tokens[4], lineno) : 16384;
+        if (minimum < 1) { die("line %d: invalid minimum", lineno); }
+        for (long size = minimum; size <= maximum; size *= 2)
+            { add_size(size, size, depth, capacity); }
+    }
+    else if (0 == strcmp(kind, "squares") || 0 == strcmp(kind, "rectangles"))
+    {
+        if (n != 4 && n != 6) { die("line %d: sizes %s DEPTH STEP [MINIMUM MAXIMUM]", lineno, kind); }
+        int depth = parse_int(tokens[2], lineno);
+        long step = parse_int(tokens[3], lineno);
+        long minimum = (n == 6) ? parse_int(tokens[4], lineno) : 64;
+        long maximum = (n == 6) ? parse_int(tokens[5], lineno) : 16384;
+        if (step < 1) { die("line %d: invalid step", lineno); }
+
+        if (kind[0] == 's')
+        {
+            for (long size = minimum; size <= maximum; size += step)
+                { add_size(size, size, depth, capacity); }
+        }
+        else
+        {
+            // as bakefont3.sizes.rectangles
+            long width = minimum, height = minimum;
+            while (height <= maximum)
+            {
+                add_size(width, height, depth, capacity);
+                if (width > height)                { height += step; }
+                else if (width + step <= maximum)  { width += step; }
+                else                               { height += step; }
+            }
+        }
+    }
+    else
+    {
+        for (int i = 1; i < n; i++)
+        {
+            int width, height, depth; char extra;
+            if (3 != sscanf(tokens[i], "%dx%dx%d%c", &width, &height, &depth, &extra))
+                { die("line %d: expected a size WxHxD, got %s", lineno, tokens[i]); }
+            add_size(width, height, depth, capacity);
+        }
+    }
+
+    for (int i = 0; i < bake.num_sizes; i++)
+    {
+        size3 s = bake.sizes[i];
+        if (s.depth != 1 && s.depth != 3 && s.depth != 4)
+            { die("line %d: invalid depth (expected 1, 3, 4) got %d", lineno, s.depth); }
+        if (s.width < 1 || s.height < 1 || s.width > 65535 || s.height > 65535)
+            { die("line %d: invalid size %dx%d", lineno, s.width, s.height); }
+    }
+}
+
+static void parse_table(char **tokens, bool *quoted, int n, int lineno)
+{
+    if (n < 6) { die("line %d: table FONT SIZE MODE NAME CHARS...", lineno); }
+
+    table t = {0};
+    size_t capacity = 0;
+
+    t.font = find_font(tokens[1]);
+    if (t.font < 0) { die("line %d: table references a missing font name %s", lineno, tokens[1]); }
+
+    char *end;
+    t.size = strtod(tokens[2], &end);
+    if (end == tokens[2] || *end || !(1 < t.size && t.size < 255))
+        { die("line %d: invalid size %s", lineno, tokens[2]); }
+
+    if      (0 == strcmp(tokens[3], "mono")) { t.antialias = MODE_MONO; }
+    else if (0 == strcmp(tokens[3], "aa"))   { t.antialias = MODE_AA; }
+    else if (0 == strcmp(tokens[3], "sdf"))  { t.antialias = MODE_SDF; }
+    else { die("line %d: invalid mode (expected aa, mono, sdf) got %s", lineno, tokens[3]); }
+
+    if (strlen(tokens[4]) >= sizeof(t.name)) { die("line %d: table name too long", lineno); }
+    strcpy(t.name, tokens[4]);
+
+    for (int i = 5; i < n; i++)
+    {
+        const char *s = tokens[i];
+
+        if (quoted[i])
+        {
+            utf8_decode_init(s, (int) strlen(s));
+            int c;
+            while ((c = utf8_decode_next()) >= 0) { push_codepoint(&t, &capacity, (uint32_t) c); }
+            if (c == UTF8_ERROR) { die("line %d: invalid UTF-8 in %s", lineno, s); }
+        }
+        else if (0 == strcmp(s, "all"))
+        {
+            FT_Face face = bake.fonts[t.font].face;
+            FT_UInt index;
+            FT_ULong c = FT_Get_First_Char(face, &index);
+            while (index)
+            {
+                push_codepoint(&t, &capacity, (uint32_t) c);
+                c = FT_Get_Next_Char(face, c, &index);
+            }
+        }
+        else
+        {
+            const char *rest;
+            uint32_t first = parse_codepoint(s, &rest, lineno), last = first;
+            if (*rest == '-') { last = parse_codepoint(rest + 1, &rest, lineno); }
+            if (*rest || last < first) { die("line %d: invalid range %s", lineno, s); }
+            for (uint32_t c = first; c <= last; c++) { push_codepoint(&t, &capacity, c); }
+        }
+    }
+
+    t.count = unique_uint32(t.codepoints, t.count);
+
+    for (int i = 0; i < bake.num_tables; i++)
+    {
+        table *other = &bake.tables[i];
+        if ((other->font == t.font) && (other->size == t.size) &&
+            (other->antialias == t.antialias) && (0 == strcmp(other->name, t.name)))
+            { die("line %d: duplicate (mode, table name) pair %s", lineno, t.name); }
+    }
+
+    bake.tables = xrealloc(bake.tables, (size_t) (bake.num_tables + 1) * sizeof(table));
+    bake.tables[bake.num_tables++] = t;
+}
+
+static void parse_manifest(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) { die("could not open %s", filename); }
+
+    // lines (and the number of values on a line) are unlimited, so that a
+    // large charset can be written out one codepoint at a time
+    char *line = NULL;
+    size_t line_capacity = 0;
+    char **tokens = NULL;
+    bool *quoted = NULL;
+    int tokens_capacity = 0;
+    int lineno = 0;
+    int sizes_capacity = 0;
+
+    while (getline(&line, &line_capacity, fp) >= 0)
+    {
+        lineno++;
+
+        int n = tokenise(line, &tokens, &quoted, &tokens_capacity, lineno);
+        if (!n) { continue; }
+        const char *directive = tokens[0];
+
+        if (0 == strcmp(directive, "font"))
+        {
+            if (n != 3) { die("line %d: font NAME PATH", lineno); }
+            if (strlen(tokens[1]) >= 44) { die("line %d: font name too long", lineno); }
+            if (find_font(tokens[1]) >= 0) { die("line %d: duplicate font name %s", lineno, tokens[1]); }
+
+            font f;
+            memset(&f, 0, sizeof(f));
+            strcpy(f.name, tokens[1]);
+            const char *home = getenv("HOME");
+            if (home && (0 == strncmp(tokens[2], "~/", 2)))
+            {
+                // e.g. "~/.fonts/Roboto-Regular.ttf"
+                f.path = xmalloc(strlen(home) + strlen(tokens[2]));
+                sprintf(f.path, "%s%s", home, tokens[2] + 1);
+            }
+            else { f.path = strdup(tokens[2]); }
+            if (FT_New_Face(library, f.path, 0, &f.face)) { die("could not load font %s", f.path); }
+            if (!FT_IS_SCALABLE(f.face)) { die("font %s is not scalable", f.path); }
+
+            bake.fonts = xrealloc(bake.fonts, (size_t) (bake.num_fonts + 1) * sizeof(font));
+            bake.fonts[bake.num_fonts++] = f;
+        }
+        else if (0 == strcmp(directive, "table"))  { parse_table(tokens, quoted, n, lineno); }
+        else if (n != 2 && 0 != strcmp(directive, "sizes"))
+            { die("line %d: expected one value for %s", lineno, directive); }
+        else if (0 == strcmp(directive, "sizes"))  { parse_sizes(tokens, n, lineno, &sizes_capacity); }
+        else if (0 == strcmp(directive, "bits"))   { bake.bits = parse_int(tokens[1], lineno); }
+        else if (0 == strcmp(directive, "dither")) { bake.dither = parse_bool(tokens[1], lineno); }
+        else if (0 == strcmp(directive, "dedupe")) { bake.dedupe = parse_bool(tokens[1], lineno); }
+        else if (0 == strcmp(directive, "spread")) { bake.spread = parse_int(tokens[1], lineno); }
+        else if (0 == strcmp(directive, "threads") && !bake.threads)
+            { bake.threads = parse_int(tokens[1], lineno); }
+        else if (0 == strcmp(directive, "threads")) { } // -j on the command line wins
+        else if (0 == strcmp(directive, "output")) { bake.output = strdup(tokens[1]); }
+        else if (0 == strcmp(directive, "atlas"))  { bake.atlas = strdup(tokens[1]); }
+        else if (0 == strcmp(directive, "search"))
+        {
+            if      (0 == strcmp(tokens[1], "linear")) { bake.bisect = false; }
+            else if (0 == strcmp(tokens[1], "bisect")) { bake.bisect = true; }
+            else { die("line %d: invalid search (expected linear, bisect) got %s", lineno, tokens[1]); }
+        }
+        else { die("line %d: unknown directive %s", lineno, directive); }
+    }
+
+    free(line);
+    free(tokens);
+    free(quoted);
+    fclose(fp);
+
+    if (!bake.num_tables) { die("%s has no tables", filename); }
+
+    if (bake.bits != 8 && bake.bits != 4 && bake.bits != 1)
+        { die("invalid bits (expected 8, 4, 1) got %d", bake.bits); }
+    if (!(0 < bake.spread && bake.spread < 128))
+        { die("invalid spread %d", bake.spread); }
+
+    for (int i = 0; i < bake.num_tables; i++)
+    {
+        if ((bake.bits == 1) && (bake.tables[i].antialias != MODE_MONO))
+            { die("bits 1 needs mode mono for every font mode"); }
+        if ((bake.bits < 8) && (bake.tables[i].antialias == MODE_SDF))
+            { die("sdf font modes need bits 8"); }
+    }
+
+    if (!bake.num_sizes)
+    {
+        for (int size = 64; size <= 16384; size *= 2)
+            { add_size(size, size, 4, &sizes_capacity); }
+    }
+}
+
+
+// construct the font modes from the tables, sorted by ascending font ID,
+// size (and mono, aa, sdf) and the superset of characters for each
+static int cmp_mode(const void *a, const void *b)
+{
+    const mode *x = a, *y = b;
+    if (x->font != y->font) { return x->font - y->font; }
+    if (x->size != y->size) { return (x->size > y->size) - (x->size < y->size); }
+    return x->antialias - y->antialias;
+}
+
+static void make_modes(void)
+{
+    bake.modes = xcalloc((size_t) bake.num_tables, sizeof(mode));
+
+    for (int i = 0; i < bake.num_tables; i++)
+    {
+        table *t = &bake.tables[i];
+        bool seen = false;
+        for (int j = 0; j < bake.num_modes; j++)
+        {
+            mode *m = &bake.modes[j];
+            if ((m->font == t->font) && (m->size == t->size) && (m->antialias == t->antialias))
+                { seen = true; }
+        }
+        if (!seen) { bake.modes[bake.num_modes++] = (mode) {t->font, t->size, t->antialias, NULL, 0, NULL}; }
+    }
+
+    qsort(bake.modes, (size_t) bake.num_modes, sizeof(mode), cmp_mode);
+
+    for (int j = 0; j < bake.num_modes; j++)
+    {
+        mode *m = &bake.modes[j];
+        size_t count = 0;
+
+        for (int i = 0; i < bake.num_tables; i++)
+        {
+            table *t = &bake.tables[i];
+            if ((m->font == t->font) && (m->size == t->size) && (m->antialias == t->antialias))
+            {
+                t->mode = j;
+                m->codepoints = xrealloc(m->codepoints, (count + t->count) * sizeof(uint32_t));
+                memcpy(m->codepoints + count, t->codepoints, t->count * sizeof(uint32_t));
+                count += t->count;
+            }
+        }
+
+        m->count = unique_uint32(m->codepoints, count);
+        m->glyphs = xcalloc(m->count, sizeof(glyph));
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// Rendering (on a worker thread, with its own FreeType library and faces)
+// -----------------------------------------------------------------------------
+
+typedef struct worker worker;
+struct worker
+{
+    pthread_t thread;
+    FT_Library library;
+    FT_Face *faces; // one per font, opened on first use
+};
+
+static FT_Face worker_face(worker *w, int fontID, double size)
+{
+    if (!w->faces[fontID])
+    {
+        if (FT_New_Face(w->library, bake.fonts[fontID].path, 0, &w->faces[fontID]))
+            { die("could not load font %s", bake.fonts[fontID].path); }
+    }
+
+    FT_Face face = w->faces[fontID];
+    // typographic DPI where 1pt = 1px
+    if (FT_Set_Char_Size(face, (FT_F26Dot6) (size * 64.0), 0, 72, 0))
+        { die("could not set font size %g", size); }
+    return face;
+}
+
+static void copy_metrics(glyph *g, FT_GlyphSlot slot)
+{
+    g->horiBearingX = slot->metrics.horiBearingX;
+    g->horiBearingY = slot->metrics.horiBearingY;
+    g->horiAdvance  = slot->metrics.horiAdvance;
+    g->vertBearingX = slot->metrics.vertBearingX;
+    g->vertBearingY = slot->metrics.vertBearingY;
+    g->vertAdvance  = slot->metrics.vertAdvance;
+}
+
+// as bakefont3.Render._init_sdf: a single-channel signed distance field, 128 on
+// the outline, 255 at `spread` pixels (or more) inside it, and 0 at `spread`
+// pixels (or more) outside it. Metrics are unhinted, for scaling to any size.
+static void render_sdf(glyph *g, FT_Face face, double size)
+{
+    const int scale = SDF_OVERSAMPLE;
+    const int spread = bake.spread;
+
+    // unhinted metrics at the mode size
+    if (FT_Load_Char(face, g->codepoint, FT_LOAD_NO_HINTING))
+        { die("could not load codepoint %#x", g->codepoint); }
+    copy_metrics(g, face->glyph);
+
+    // oversampled bitmap to measure distances from
+    if (FT_Set_Char_Size(face, (FT_F26Dot6) (size * 64.0 * scale), 0, 72, 0))
+        { die("could not set font size %g", size * scale); }
+    if (FT_Load_Char(face, g->codepoint, FT_LOAD_RENDER | FT_LOAD_NO_HINTING))
+        { die("could not render codepoint %#x", g->codepoint); }
+    if (FT_Set_Char_Size(face, (FT_F26Dot6) (size * 64.0), 0, 72, 0))
+        { die("could not set font size %g", size); }
+
+    FT_Bitmap *bitmap = &face->glyph->bitmap;
+    int width  = (int) bitmap->width;
+    int height = (int) bitmap->rows;
+    int pitch  = bitmap->pitch;
+    int left   = face->glyph->bitmap_left;
+    int top    = face->glyph->bitmap_top;
+
+    if (pitch < 0) { die("codepoint %#x: negative bitmap pitch is not supported", g->codepoint); }
+    if (!((width > 0) && (height > 0))) { return; } // empty
+
+    // outline pixels: inside pixels next to an outside pixel
+    #define INSIDE(x, y) (((x) >= 0) && ((x) < width) && ((y) >= 0) && ((y) < height) \
+        && (bitmap->buffer[((y) * pitch) + (x)] >= 128))
+
+    size_t num_edges = 0;
+    double *edges = xmalloc((size_t) width * (size_t) height * 2 * sizeof(double));
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            if (!INSIDE(x, y)) { continue; }
+            if (INSIDE(x, y - 1) && INSIDE(x, y + 1) && INSIDE(x - 1, y) && INSIDE(x + 1, y)) { continue; }
+            edges[2 * num_edges]     = left + x + 0.5; // oversampled pixels, upwards y +ve
+            edges[2 * num_edges + 1] = top - y - 0.5;
+            num_edges++;
+        }
+    }
+
+    // the distance field in pixels at the mode size, with room for spread
+    int sdf_left   = floordiv(left, scale) - spread;
+    int sdf_top    = -floordiv(-top, scale) + spread; // ceil
+    int sdf_width  = -floordiv(-(left + width), scale) + spread - sdf_left;
+    int sdf_height = sdf_top - floordiv(top - height, scale) + spread;
+
+    unsigned char *out = xmalloc((size_t) sdf_width * (size_t) sdf_height);
+
+    for (int j = 0; j < sdf_height; j++)
+    {
+        // sample at the centre of each pixel
+        double sample_y = ((double) (sdf_top - j) - 0.5) * scale;
+
+        for (int i = 0; i < sdf_width; i++)
+        {
+            double sample_x = ((double) (sdf_left + i) + 0.5) * scale;
+
+            double nearest = INFINITY;
+            for (size_t e = 0; e < num_edges; e++)
+            {
+                double dx = sample_x - edges[2 * e];
+                double dy = sample_y - edges[2 * e + 1];
+                double d = (dx * dx) + (dy * dy);
+                if (d < nearest) { nearest = d; }
+            }
+
+            // is this sample inside the outline?
+            int col = (int) floor(sample_x - left);
+            int row = (int) floor(top - sample_y);
+            double sign = INSIDE(col, row) ? 1.0 : -1.0;
+
+            // the outline is half a pixel beyond the centre of an outline pixel
+            double distance = ((sign * sqrt(nearest)) + 0.5) / scale; // pixels at the mode size
+            double value = rint(128.0 + ((distance * 127.0) / spread));
+            out[(j * sdf_width) + i] = (value <= 0.0) ? 0 : (value >= 255.0) ? 255 : (unsigned char) value;
+        }
+    }
+
+    #undef INSIDE
+    free(edges);
+
+    g->coverage = out;
+    g->width = sdf_width;
+    g->height = sdf_height;
+    g->bitmap_left = sdf_left;
+    g->bitmap_top = sdf_top;
+}
+
+static void render(glyph *g, FT_Face face, const mode *m)
+{
+    if (m->antialias == MODE_SDF) { render_sdf(g, face, m->size); return; }
+
+    FT_Int32 flags = FT_LOAD_RENDER;
+    if (m->antialias == MODE_MONO)
+    {
+        // autohint makes monochrome look better
+        flags |= FT_LOAD_TARGET_MONO | FT_LOAD_FORCE_AUTOHINT;
+    }
+    if (FT_Load_Char(face, g->codepoint, flags))
+        { die("could not render codepoint %#x", g->codepoint); }
+
+    FT_GlyphSlot slot = face->glyph;
+    FT_Bitmap *bitmap = &slot->bitmap;
+    int width  = (int) bitmap->width;
+    int height = (int) bitmap->rows;
+    int pitch  = bitmap->pitch;
+
+    if (pitch < 0) { die("codepoint %#x: negative bitmap pitch is not supported", g->codepoint); }
+
+    if ((width > 0) && (height > 0))
+    {
+        unsigned char *out = xmalloc((size_t) width * (size_t) height);
+        for (int y = 0; y < height; y++)
+        {
+            const unsigned char *row = bitmap->buffer + (y * pitch);
+            for (int x = 0; x < width; x++)
+            {
+                if (m->antialias == MODE_AA) { out[(y * width) + x] = row[x]; }
+                // 1 bit per pixel, most significant bit first
+                else { out[(y * width) + x] = (row[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0; }
+            }
+        }
+        g->coverage = out;
+        g->width = width;
+        g->height = height;
+    }
+
+    g->bitmap_left = slot->bitmap_left;
+    g->bitmap_top  = slot->bitmap_top;
+    copy_metrics(g, slot);
+}
+
+static void render_chunk(worker *w, int modeID, size_t start, size_t count)
+{
+    mode *m = &bake.modes[modeID];
+    FT_Face face = worker_face(w, m->font, m->size);
+
+    for (size_t i = start; i < start + count; i++)
+    {
+        glyph *g = &m->glyphs[i];
+        g->codepoint = m->codepoints[i];
+        g->present = (0 != FT_Get_Char_Index(face, g->codepoint));
+        if (g->present) { render(g, face, m); }
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// Kerning (on a worker thread)
+// -----------------------------------------------------------------------------
+
+// as bakefont3.encode.kernpairs: KERN records for every ordered pair of
+// characters in the table that the font has, sorted by (left, right)
+static void kern_table(worker *w, table *t)
+{
+    mode *m = &bake.modes[t->mode];
+    FT_Face face = worker_face(w, m->font, m->size);
+
+    if (!FT_HAS_KERNING(face)) { return; }
+
+    uint32_t *codepoints = xmalloc(t->count * sizeof(uint32_t));
+    FT_UInt *indexes = xmalloc(t->count * sizeof(FT_UInt));
+    size_t num = 0;
+    for (size_t i = 0; i < t->count; i++)
+    {
+        FT_UInt index = FT_Get_Char_Index(face, t->codepoints[i]);
+        if (index) { codepoints[num] = t->codepoints[i]; indexes[num] = index; num++; }
+    }
+
+    size_t capacity = 0, size = 0;
+    unsigned char *records = NULL;
+
+    for (size_t l = 0; l < num; l++)
+    {
+        for (size_t r = 0; r < num; r++)
+        {
+            if (l == r) { continue; }
+
+            // the grid-fitted offset is the unfitted offset rounded, so it
+            // can only be non-zero if the unfitted offset is
+            FT_Vector fine, fitted;
+            FT_Get_Kerning(face, indexes[l], indexes[r], FT_KERNING_UNFITTED, &fine);
+            if (!fine.x) { continue; }
+            FT_Get_Kerning(face, indexes[l], indexes[r], FT_KERNING_DEFAULT, &fitted);
+
+            if (size + 16 > capacity)
+            {
+                capacity = capacity ? capacity * 2 : 4096;
+                records = xrealloc(records, capacity);
+            }
+
+            // 16 byte record: left, right codepoint, x, x_fine (FP26.6)
+            uint32_t left = codepoints[l], right = codepoints[r];
+            int32_t x = (int32_t) fitted.x, x_fine = (int32_t) fine.x;
+            memcpy(records + size,      &left,   4);
+            memcpy(records + size + 4,  &right,  4);
+            memcpy(records + size + 8,  &x,      4);
+            memcpy(records + size + 12, &x_fine, 4);
+            size += 16;
+        }
+    }
+
+    free(codepoints);
+    free(indexes);
+    t->kerning = records;
+    t->kerning_size = size;
+}
+
+
+// -----------------------------------------------------------------------------
+// The pool of worker threads. Every rendering job comes before every kerning
+// job, so that the main thread can fit and compose the atlas as soon as the
+// glyphs are rendered, while the workers are still gathering kerning data.
+// -----------------------------------------------------------------------------
+
+typedef struct job job;
+struct job { int mode; size_t start, count; int table; }; // table < 0 to render
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t rendered;
+    job *jobs;
+    size_t num_jobs;
+    size_t next_job;
+    size_t renders_left;
+    size_t kerns_done;
+    worker *workers;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, NULL};
+
+static void *work(void *arg)
+{
+    worker *w = arg;
+
+    if (FT_Init_FreeType(&w->library)) { die("could not initialise FreeType"); }
+    w->faces = xcalloc((size_t) bake.num_fonts, sizeof(FT_Face));
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.next_job == pool.num_jobs) { pthread_mutex_unlock(&pool.lock); break; }
+        job *j = &pool.jobs[pool.next_job++];
+        pthread_mutex_unlock(&pool.lock);
+
+        if (j->table < 0) { render_chunk(w, j->mode, j->start, j->count); }
+        else              { kern_table(w, &bake.tables[j->table]); }
+
+        pthread_mutex_lock(&pool.lock);
+        if (j->table < 0)
+        {
+            if (0 == --pool.renders_left) { pthread_cond_broadcast(&pool.rendered); }
+        }
+        else { pool.kerns_done++; }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    for (int i = 0; i < bake.num_fonts; i++)
+    {
+        if (w->faces[i]) { FT_Done_Face(w->faces[i]); }
+    }
+    free(w->faces);
+    FT_Done_FreeType(w->library);
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    size_t capacity = (size_t) bake.num_tables;
+    for (int i = 0; i < bake.num_modes; i++) { capacity += (bake.modes[i].count / CHUNK) + 1; }
+    pool.jobs = xmalloc(capacity * sizeof(job));
+
+    for (int i = 0; i < bake.num_modes; i++)
+    {
+        for (size_t start = 0; start < bake.modes[i].count; start += CHUNK)
+        {
+            size_t count = bake.modes[i].count - start;
+            if (count > CHUNK) { count = CHUNK; }
+            pool.jobs[pool.num_jobs++] = (job) {i, start, count, -1};
+        }
+    }
+    pool.renders_left = pool.num_jobs;
+
+    for (int i = 0; i < bake.num_tables; i++)
+        { pool.jobs[pool.num_jobs++] = (job) {bake.tables[i].mode, 0, 0, i}; }
+
+    pool.workers = xcalloc((size_t) bake.threads, sizeof(worker));
+    for (int i = 0; i < bake.threads; i++)
+    {
+        if (pthread_create(&pool.workers[i].thread, NULL, work, &pool.workers[i]))
+            { die("could not start a thread"); }
+    }
+}
+
+static void pool_wait_rendered(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.renders_left) { pthread_cond_wait(&pool.rendered, &pool.lock); }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_join(void)
+{
+    for (int i = 0; i < bake.threads; i++) { pthread_join(pool.workers[i].thread, NULL); }
+    free(pool.workers);
+    free(pool.jobs);
+}
+
+
+// -----------------------------------------------------------------------------
+// Fitting glyphs into the texture atlas
+// -----------------------------------------------------------------------------
+
+// a port of bakefont3.TernaryTree: if a node has no children, its bounding box
+// is empty space. Otherwise, it is split to the right, below, and outwards
+// by exactly three children, for which the same definition applies.
+typedef struct node node;
+struct node
+{
+    int x0, y0, z0, x1, y1, z1;
+    int children; // index of the first of three children, or 0 if empty
+};
+
+typedef struct fit fit;
+struct fit
+{
+    size3 size;
+    const int *dims; // (width, height) pairs, sorted by descending height
+    size_t count;
+    int layers;
+    int *xyz; // result: (x, y, z) for each glyph, or NULL if no fit
+};
+
+// same as TernaryTree.fit, but without recursion: a depth-first search for the
+// first empty node (trying right, then down, then out) that fits w, h
+static bool fit_one(node *nodes, int *num_nodes, int *stack, int w, int h, int *xyz)
+{
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top)
+    {
+        node *n = &nodes[stack[--top]];
+
+        if (n->children)
+        {
+            stack[top++] = n->children + 2; // out
+            stack[top++] = n->children + 1; // down
+            stack[top++] = n->children;     // right
+            continue;
+        }
+
+        if ((w > n->x1 - n->x0) || (h > n->y1 - n->y0) || (n->z1 - n->z0 < 1)) { continue; }
+
+        // it fits, so split the remaining space: given that the glyphs are
+        // sorted on descending height, split on the bottom edge first
+        // (NOTE the outwards node's y0 is x0, the same as geometry.py, so that
+        // the result is too)
+        int c = *num_nodes; *num_nodes += 3;
+        nodes[c]     = (node) {n->x0 + w, n->y0,     n->z0,     n->x1, n->y0 + h, n->z0 + 1, 0};
+        nodes[c + 1] = (node) {n->x0,     n->y0 + h, n->z0,     n->x1, n->y1,     n->z0 + 1, 0};
+        nodes[c + 2] = (node) {n->x0,     n->x0,     n->z0 + 1, n->x1, n->y1,     n->z1,     0};
+        n->children = c;
+
+        xyz[0] = n->x0; xyz[1] = n->y0; xyz[2] = n->z0;
+        return true;
+    }
+
+    return false;
+}
+
+static void *fit_all(void *arg)
+{
+    fit *f = arg;
+    node *nodes = xmalloc(((3 * f->count) + 1) * sizeof(node));
+    int *stack = xmalloc(((3 * f->count) + 1) * sizeof(int));
+    int *xyz = xmalloc((f->count * 3 + 1) * sizeof(int));
+    int num_nodes = 1;
+    nodes[0] = (node) {0, 0, 0, f->size.width, f->size.height, f->size.depth * f->layers, 0};
+
+    f->xyz = xyz;
+    for (size_t i = 0; i < f->count; i++)
+    {
+        if (!fit_one(nodes, &num_nodes, stack, f->dims[2 * i], f->dims[(2 * i) + 1], &xyz[3 * i]))
+        {
+            free(xyz);
+            f->xyz = NULL;
+            break;
+        }
+    }
+
+    free(nodes);
+    free(stack);
+    return NULL;
+}
+
+// try several candidate sizes at once, one per thread
+static void probe(fit *fits, const int *indexes, int num)
+{
+    char sizes[1024] = {0};
+    for (int i = 0; i < num; i++)
+    {
+        size3 s = fits[indexes[i]].size;
+        size_t len = strlen(sizes);
+        snprintf(sizes + len, sizeof(sizes) - len, "%s(%d, %d, %d)", i ? ", " : "", s.width, s.height, s.depth);
+    }
+    info("Trying sizes %s", sizes);
+
+    pthread_t *threads = xmalloc((size_t) num * sizeof(pthread_t));
+    bool *started = xcalloc((size_t) num, sizeof(bool));
+    for (int i = 0; i < num; i++)
+    {
+        started[i] = (num > 1) && (0 == pthread_create(&threads[i], NULL, fit_all, &fits[indexes[i]]));
+        if (!started[i]) { fit_all(&fits[indexes[i]]); }
+    }
+    for (int i = 0; i < num; i++)
+    {
+        if (started[i]) { pthread_join(threads[i], NULL); }
+        size3 s = fits[indexes[i]].size;
+        if (!fits[indexes[i]].xyz) { info("No fit for size (%d, %d, %d)", s.width, s.height, s.depth); }
+    }
+    free(threads);
+    free(started);
+}
+
+// as bakefont3.pack _search_linear and _search_bisect, over the candidate
+// sizes that pass the cheap checks. Returns the index of the first fit, or -1
+static int search(fit *fits, int num, bool *probed, int workers)
+{
+    int *indexes = xmalloc((size_t) (workers + 1) * sizeof(int));
+    int result = -1;
+
+    #define PROBE(n) do { \
+        int m_ = 0; \
+        for (int k_ = 0; k_ < (n); k_++) { if (!probed[indexes[k_]]) { indexes[m_++] = indexes[k_]; } } \
+        if (m_) { probe(fits, indexes, m_); } \
+        for (int k_ = 0; k_ < m_; k_++) { probed[indexes[k_]] = true; } \
+    } while (0)
+
+    if (!bake.bisect)
+    {
+        for (int start = 0; start < num && result < 0; start += workers)
+        {
+            int n = 0;
+            for (int i = start; i < num && i < start + workers; i++) { indexes[n++] = i; }
+            PROBE(n);
+            for (int i = start; i < num && i < start + workers; i++)
+            {
+                if (fits[i].xyz) { result = i; break; }
+            }
+        }
+        free(indexes);
+        return result;
+    }
+
+    // gallop: find lo, hi such that lo - 1 misses and hi fits
+    int lo = 0, hi = -1, step = 1;
+    while (hi < 0)
+    {
+        bool exhausted = (lo + (step * workers)) > num;
+        int n = 0;
+        for (int k = 0; k < workers; k++)
+        {
+            int i = lo + (step * (k + 1)) - 1;
+            if (i < num) { indexes[n++] = i; }
+        }
+        if (exhausted && (lo < num) && !(n && indexes[n - 1] == num - 1)) { indexes[n++] = num - 1; }
+        if (!n) { free(indexes); return -1; }
+
+        int wanted[1024]; int num_wanted = n < 1024 ? n : 1024;
+        memcpy(wanted, indexes, (size_t) num_wanted * sizeof(int));
+        PROBE(n);
+
+        int first = -1, last_miss = -1;
+        for (int k = 0; k < num_wanted; k++)
+        {
+            if (fits[wanted[k]].xyz) { first = wanted[k]; break; }
+            last_miss = wanted[k];
+        }
+
+        if (first >= 0)
+        {
+            hi = first;
+            if (last_miss >= 0) { lo = last_miss + 1; }
+        }
+        else if (exhausted) { free(indexes); return -1; }
+        else { lo = wanted[num_wanted - 1] + 1; step *= 2; }
+    }
+
+    // bisect: narrow the range (lo, hi) in rounds of `workers` probes
+    while (lo < hi)
+    {
+        int span = hi - lo, n = 0;
+        for (int k = 0; k < workers; k++)
+        {
+            int i = lo + ((span * (k + 1)) / (workers + 1));
+            if ((lo <= i) && (i < hi) && !(n && indexes[n - 1] == i)) { indexes[n++] = i; }
+        }
+        if (!n) { break; }
+
+        int wanted[1024]; int num_wanted = n < 1024 ? n : 1024;
+        memcpy(wanted, indexes, (size_t) num_wanted * sizeof(int));
+        PROBE(n);
+
+        for (int k = 0; k < num_wanted; k++)
+        {
+            if (!fits[wanted[k]].xyz) { lo = wanted[k] + 1; }
+            else { hi = wanted[k]; break; }
+        }
+    }
+
+    #undef PROBE
+    free(indexes);
+    return hi;
+}
+
+
+// -----------------------------------------------------------------------------
+// Sorting, deduplicating, placing, composing
+// -----------------------------------------------------------------------------
+
+static glyph **order; // every present glyph with a bitmap
+static size_t num_order;
+
+static int cmp_height(const void *a, const void *b)
+{
+    // by descending height, and stable
+    const glyph *x = *(glyph * const *) a, *y = *(glyph * const *) b;
+    if (x->height != y->height) { return y->height - x->height; }
+    return (x->rank > y->rank) - (x->rank < y->rank);
+}
+
+static uint64_t hash_glyph(const glyph *g)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    h = (h ^ (uint64_t) g->width) * 1099511628211ULL;
+    h = (h ^ (uint64_t) g->height) * 1099511628211ULL;
+    size_t size = (size_t) g->width * (size_t) g->height;
+    for (size_t i = 0; i < size; i++) { h = (h ^ g->coverage[i]) * 1099511628211ULL; }
+    return h;
+}
+
+static bool same_bitmap(const glyph *a, const glyph *b)
+{
+    return (a->width == b->width) && (a->height == b->height) &&
+        (0 == memcmp(a->coverage, b->coverage, (size_t) a->width * (size_t) a->height));
+}
+
+// identical bitmaps only take up space in the texture atlas once: returns the
+// unique glyphs (in order), and sets copies[i] to the original of each glyph
+// in `order`, or NULL
+static glyph **dedupe(glyph ***copies, size_t *num_unique)
+{
+    glyph **unique = xmalloc(num_order * sizeof(glyph *));
+    *copies = xcalloc(num_order, sizeof(glyph *));
+    *num_unique = 0;
+
+    size_t buckets = 1;
+    while (buckets < 2 * num_order) { buckets *= 2; }
+    glyph **table = xcalloc(buckets, sizeof(glyph *));
+
+    size_t num_copies = 0;
+    for (size_t i = 0; i < num_order; i++)
+    {
+        glyph *g = order[i];
+        size_t slot = (size_t) hash_glyph(g) & (buckets - 1);
+        while (table[slot] && !same_bitmap(table[slot], g)) { slot = (slot + 1) & (buckets - 1); }
+
+        if (table[slot]) { (*copies)[i] = table[slot]; num_copies++; }
+        else { table[slot] = g; unique[(*num_unique)++] = g; }
+    }
+
+    if (num_copies) { info("%zu glyphs share a bitmap with another glyph", num_copies); }
+    free(table);
+    return unique;
+}
+
+// 4x4 ordered dither thresholds, scaled to 0-255
+static const int bayer4[4][4] =
+{
+    {((( 0 * 2) + 1) * 255) / 32, (((8 * 2) + 1) * 255) / 32, ((( 2 * 2) + 1) * 255) / 32, (((10 * 2) + 1) * 255) / 32},
+    {(((12 * 2) + 1) * 255) / 32, (((4 * 2) + 1) * 255) / 32, (((14 * 2) + 1) * 255) / 32, ((( 6 * 2) + 1) * 255) / 32},
+    {((( 3 * 2) + 1) * 255) / 32, (((11* 2) + 1) * 255) / 32, ((( 1 * 2) + 1) * 255) / 32, ((( 9 * 2) + 1) * 255) / 32},
+    {(((15 * 2) + 1) * 255) / 32, (((7 * 2) + 1) * 255) / 32, (((13 * 2) + 1) * 255) / 32, ((( 5 * 2) + 1) * 255) / 32},
+};
+
+static void pack_atlas(void)
+{
+    int layers = 8 / bake.bits;
+
+    num_order = 0;
+    for (int i = 0; i < bake.num_modes; i++) { num_order += bake.modes[i].count; }
+    order = xmalloc((num_order + 1) * sizeof(glyph *));
+    num_order = 0;
+    for (int i = 0; i < bake.num_modes; i++)
+    {
+        for (size_t j = 0; j < bake.modes[i].count; j++)
+        {
+            glyph *g = &bake.modes[i].glyphs[j];
+            if (g->present && g->coverage) { g->rank = num_order; order[num_order++] = g; }
+        }
+    }
+
+    // sort by height for packing - good heuristic
+    qsort(order, num_order, sizeof(glyph *), cmp_height);
+
+    glyph **copies = NULL;
+    glyph **unique = order;
+    size_t num_unique = num_order;
+    if (bake.dedupe) { unique = dedupe(&copies, &num_unique); }
+
+    int *dims = xmalloc((num_unique * 2 + 1) * sizeof(int));
+    int64_t minVolume = 0; int minWidth = 0, minHeight = 0;
+    for (size_t i = 0; i < num_unique; i++)
+    {
+        dims[2 * i] = unique[i]->width;
+        dims[(2 * i) + 1] = unique[i]->height;
+        minVolume += (int64_t) unique[i]->width * unique[i]->height;
+        if (unique[i]->width  > minWidth)  { minWidth  = unique[i]->width; }
+        if (unique[i]->height > minHeight) { minHeight = unique[i]->height; }
+    }
+
+    // candidate sizes that pass the cheap checks against the lower bound
+    fit *fits = xcalloc((size_t) bake.num_sizes, sizeof(fit));
+    int num_fits = 0;
+    for (int i = 0; i < bake.num_sizes; i++)
+    {
+        size3 s = bake.sizes[i];
+        int64_t volume = (int64_t) s.width * s.height * s.depth * layers;
+        if ((minVolume > volume) || (minWidth > s.width) || (minHeight > s.height))
+        {
+            info("Early discard for size (%d, %d, %d)", s.width, s.height, s.depth);
+            continue;
+        }
+        fits[num_fits++] = (fit) {s, dims, num_unique, layers, NULL};
+    }
+
+    bool *probed = xcalloc((size_t) num_fits, sizeof(bool));
+    int found = search(fits, num_fits, probed, bake.threads);
+
+    if (found >= 0)
+    {
+        bake.size = fits[found].size;
+        const int *xyz = fits[found].xyz;
+
+        for (size_t i = 0; i < num_unique; i++)
+        {
+            // because we don't want people to think their image is broken,
+            // make sure the alpha channel has the most information
+            // by swapping red and alpha
+            int channel = xyz[(3 * i) + 2] / layers, layer = xyz[(3 * i) + 2] % layers;
+            if (bake.size.depth == 4) { static const int swap[4] = {3, 1, 2, 0}; channel = swap[channel]; }
+
+            unique[i]->x0 = xyz[3 * i];
+            unique[i]->y0 = xyz[(3 * i) + 1];
+            unique[i]->z0 = (channel * layers) + layer;
+            unique[i]->depth = 1;
+        }
+
+        for (size_t i = 0; copies && i < num_order; i++)
+        {
+            glyph *original = copies[i];
+            if (!original) { continue; }
+            order[i]->x0 = original->x0; order[i]->y0 = original->y0;
+            order[i]->z0 = original->z0; order[i]->depth = original->depth;
+        }
+    }
+
+    for (int i = 0; i < num_fits; i++) { free(fits[i].xyz); }
+    free(fits); free(probed); free(dims); free(copies);
+    if (unique != order) { free(unique); }
+}
+
+static void compose(void)
+{
+    int width = bake.size.width, height = bake.size.height, depth = bake.size.depth;
+    int layers = 8 / bake.bits;
+    int levels = (1 << bake.bits) - 1;
+
+    stage("Composing Texture Atlas");
+    bake.pixels = xcalloc((size_t) width * (size_t) height * (size_t) depth, 1);
+
+    for (size_t i = 0; i < num_order; i++)
+    {
+        glyph *g = order[i];
+        if (!g->depth) { continue; }
+
+        int channel = g->z0 / layers, layer = g->z0 % layers;
+
+        for (int y = 0; y < g->height; y++)
+        {
+            for (int x = 0; x < g->width; x++)
+            {
+                unsigned char *dest = &bake.pixels[(((size_t) (g->y0 + y) * width) + g->x0 + x) * depth + channel];
+                int coverage = g->coverage[(y * g->width) + x];
+
+                if (bake.bits == 8) { *dest = (unsigned char) coverage; continue; }
+
+                // quantise to the nearest of 2**bits levels (or dither)
+                int threshold = bake.dither ? bayer4[y & 3][x & 3] : 127;
+                int value = ((coverage * levels) + threshold) / 255;
+                *dest |= (unsigned char) (value << (layer * bake.bits));
+            }
+        }
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// Writing the .bf3 file (see bakefont3/encode.py for the format) and atlas
+// -----------------------------------------------------------------------------
+
+static void put(FILE *fp, const void *data, size_t size)
+{
+    if (size && (1 != fwrite(data, size, 1, fp))) { die("write error"); }
+}
+
+static void put_u8(FILE *fp, unsigned value)   { uint8_t v = (uint8_t) value; put(fp, &v, 1); }
+static void put_u16(FILE *fp, unsigned value)  { uint16_t v = (uint16_t) value; put(fp, &v, 2); }
+static void put_u32(FILE *fp, uint32_t value)  { put(fp, &value, 4); }
+static void put_i32(FILE *fp, int32_t value)   { put(fp, &value, 4); }
+static void put_fixed(FILE *fp, const char *s, size_t size)
+{
+    char buf[64] = {0};
+    memcpy(buf, s, strlen(s));
+    put(fp, buf, size);
+}
+
+// a value in font units, as FP26.6 pixels at the given size, as fp26_6(fontrelative())
+static int32_t fontrelative(FT_Face face, double size, long value)
+{
+    return (int32_t) ((((double) value * size) / (double) face->units_per_EM) * 64.0);
+}
+
+static void check_range(const char *name, long value, long min, long max)
+{
+    if ((value < min) || (value > max)) { die("%s out of range (%ld)", name, value); }
+}
+
+static void write_bf3(const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { die("could not open %s for writing", filename); }
+
+    long preamble = 24 + 8 + (48 * bake.num_fonts) + 8 + (32 * bake.num_modes) + 8 + (40 * bake.num_tables);
+    if (preamble > 65535) { die("too many fonts, modes and tables"); }
+
+    // HEADER - 24 bytes
+    put(fp, "BAKEFONTv3r1", 12);
+    put_u16(fp, (unsigned) bake.size.width);
+    put_u16(fp, (unsigned) bake.size.height);
+    put_u16(fp, (unsigned) bake.size.depth);
+    put_u16(fp, (unsigned) preamble);
+    put_u8(fp, (bake.bits == 8) ? 0 : (unsigned) bake.bits);
+    put(fp, "\0\0\0", 3);
+
+    // FONT TABLE - 8 bytes, then 48 bytes per font
+    put(fp, "FONT", 4);
+    put_u16(fp, (unsigned) bake.num_fonts);
+    put(fp, "\0\0", 2);
+    for (int i = 0; i < bake.num_fonts; i++)
+    {
+        FT_Face face = bake.fonts[i].face;
+        put(fp, FT_HAS_HORIZONTAL(face) ? "H" : "h", 1);
+        put(fp, FT_HAS_VERTICAL(face) ? "V" : "v", 1);
+        put(fp, "\0\0", 2);
+        put_fixed(fp, bake.fonts[i].name, 44);
+    }
+
+    // FONT MODE TABLE - 8 bytes, then 32 bytes per mode
+    put(fp, "MODE", 4);
+    put_u16(fp, (unsigned) bake.num_modes);
+    put(fp, "\0\0", 2);
+    for (int i = 0; i < bake.num_modes; i++)
+    {
+        mode *m = &bake.modes[i];
+        FT_Face face = bake.fonts[m->font].face;
+        put_u16(fp, (unsigned) m->font);
+        put(fp, (m->antialias == MODE_SDF) ? "S" : (m->antialias == MODE_AA) ? "A" : "a", 1);
+        put_u8(fp, (m->antialias == MODE_SDF) ? (unsigned) bake.spread : 0);
+        put_i32(fp, (int32_t) (m->size * 64.0));
+        put_i32(fp, fontrelative(face, m->size, face->height));
+        put_i32(fp, fontrelative(face, m->size, face->underline_position));
+        put_i32(fp, fontrelative(face, m->size, face->underline_thickness));
+        put(fp, "\0\0\0\0\0\0\0\0\0\0\0\0", 12);
+    }
+
+    // GLYPH TABLE - 8 bytes, then 40 bytes per table (back-patched below)
+    put(fp, "GTBL", 4);
+    put_u16(fp, (unsigned) bake.num_tables);
+    put(fp, "\0\0", 2);
+    long tableOffset = ftell(fp);
+    char zeros[40] = {0};
+    for (int i = 0; i < bake.num_tables; i++) { put(fp, zeros, 40); }
+
+    if (ftell(fp) != preamble) { die("internal error: preamble size"); }
+
+    uint32_t (*locations)[4] = xcalloc((size_t) bake.num_tables, sizeof(*locations));
+
+    for (int i = 0; i < bake.num_tables; i++)
+    {
+        table *t = &bake.tables[i];
+        mode *m = &bake.modes[t->mode];
+
+        // GLYPH SET - "GSET", then a 40 byte record per glyph, by codepoint
+        // (a mode's glyphs are already sorted by codepoint)
+        locations[i][0] = (uint32_t) ftell(fp);
+        put(fp, "GSET", 4);
+        for (size_t j = 0; j < m->count; j++)
+        {
+            glyph *g = &m->glyphs[j];
+            if (!g->present) { continue; }
+
+            check_range("x", g->x0, 0, 65535);
+            check_range("y", g->y0, 0, 65535);
+            check_range("z", g->z0, 0, 255);
+            check_range("width", g->width, 0, 255);
+            check_range("height", g->height, 0, 255);
+            check_range("bitmap_left", g->bitmap_left, -32768, 32767);
+            check_range("bitmap_top", g->bitmap_top, -32768, 32767);
+
+            int16_t left = (int16_t) g->bitmap_left, top = (int16_t) g->bitmap_top;
+            put_u32(fp, g->codepoint);
+            put_u16(fp, (unsigned) g->x0);
+            put_u16(fp, (unsigned) g->y0);
+            put_u8(fp, (unsigned) g->z0);
+            put_u8(fp, (unsigned) g->width);
+            put_u8(fp, (unsigned) g->height);
+            put_u8(fp, (unsigned) g->depth);
+            put(fp, &left, 2);
+            put(fp, &top, 2);
+            put_i32(fp, (int32_t) g->horiBearingX);
+            put_i32(fp, (int32_t) g->horiBearingY);
+            put_i32(fp, (int32_t) g->horiAdvance);
+            put_i32(fp, (int32_t) g->vertBearingX);
+            put_i32(fp, (int32_t) g->vertBearingY);
+            put_i32(fp, (int32_t) g->vertAdvance);
+        }
+        locations[i][1] = (uint32_t) ftell(fp) - locations[i][0];
+
+        // KERNING - "KERN", then a 16 byte record per pair
+        locations[i][2] = (uint32_t) ftell(fp);
+        put(fp, "KERN", 4);
+        put(fp, t->kerning, t->kerning_size);
+        locations[i][3] = (uint32_t) ftell(fp) - locations[i][2];
+    }
+
+    // INFO - notes in case the author wants to generate the same file again
+    char *notes = NULL; size_t notes_size = 0;
+    FILE *nf = open_memstream(&notes, &notes_size);
+    if (!nf) { die("out of memory"); }
+    fprintf(nf, "\n\nencoder = '%s';\n\nfonts = {\n", ENCODER);
+    for (int i = 0; i < bake.num_fonts; i++)
+    {
+        const char *family = bake.fonts[i].face->family_name;
+        fprintf(nf, "    '%s': '%s',\n", bake.fonts[i].name, family ? family : "");
+    }
+    fprintf(nf, "};\n\nmodes = [\n");
+    for (int i = 0; i < bake.num_modes; i++)
+    {
+        mode *m = &bake.modes[i];
+        static const char *antialias[] = {"False", "True", "bakefont3.SDF"};
+        fprintf(nf, "    ('%s', %g, %s),\n", bake.fonts[m->font].name, m->size, antialias[m->antialias]);
+    }
+    fprintf(nf, "];\n\n");
+    fclose(nf);
+
+    put(fp, "INFO", 4);
+    put_u32(fp, (uint32_t) notes_size);
+    put(fp, notes, notes_size);
+    free(notes);
+
+    // back-patch the glyph table
+    fseek(fp, tableOffset, SEEK_SET);
+    for (int i = 0; i < bake.num_tables; i++)
+    {
+        put_u16(fp, (unsigned) bake.tables[i].mode);
+        put(fp, "\0\0", 2);
+        for (int k = 0; k < 4; k++) { put_u32(fp, locations[i][k]); }
+        put_fixed(fp, bake.tables[i].name, 20);
+    }
+
+    free(locations);
+    if (fclose(fp)) { die("write error"); }
+}
+
+static void write_png(const char *filename)
+{
+    int width = bake.size.width, height = bake.size.height, depth = bake.size.depth;
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { die("could not open %s for writing", filename); }
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop pnginfo = png ? png_create_info_struct(png) : NULL;
+    if (!pnginfo) { die("could not initialise libpng"); }
+    if (setjmp(png_jmpbuf(png))) { die("could not write %s", filename); }
+
+    static const int color_types[5] = {0, PNG_COLOR_TYPE_GRAY, 0, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA};
+
+    png_init_io(png, fp);
+    png_set_IHDR(png, pnginfo, (png_uint_32) width, (png_uint_32) height, 8, color_types[depth],
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, pnginfo);
+
+    for (int y = 0; y < height; y++)
+        { png_write_row(png, bake.pixels + ((size_t) y * (size_t) width * (size_t) depth)); }
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &pnginfo);
+    if (fclose(fp)) { die("write error"); }
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *manifest = NULL;
+
+    bake.bits = 8;
+    bake.dedupe = true;
+    bake.spread = 4;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-q")) { quiet = true; }
+        else if ((0 == strcmp(argv[i], "-j")) && (i + 1 < argc)) { bake.threads = atoi(argv[++i]); }
+        else if (!manifest && argv[i][0] != '-') { manifest = argv[i]; }
+        else { manifest = NULL; break; }
+    }
+
+    if (!manifest)
+    {
+        printf("USAGE: %s [-q] [-j threads] manifest\n", argv[0]);
+        return -1;
+    }
+
+    if (FT_Init_FreeType(&library)) { die("could not initialise FreeType"); }
+
+    // -------------------------------------------------------------------------
+    stage("Processing Parameters");
+    // -------------------------------------------------------------------------
+
+    parse_manifest(manifest);
+    make_modes();
+
+    if (bake.threads <= 0) { bake.threads = (int) sysconf(_SC_NPROCESSORS_ONLN); }
+    if (bake.threads <= 0) { bake.threads = 1; }
+    if (!bake.output) { bake.output = "test.bf3"; }
+    if (!bake.atlas)  { bake.atlas = "test.png"; }
+
+    // -------------------------------------------------------------------------
+    stage("Rendering Glyphs");
+    // -------------------------------------------------------------------------
+
+    pool_start();
+    pool_wait_rendered();
+
+    for (int i = 0; (!quiet) && (i < bake.num_modes); i++)
+    {
+        mode *m = &bake.modes[i];
+        for (size_t j = 0; j < m->count; j++)
+        {
+            if (m->glyphs[j].present) { continue; }
+            fprintf(stderr, "notice: font '%s' doesn't include codepoint %#x\n",
+                bake.fonts[m->font].name, m->codepoints[j]);
+        }
+    }
+
+    // -------------------------------------------------------------------------
+    stage("Fitting Glyphs");
+    // -------------------------------------------------------------------------
+
+    pack_atlas();
+    if (bake.size.width) { compose(); }
+
+    // -------------------------------------------------------------------------
+    stage("Gathering kerning data");
+    // -------------------------------------------------------------------------
+
+    pool_join();
+
+    if (!bake.size.width)
+    {
+        printf("No fit :-(\n");
+        return 1;
+    }
+
+    // -------------------------------------------------------------------------
+    stage("Generating binary");
+    // -------------------------------------------------------------------------
+
+    write_bf3(bake.output);
+    write_png(bake.atlas);
+
+    info("%dx%dx%d texture atlas, %s and %s", bake.size.width, bake.size.height,
+        bake.size.depth, bake.output, bake.atlas);
+    stage("Done");
+
+    return 0;
+}
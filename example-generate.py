@@ -2,6 +2,7 @@ import freetype
 import os.path
 import bakefont3
 import sys
+from concurrent.futures import ThreadPoolExecutor
 
 fontdir = os.path.expanduser("~") + "/.fonts" # e.g. /home/me/.fonts
 
@@ -41,7 +42,8 @@ fonts = {
 #   * name - a key from the table defined above
 #   * size - font size in pixels (at typographic DPI where 1px = 1pt),
 #            may be a fraction e.g. 11.5.
-#   * antialias - True for nice hinting, False for 1-bit
+#   * antialias - True for nice hinting, False for 1-bit, or bakefont3.SDF
+#                 for a signed distance field that can be scaled to any size
 fontmode_mono14   = ("Mono",      14, True) # (monospace)
 fontmode_mono14b  = ("Mono Bold", 14, True)
 fontmode_sans14   = ("Sans",      14, True)
@@ -107,6 +109,11 @@ tasks = [
 depth = 4
 suitable_texture_sizes = [(2**x, 2**x, depth) for x in range(6, 17)]
 
+# or see bakefont3.sizes for other sequences e.g.
+# bakefont3.sizes.squares(depth, step=64) for sizes that aren't powers of two.
+# These are monotone, so pack() can use search="bisect" to find the smallest
+# fit in a few attempts, and workers=n to try n sizes at once.
+
 
 # a callback for getting progress
 class progress:
@@ -127,8 +134,13 @@ class progress:
 
 
 # Use bakefont3 to rasterise the glyphs, tightly pack them, and collect
-# kerning data
-result = bakefont3.pack(fonts, tasks, suitable_texture_sizes, cb=progress())
+# kerning data. Rendering and kerning run on a thread per CPU, overlapping
+# with fitting and composing the texture atlas (see the `threads` argument).
+# A trace records where the time goes, for chrome://tracing or ui.perfetto.dev.
+trace = bakefont3.trace.Trace()
+result = bakefont3.pack(fonts, tasks, suitable_texture_sizes, cb=progress(), trace=trace)
+trace.save("test-trace.json")
+print(trace.summary())
 
 if not result.image:
     print("No fit :-(")
@@ -139,27 +151,38 @@ if not result.image:
 #   * result.image.save(filename) - saves to a file
 #   * result.image.split() - splits a RGB or RGBA image into channels
 
+# result.atlas => the same pixels as a numpy (height, width, depth) array
+#   * result.tiles(rows) - yields (y, pixels) for each band of rows
+#   * result.save_png(filename) - saves to a PNG file one band at a time
+#     (for very large atlases, also see the `atlasfile` argument of pack)
+
 # result.data  => a bakefont3.saveable object with the methods:
 #   * result.data.bytes - raw bytes of the data file
 #   * result.data.save(filename) - saves to a file
+#     (generated into a temporary file by pack, so it is never all in memory)
 
-result.data.save("test.bf3")
+# The data file and the images are independent, so save them at the same time
+# (PNG compression and file IO release the GIL)
+saving = ThreadPoolExecutor()
+jobs = [saving.submit(result.data.save, "test.bf3")]
 
 width, height, depth = result.size
 if depth == 4:
-    result.image.save("test-rgba.png")
+    jobs.append(saving.submit(result.save_png, "test-rgba.png"))
     red,green,blue,alpha = result.image.split()
-    red.save("test-4r.png")
-    green.save("test-4g.png")
-    blue.save("test-4b.png")
-    alpha.save("test-4a.png")
+    jobs.append(saving.submit(red.save, "test-4r.png"))
+    jobs.append(saving.submit(green.save, "test-4g.png"))
+    jobs.append(saving.submit(blue.save, "test-4b.png"))
+    jobs.append(saving.submit(alpha.save, "test-4a.png"))
 elif depth == 3:
-    result.image.save("test-rgb.png")
+    jobs.append(saving.submit(result.image.save, "test-rgb.png"))
     red,green,blue = result.image.split()
-    red.save("test-3r.png")
-    green.save("test-3g.png")
-    blue.save("test-3b.png")
+    jobs.append(saving.submit(red.save, "test-3r.png"))
+    jobs.append(saving.submit(green.save, "test-3g.png"))
+    jobs.append(saving.submit(blue.save, "test-3b.png"))
 elif depth == 1:
-    result.image.save("test-greyscale.png")
-
+    jobs.append(saving.submit(result.image.save, "test-greyscale.png"))
 
+for job in jobs:
+    job.result() # raise any errors
+saving.shutdown()
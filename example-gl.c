@@ -1,25 +1,36 @@
 // Example program loading bakefont3 data and using it to display text
 
 // COMPILE:
-//     gcc -std=c99 example-gl.c bakefont3.c lib/png.c lib/gl3w.c lib/utf8.c -lm -lglfw -lGL -lpng -ldl  -Wall -Wextra -o example-gl.bin
+//     gcc -std=c99 example-gl.c bakefont3.c lib/png.c lib/gl3w.c -lm -lglfw -lGL -lEGL -lpng -ldl  -Wall -Wextra -o example-gl.bin
 // USAGE:
-//     ./example-gl.bin example/test.bf3 example/test-rgba.png
+//     ./example-gl.bin [--headless [frames]] [--orphan] example/test.bf3 example/test-rgba.png
+//
+// --headless draws `frames` frames (default 1000) into an offscreen
+// framebuffer, with no window (e.g. with Mesa's llvmpipe), and reports the
+// bytes uploaded and the time per frame. --orphan uses the fallback upload
+// path even if persistent mapping is supported.
 
 // NOTE FOR AUTHOR - OpenGL functionality was butchered from previous projects
 // * web/___/galaxy-fleet-tactics/src/typescript/*.ts
 // * Code/OLD/LIDS/src/graphics/*.c
 
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
 #include "bakefont3.h"
 
 #include "lib/gl3w.h" // modern GL.h
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include <stdlib.h> // malloc, free
 #include <string.h> // strcmp
+#include <stddef.h> // offsetof
 #include <stdio.h>
 #include <errno.h>
 #include <png.h>
 #include <assert.h>
+#include <time.h>
 
 // from png.c
 typedef struct image image;
@@ -33,31 +44,6 @@ struct image
 bool check_if_png(FILE *fp);
 bool read_png(image *img, FILE *fp);
 
-// utf8_decode.h
-
-#define UTF8_END   -1
-#define UTF8_ERROR -2
-
-int  utf8_decode_at_byte();
-int  utf8_decode_at_character();
-void utf8_decode_init(const char *p, int length);
-int  utf8_decode_next();
-
-// simple utf8-aware strlen
-// not the fastest, but surely the simplest
-// from http://canonical.org/~kragen/strlen-utf8.html
-// (see also http://www.daemonology.net/blog/2008-06-05-faster-utf8-strlen.html)
-size_t utf8len(char *s)
-{
-  int i = 0, j = 0;
-  while (s[i]) {
-    if ((s[i] & 0xc0) != 0x80) j++;
-    i++;
-  }
-  return (size_t) j;
-}
-
-
 static const char *fragment_shader = "\
  \
  #version 130\n\
@@ -172,15 +158,156 @@ GLuint make_shader
 }
 
 
-// create a vertex buffer object
-GLuint create_vbo(size_t size)
+// Vertex data is written straight into one buffer, through a ring of
+// RING_SECTIONS sections, each big enough for a frame. With persistent
+// mapping (OpenGL 4.4, or ARB_buffer_storage), the buffer is mapped once,
+// and a fence after each frame's draw call says when the GPU has finished
+// with that section, so it can be written again RING_SECTIONS frames later,
+// usually without waiting. Otherwise, every frame "orphans" the buffer with
+// glBufferData, so the driver can hand over fresh memory instead of waiting.
+
+#define RING_SECTIONS 3
+
+typedef struct ring ring;
+
+struct ring
 {
-    GLuint name[1];
-    glCreateBuffers(1, name);
-    glBindBuffer(GL_ARRAY_BUFFER, name[0]);
-    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    GLuint vbo;
+    size_t section_size; // bytes
+    int current;
+    char *mapped; // the whole buffer, if persistently mapped, or NULL
+    GLsync fences[RING_SECTIONS];
+    size_t bytes_uploaded;
+};
 
-    return name[0];
+
+bool has_buffer_storage(void)
+{
+    if (!glBufferStorage) { return false; }
+    if (gl3wIsSupported(4, 4)) { return true; }
+
+    GLint num_extensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+    for (GLint i = 0; i < num_extensions; i++)
+    {
+        const char *name = (const char *) glGetStringi(GL_EXTENSIONS, i);
+        if (name && (0 == strcmp(name, "GL_ARB_buffer_storage"))) { return true; }
+    }
+
+    return false;
+}
+
+
+// create the buffer (and leave it bound to GL_ARRAY_BUFFER)
+void ring_init(ring *r, size_t section_size, bool persistent)
+{
+    memset(r, 0, sizeof(ring));
+    r->section_size = section_size;
+
+    glGenBuffers(1, &r->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, r->vbo);
+
+    if (persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr size = (GLsizeiptr) (section_size * RING_SECTIONS);
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        r->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    }
+
+    if (!r->mapped)
+        { glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) section_size, NULL, GL_STREAM_DRAW); }
+}
+
+
+// Get somewhere to write the next frame's vertex data
+void *ring_begin(ring *r)
+{
+    if (r->mapped)
+    {
+        // wait until the GPU has finished with this section (it usually has)
+        GLsync fence = r->fences[r->current];
+        if (fence)
+        {
+            GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+            while (GL_TIMEOUT_EXPIRED == glClientWaitSync(fence, flags, 1000000))
+                { flags = 0; }
+            glDeleteSync(fence);
+            r->fences[r->current] = NULL;
+        }
+
+        return r->mapped + (r->current * r->section_size);
+    }
+
+    // orphan the old storage, then map the new storage
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) r->section_size, NULL, GL_STREAM_DRAW);
+    return glMapBufferRange(GL_ARRAY_BUFFER, 0, (GLsizeiptr) r->section_size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+}
+
+
+// Finish writing `bytes` of vertex data, and return the index of the first
+// vertex written (for glDrawArrays)
+GLint ring_end(ring *r, size_t bytes)
+{
+    r->bytes_uploaded += bytes;
+    if (!r->mapped) { glUnmapBuffer(GL_ARRAY_BUFFER); return 0; }
+    return (GLint) ((r->current * r->section_size) / sizeof(bf3_vertex));
+}
+
+
+// Call after the draw call that uses this frame's vertex data
+void ring_fence(ring *r)
+{
+    if (!r->mapped) { return; }
+    r->fences[r->current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    r->current = (r->current + 1) % RING_SECTIONS;
+}
+
+
+void ring_free(ring *r)
+{
+    for (int i = 0; i < RING_SECTIONS; i++)
+        { if (r->fences[i]) { glDeleteSync(r->fences[i]); } }
+
+    glBindBuffer(GL_ARRAY_BUFFER, r->vbo);
+    if (r->mapped) { glUnmapBuffer(GL_ARRAY_BUFFER); }
+    glDeleteBuffers(1, &r->vbo);
+}
+
+
+// For --headless, an OpenGL context with no window or display, using EGL.
+// (With Mesa, this is llvmpipe when there is no GPU, or with
+// LIBGL_ALWAYS_SOFTWARE=1.)
+bool headless_context(void)
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display)
+        { display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL); }
+    if (display == EGL_NO_DISPLAY)
+        { display = eglGetDisplay(EGL_DEFAULT_DISPLAY); }
+
+    if (!eglInitialize(display, NULL, NULL)) { return false; }
+    if (!eglBindAPI(EGL_OPENGL_API)) { return false; }
+
+    const EGLint attribs[] =
+        { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 0, EGL_NONE };
+    EGLContext context = eglCreateContext(display, (EGLConfig) 0, EGL_NO_CONTEXT, attribs);
+    if (context == EGL_NO_CONTEXT) { return false; }
+
+    // no surface - draw into a framebuffer object instead
+    return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec / 1e9);
 }
 
 
@@ -223,23 +350,40 @@ size_t (read_FILE)(char *dest, bf3_filelike *filelike, size_t offset, size_t num
 int main(int argc, char *argv[])
 {
     bool found;
+    bool headless = false;
+    bool orphan = false;
+    long frames = 1000;
+
+    int arg = 1;
+    for (; (arg < argc) && (0 == strncmp(argv[arg], "--", 2)); arg++)
+    {
+        if (0 == strcmp(argv[arg], "--orphan")) { orphan = true; continue; }
+        if (0 != strcmp(argv[arg], "--headless")) { break; }
+
+        headless = true;
+        if ((arg + 1 < argc) && (argv[arg + 1][0] >= '0') && (argv[arg + 1][0] <= '9'))
+            { frames = strtol(argv[++arg], NULL, 10); }
+    }
 
-    if (argc != 3)
+    if ((argc - arg != 2) || (frames < 1))
     {
-        printf("USAGE: %s data.bf3 atlas.png\n", argv[0]);
+        printf("USAGE: %s [--headless [frames]] [--orphan] data.bf3 atlas.png\n", argv[0]);
         return -1;
     }
 
+    const char *data_path = argv[arg];
+    const char *atlas_path = argv[arg + 1];
+
     // open the bf3 data file
-    FILE *fdata = fopen(argv[1], "rb");
-    if (!fdata) { fprintf(stderr, "Could not open %s\n", argv[1]); return -1; }
+    FILE *fdata = fopen(data_path, "rb");
+    if (!fdata) { fprintf(stderr, "Could not open %s\n", data_path); return -1; }
     
     // open the texture atlas
     image atlas;
-    FILE *fimage = fopen(argv[2], "rb");
-    if (!fimage) { fprintf(stderr, "Could not open %s\n", argv[2]); return -1; }
-    if (!check_if_png(fimage)) { fprintf(stderr, "Not a PNG: %s\n", argv[2]); return -1; }
-    if (!read_png(&atlas, fimage)) { fprintf(stderr, "Failed to laod PNG: %s\n", argv[2]); return -1; }
+    FILE *fimage = fopen(atlas_path, "rb");
+    if (!fimage) { fprintf(stderr, "Could not open %s\n", atlas_path); return -1; }
+    if (!check_if_png(fimage)) { fprintf(stderr, "Not a PNG: %s\n", atlas_path); return -1; }
+    if (!read_png(&atlas, fimage)) { fprintf(stderr, "Failed to laod PNG: %s\n", atlas_path); return -1; }
     fclose(fimage);
     printf("Texture atlas size: %dx%d\n", atlas.width, atlas.height);
     
@@ -250,7 +394,7 @@ int main(int argc, char *argv[])
     // peek at the the header telling us what's in the bakefont3 file
     // to see how big the first chunk of information we need is
     size_t header_size = bf3_header_peek(&data_reader);
-    if (!header_size) { fprintf(stderr, "Not a bf3 file %s\n", argv[1]); return -1; }
+    if (!header_size) { fprintf(stderr, "Not a bf3 file %s\n", data_path); return -1; }
     
     // allocate a buffer to hold the header information
     // don't free() this until you're done using bakefont3 for anything
@@ -308,7 +452,7 @@ int main(int argc, char *argv[])
     {
         bf3_mode mode;
         bf3_mode_get(&mode, hdr, i);
-        if ((mode.font_id == font_sans.id) && (mode.size == wanted_size) && (mode.antialias))
+        if ((mode.font_id == font_sans.id) && (mode.size == wanted_size) && (mode.antialias) && (!mode.sdf))
             { mode_sans16 = mode; found=true; }
     }
     
@@ -375,31 +519,61 @@ int main(int argc, char *argv[])
     // we now have lookup tables that we can quickly index by a unicode code point
     
     // Lets move onto graphics...
-    gl3wInit();
+    const int width = 640;
+    const int height = 480;
+    GLFWwindow* window = NULL;
 
-    GLFWwindow* window;
-    
-    // Initialize the library
-    if (!glfwInit())
-        { fprintf(stderr, "Couldn't initialise GLFW"); exit(-1); }
+    if (headless)
+    {
+        if (!headless_context())
+            { fprintf(stderr, "Couldn't create a headless OpenGL context with EGL\n"); exit(-1); }
+    }
+    else
+    {
+        // Initialize the library
+        if (!glfwInit())
+            { fprintf(stderr, "Couldn't initialise GLFW"); exit(-1); }
+
+        // Create a windowed mode window and its OpenGL 3.0 context
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+        window = glfwCreateWindow(width, height, "Bakefont3 Example", NULL, NULL);
+        if (!window)
+            { fprintf(stderr, "Couldn't initialise window"); exit(-1); }
+
+        // Make the window's context current
+        glfwMakeContextCurrent(window);
+    }
+
+    // load the OpenGL functions (needs a current context)
+    if (0 != gl3wInit())
+        { fprintf(stderr, "Couldn't load OpenGL 3\n"); exit(-1); }
+    printf("OpenGL: %s (%s)\n", (const char *) glGetString(GL_VERSION),
+        (const char *) glGetString(GL_RENDERER));
 
-    // Create a windowed mode window and its OpenGL 3.0 context
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
-    window = glfwCreateWindow(640, 480, "Bakefont3 Example", NULL, NULL);
-    if (!window)
-        { fprintf(stderr, "Couldn't initialise window"); exit(-1); }
+    // with no window, draw into a framebuffer object instead
+    GLuint framebuffer = 0, renderbuffer = 0;
+    if (headless)
+    {
+        glGenRenderbuffers(1, &renderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffer);
+        if (GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER))
+            { fprintf(stderr, "Couldn't create a framebuffer"); exit(-1); }
+        glViewport(0, 0, width, height);
+    }
 
-    // Make the window's context current
-    glfwMakeContextCurrent(window);
     glClearColor(0.3, 0.3, 0.3, 1.0);
 
     // Upload the texture atlas
     GLuint atlas_texture = new_texture2D(atlas.width, atlas.height, atlas.rgba);
-    
+
     // don't need a copy of this in memory any more
     free(atlas.rgba);
-    
+
     // Make the texture active in texture unit 0
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, atlas_texture);
@@ -407,7 +581,7 @@ int main(int argc, char *argv[])
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    
+
     // create a shader for drawing
     GLuint shader = make_shader(fragment_shader, strlen(fragment_shader),
         vertex_shader, strlen(vertex_shader));
@@ -423,14 +597,29 @@ int main(int argc, char *argv[])
     GLint shader_uniform_sample0 = glGetUniformLocation(shader, "sample0");
     GLint shader_uniform_proj    = glGetUniformLocation(shader, "projection_matrix");
 
-    // create a vbo for position and color data
-    size_t max_vertexes = 16 * 1024;
-    size_t max_glyphs = max_vertexes / 6; // ~85
-    size_t vertex_bytes =  6 * sizeof(GL_FLOAT); // XYUV, MASK, COLOUR
-    GLuint vbo_xy = create_vbo(max_vertexes * 2);
-    GLuint vbo_uv = create_vbo(max_vertexes * 2);
-    GLuint vbo_mask = create_vbo(max_vertexes);
-    GLuint vbo_color = create_vbo(max_vertexes);
+    // one interleaved vertex buffer, with room for max_glyphs each frame
+    size_t max_glyphs = 1024;
+    bool persistent = !orphan && has_buffer_storage();
+
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+
+    ring vertices;
+    ring_init(&vertices, max_glyphs * 6 * sizeof(bf3_vertex), persistent);
+    printf("Vertex upload: %s\n", vertices.mapped ? "persistent mapped ring" : "orphaning");
+
+    // the vertex layout only needs setting once: every attribute comes from
+    // the same buffer, with the stride of one bf3_vertex
+    GLsizei stride = sizeof(bf3_vertex);
+    glEnableVertexAttribArray(shader_attrib_xy);
+    glVertexAttribPointer(shader_attrib_xy, 2, GL_FLOAT, false, stride, (void *) offsetof(bf3_vertex, x));
+    glEnableVertexAttribArray(shader_attrib_uv);
+    glVertexAttribPointer(shader_attrib_uv, 2, GL_FLOAT, false, stride, (void *) offsetof(bf3_vertex, u));
+    glEnableVertexAttribArray(shader_attrib_mask);
+    glVertexAttribPointer(shader_attrib_mask, 4, GL_UNSIGNED_BYTE, true, stride, (void *) offsetof(bf3_vertex, mask));
+    glEnableVertexAttribArray(shader_attrib_color);
+    glVertexAttribPointer(shader_attrib_color, 4, GL_UNSIGNED_BYTE, true, stride, (void *) offsetof(bf3_vertex, color));
 
     // a 2D projection
     GLfloat projection_matrix[16] =
@@ -441,8 +630,8 @@ int main(int argc, char *argv[])
         0.0f,  0.0f,  0.0f,       1.0f
     };
 
-    projection_matrix[0] /= 640.0f; // window width
-    projection_matrix[5] /= 480.0f; // window height
+    projection_matrix[0] /= (float) width;
+    projection_matrix[5] /= (float) height;
 
     // set uniforms
     glUniformMatrix4fv(shader_uniform_proj, 1, GL_FALSE, projection_matrix);
@@ -452,33 +641,49 @@ int main(int argc, char *argv[])
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    // a buffer for uploading data
-    float *tmp = malloc(max_vertexes * vertex_bytes);
-    assert(tmp);
-
-    // convert utf8 into a Unicode string
-    char string_utf8[(max_glyphs * 4) + 1];
-    strcpy(string_utf8, "Hello, world!\nThis is the Bakefont 3 test!\nDAVE DOVE www.example.org\nGBP £ Euro €\nWelsh: Ga i fynd i'r tŷ bach os gwelwch yn dda?");
-    uint32_t string_utf32[max_glyphs];
-
-    size_t len = strlen(string_utf8);
-    if (len > max_glyphs) { len = max_glyphs; }
-    utf8_decode_init(string_utf8, len);
-    size_t index = 0;
-    while (index < max_glyphs)
+    // two blocks of text, each with a vertical gradient: a message that
+    // never changes, so is only laid out once, and a frame counter below it
+    const char *message = "Hello, world!\nThis is the Bakefont 3 test!\nDAVE DOVE www.example.org\nGBP £ Euro €\nWelsh: Ga i fynd i'r tŷ bach os gwelwch yn dda?";
+    const uint8_t color_top[4] = {255, 255, 0, 255};
+    const uint8_t color_bottom[4] = {255, 0, 255, 255};
+    int lineheight = BF3_DECODE_FP26_NEAREST(mode_sans16.lineheight);
+
+    size_t message_capacity = strlen(message);
+    uint32_t *message_codepoints = malloc(message_capacity * sizeof(uint32_t));
+    bf3_quad *message_quads = malloc(message_capacity * sizeof(bf3_quad));
+    bf3_vertex *message_vertices = malloc(message_capacity * 6 * sizeof(bf3_vertex));
+    assert(message_codepoints && message_quads && message_vertices);
+
+    bf3_text message_text;
+    bf3_text_init(&message_text, message_codepoints, message_quads, message_vertices, message_capacity);
+    bf3_text_set_table(&message_text, &info, &mode_sans16, metrics, kerning);
+    bf3_text_set_color(&message_text, color_top, color_bottom);
+    bf3_text_set_origin(&message_text, 20, 20);
+    bf3_text_set_utf8(&message_text, message, strlen(message));
+
+    #define COUNTER_CAPACITY 32
+    uint32_t counter_codepoints[COUNTER_CAPACITY];
+    bf3_quad counter_quads[COUNTER_CAPACITY];
+    bf3_vertex counter_vertices[COUNTER_CAPACITY * 6];
+    char counter[COUNTER_CAPACITY];
+
+    bf3_text counter_text;
+    bf3_text_init(&counter_text, counter_codepoints, counter_quads, counter_vertices, COUNTER_CAPACITY);
+    bf3_text_set_table(&counter_text, &info, &mode_sans16, metrics, kerning);
+    bf3_text_set_color(&counter_text, color_top, color_bottom);
+    bf3_text_set_origin(&counter_text, 20, 20 + (5 * lineheight));
+
+    double start = now_seconds();
+    double first_frame = 0.0;
+    double slowest = 0.0;
+    size_t total_glyphs = 0;
+    long frame = 0;
+
+    // loop until the user closes the window (or for `frames` frames)
+    while (headless ? (frame < frames) : !glfwWindowShouldClose(window))
     {
-        int scodepoint = utf8_decode_next();
-        if (scodepoint < 0) { break; }
-        
-        string_utf32[index] = (uint32_t) scodepoint;
-        
-        index++;
-    }
-    size_t string_utf32_len = index;
+        double frame_start = now_seconds();
 
-    // loop until the user closes the window
-    while (!glfwWindowShouldClose(window))
-    {
         // check for errors
         while (true)
         {
@@ -486,201 +691,87 @@ int main(int argc, char *argv[])
             if (!error) { break; }
             printf("glGetError: %d\n", (int) error);
         }
-    
+
         glClear(GL_COLOR_BUFFER_BIT);
-        
-        size_t vertexes = 0;
-        
-        int xoffset = 20;
-        int yoffset = 20;
-        int wordspacing = 6;
-        
-        // get the lineheight and round up to the nearest pixel
-        int lineheight = BF3_DECODE_FP26_NEAREST(mode_sans16.lineheight);
-        yoffset += lineheight;
-        
-        float *p = tmp;
-        
-        // write a densely packed structure with information about the
-        // triangles to draw (counter-clockwise triangles)
-        for (size_t i = 0; i < string_utf32_len; i++)
-        {
-            // look up the glyph metrics
-            bf3_metric metric;
-            uint32_t codepoint = string_utf32[i];
-            
-            if (codepoint == '\n') { yoffset += lineheight; xoffset = 20; continue; }
-            
-            if (!bf3_metric_get(&metric, metrics, codepoint)) { continue; }
-            
-            // nothing to render? e.g. space
-            if (!metric.tex_d) { xoffset += wordspacing; continue; }
-            
-            // based on the layer (metric.tex_z),
-            // choose a mask colour that will extract from the channel we want
-            unsigned char mask[4] = {0, 0, 0, 0};
-            switch (metric.tex_z)
-            {
-                case 0: mask[0] = 255; break; // red
-                case 1: mask[1] = 255; break; // green
-                case 2: mask[2] = 255; break; // blue
-                case 3: mask[3] = 255; break; // alpha
-            }
-            
-            // layout - see
-            // https://www.freetype.org/freetype2/docs/glyphs/glyphs-3.html
-            // right side bearing = advance_width - left_side_bearing - (xMax-xMin)
-            int advance = BF3_DECODE_FP26_NEAREST(metric.hadvance);
-            int lsb = BF3_DECODE_FP26_NEAREST(metric.hbx);
-            //int rsb = advance - lsb - metric.tex_w;
-            int tsb = BF3_DECODE_FP26_NEAREST(metric.hby);
-            int bitmap_left = metric.bitmap_left;
-            int bitmap_top = metric.bitmap_top;
-            
-            // kerning
-            int xkern = 0;
-            if (i > 0) // don't kern the first letter
-            {
-                uint32_t last_codepoint = string_utf32[i-1];
-                bf3_kpair kpair;
-                
-                // not all fonts have kerning information
-                if (bf3_kpair_get(&kpair, kerning, last_codepoint, codepoint))
-                {
-                    xkern = kpair.x;
-                }
-            }
-            
-            // compute x/y, size, and texture u/v
-            float x0 = ((float) xoffset + lsb + xkern);
-            float y0 = ((float) yoffset - tsb); // realtive to baseline
-            float x1 = x0 + metric.tex_w;
-            float y1 = y0 + metric.tex_h;
-            float u0 = ((float) metric.tex_x) / ((float)info.width); // could be optimised
-            float v0 = ((float) metric.tex_y) / ((float)info.height); // could be optimised
-            float u1 = ((float) (metric.tex_x + metric.tex_w)) / ((float)info.width); // could be optimised
-            float v1 = ((float) (metric.tex_y + metric.tex_h)) / ((float)info.height); // could be optimised
-            
-            // lets compute per-vertex colors (any linear gradient you like!)
-            unsigned char color_top[4] = {255, 255, 0, 255};
-            unsigned char color_bottom[4] = {255, 0, 255, 255};
-            
-            // move the cursor across
-            xoffset += advance + xkern;
-
-            
-            /*
-            printf("%d %d %d %d %d %d (%d, %d) => %.4f %.4f %.4f %.4f / %.4f %.4f %.4f %.4f\n",
-                (int) i, metric.tex_x, metric.tex_y, metric.tex_z, metric.tex_w, metric.tex_h,
-                info.width, info.height,
-                u0, v0, u1, v1,
-                x0, y0, x1, y1);
-                */
-            
-            // fill a quad (triangles go counter-clockwise)
-            
-            #define P(x) (*p++) = (x)
-            
-            // cheat and pack 4 bytes into a float to save space
-            #define B(x) memcpy(p++, &(x), 4);
-            
-            // triangle 1
-            P(x0);
-            P(y0);
-            P(u0);
-            P(v0);
-            B(mask);
-            B(color_top);
-            
-            P(x0);
-            P(y1);
-            P(u0);
-            P(v1);
-            B(mask);
-            B(color_bottom);
-            
-            P(x1);
-            P(y1);
-            P(u1);
-            P(v1);
-            B(mask);
-            B(color_bottom);
-            
-            // triangle 2
-            
-            P(x0);
-            P(y0);
-            P(u0);
-            P(v0);
-            B(mask);
-            B(color_top);
-            
-            P(x1);
-            P(y1);
-            P(u1);
-            P(v1);
-            B(mask);
-            B(color_bottom);
-            
-            P(x1);
-            P(y0);
-            P(u1);
-            P(v0);
-            B(mask);
-            B(color_top);
-            
-            vertexes += 6;
-        }
-        
-        // upload XY coordinates
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_xy);
-        glEnableVertexAttribArray(shader_attrib_xy);
-        glVertexAttribPointer(shader_attrib_xy, 2, GL_FLOAT, false, vertex_bytes, (void *) 0);
-        // components (XY), stride in bytes, and offset
-        glBufferData(GL_ARRAY_BUFFER, vertexes * vertex_bytes, tmp, GL_DYNAMIC_DRAW);
-        
-        // upload UV coordinates
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_uv);
-        glEnableVertexAttribArray(shader_attrib_uv);
-        glVertexAttribPointer(shader_attrib_uv, 2, GL_FLOAT, false, vertex_bytes, (char *) (2 * sizeof(GL_FLOAT)));
-        // components (UV), stride in bytes, and offset
-        glBufferData(GL_ARRAY_BUFFER, vertexes * vertex_bytes, tmp, GL_DYNAMIC_DRAW);
-        
-        // upload mask information
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_mask);
-        glEnableVertexAttribArray(shader_attrib_mask);
-        glVertexAttribPointer(shader_attrib_mask, 4, GL_UNSIGNED_BYTE, true, vertex_bytes, (char *) (4 * sizeof(GL_FLOAT)));
-        // components (UV), stride in bytes, and offset
-        glBufferData(GL_ARRAY_BUFFER, vertexes * vertex_bytes, tmp, GL_DYNAMIC_DRAW);
-        
-        // upload colour information
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_color);
-        glEnableVertexAttribArray(shader_attrib_color);
-        glVertexAttribPointer(shader_attrib_color, 4, GL_UNSIGNED_BYTE, true, vertex_bytes, (char *) (5 * sizeof(GL_FLOAT)));
-        // components (UV), stride in bytes, and offset
-        glBufferData(GL_ARRAY_BUFFER, vertexes * vertex_bytes, tmp, GL_DYNAMIC_DRAW);
-        
-        // FIXME -- this should all be combined into one vertex buffer instead
-        // FIXME -- of uploading data four times
-        
+
+        // only the frame counter changes every frame, so only it is laid
+        // out again (bf3_text_update does nothing for the message)
+        int len = snprintf(counter, sizeof(counter), "Frame %ld", frame);
+        bf3_text_set_utf8(&counter_text, counter, (size_t) len);
+        bf3_text_update(&message_text);
+        bf3_text_update(&counter_text);
+
+        // copy the vertices of both into the vertex buffer
+        size_t vertexes = message_text.num_vertices + counter_text.num_vertices;
+        assert(vertexes <= max_glyphs * 6);
+        bf3_vertex *dest = ring_begin(&vertices);
+        memcpy(dest, message_text.vertices, message_text.num_vertices * sizeof(bf3_vertex));
+        memcpy(dest + message_text.num_vertices, counter_text.vertices,
+            counter_text.num_vertices * sizeof(bf3_vertex));
+        GLint first = ring_end(&vertices, vertexes * sizeof(bf3_vertex));
+
         // make the texture active in texture unit 0
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, atlas_texture);
-        
-        // finally draw
-        glDrawArrays(GL_TRIANGLES, 0, vertexes);
-        
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+
+        // finally draw, with one call
+        glDrawArrays(GL_TRIANGLES, first, (GLsizei) vertexes);
+        ring_fence(&vertices);
+
+        if (!headless)
+        {
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+
+        // the first frame also compiles shaders, so is counted separately
+        double elapsed = now_seconds() - frame_start;
+        if (frame == 0) { first_frame = elapsed; }
+        else if (elapsed > slowest) { slowest = elapsed; }
+        total_glyphs += vertexes / 6;
+        frame++;
+    }
+
+    if (headless)
+    {
+        // wait for the GPU, and check something was drawn
+        glFinish();
+        double seconds = now_seconds() - start;
+
+        unsigned char *pixels = malloc((size_t) (width * height * 4));
+        assert(pixels);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        size_t drawn = 0;
+        for (int i = 0; i < width * height; i++)
+            { if (pixels[(4 * i) + 0] != pixels[(4 * i) + 2]) { drawn++; } } // not grey
+        free(pixels);
+
+        printf("Frames: %ld, quads per frame: %.1f\n",
+            frame, (double) total_glyphs / (double) frame);
+        printf("Uploaded: %zu bytes, %.1f bytes per frame\n",
+            vertices.bytes_uploaded, (double) vertices.bytes_uploaded / (double) frame);
+        printf("Frame time: %.3f ms average, %.3f ms slowest, %.3f ms first (%.1f frames/s)\n",
+            1000.0 * seconds / (double) frame, 1000.0 * slowest, 1000.0 * first_frame,
+            (double) frame / seconds);
+        printf("Pixels drawn in the last frame: %zu\n", drawn);
+        printf("Relayouts: message %u, frame counter %u\n",
+            (unsigned int) message_text.relayouts, (unsigned int) counter_text.relayouts);
+
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteRenderbuffers(1, &renderbuffer);
     }
 
-    glfwTerminate();
+    ring_free(&vertices);
+    glDeleteVertexArrays(1, &vao);
 
+    if (!headless) { glfwTerminate(); }
+
+    free(message_vertices);
+    free(message_quads);
+    free(message_codepoints);
     free(kerning);
     free(metrics);
     free(hdr);
 
     return 0;
 }
-
-
@@ -164,7 +164,7 @@ int main(int argc, char *argv[])
         printf("Mode: ID: %d, Font ID: %d, Size: %.2f\n",
             mode.mode_id, mode.font_id, size);
         
-        if ((mode.font_id == font_sans.id) && (mode.size == wanted_size) && (mode.antialias))
+        if ((mode.font_id == font_sans.id) && (mode.size == wanted_size) && (mode.antialias) && (!mode.sdf))
             { mode_sans16 = mode; found=true; }
     }
     
@@ -26,15 +26,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-/* utf8_decode.h */
-
-#define UTF8_END   -1
-#define UTF8_ERROR -2
-
-int  utf8_decode_at_byte();
-int  utf8_decode_at_character();
-void utf8_decode_init(const char *p, int length);
-int  utf8_decode_next();
+#include "utf8.h"
 
 
 /*
@@ -58,26 +50,39 @@ int  utf8_decode_next();
     1110xxxx           2    2048   65535 excluding 55296 - 57343
     11110xxx           3   65536 1114111
     11111xxx       error
+
+    All of the decoder's state is in a utf8_decoder, so any number of them
+    can be used at once, e.g. from different threads. The utf8_decode_*
+    functions use one shared decoder, and are not reentrant.
+
+    utf8_decode_bulk decodes a whole buffer at once, with the same rules,
+    and keeps no state at all. On x86, it decodes 16 bytes at a time with
+    SSE2 (32 bytes of ASCII at a time with AVX2) where it can.
 */
 
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(UTF8_NO_SIMD)
+#   define UTF8_SSE2
+#   include <emmintrin.h>
+#   if defined(__AVX2__)
+#       define UTF8_AVX2
+#       include <immintrin.h>
+#   endif
+#endif
+
 
-static int  the_index = 0;
-static int  the_length = 0;
-static int  the_char = 0;
-static int  the_byte = 0;
-static const char *the_input;
+static utf8_decoder the_decoder;
 
 
 /*
     Get the next byte. It returns UTF8_END if there are no more bytes.
 */
-static int get() {
+static int get(utf8_decoder *d) {
     int c;
-    if (the_index >= the_length) {
+    if (d->index >= d->length) {
         return UTF8_END;
     }
-    c = the_input[the_index] & 0xFF;
-    the_index += 1;
+    c = d->input[d->index] & 0xFF;
+    d->index += 1;
     return c;
 }
 
@@ -86,8 +91,8 @@ static int get() {
     Get the 6-bit payload of the next continuation byte.
     Return UTF8_ERROR if it is not a contination byte.
 */
-static int cont() {
-    int c = get();
+static int cont(utf8_decoder *d) {
+    int c = get(d);
     return ((c & 0xC0) == 0x80)
         ? (c & 0x3F)
         : UTF8_ERROR;
@@ -95,22 +100,22 @@ static int cont() {
 
 
 /*
-    Initialize the UTF-8 decoder. The decoder is not reentrant,
+    Initialize a UTF-8 decoder.
 */
-void utf8_decode_init(const char *p, int length) {
-    the_index = 0;
-    the_input = p;
-    the_length = length;
-    the_char = 0;
-    the_byte = 0;
+void utf8_decoder_init(utf8_decoder *d, const char *p, int length) {
+    d->index = 0;
+    d->input = p;
+    d->length = length;
+    d->character = 0;
+    d->byte = 0;
 }
 
 
 /*
     Get the current byte offset. This is generally used in error reporting.
 */
-int utf8_decode_at_byte() {
-    return the_byte;
+int utf8_decoder_at_byte(const utf8_decoder *d) {
+    return d->byte;
 }
 
 
@@ -118,9 +123,9 @@ int utf8_decode_at_byte() {
     Get the current character offset. This is generally used in error reporting.
     The character offset matches the byte offset if the text is strictly ASCII.
 */
-int utf8_decode_at_character() {
-    return (the_char > 0)
-        ? the_char - 1
+int utf8_decoder_at_character(const utf8_decoder *d) {
+    return (d->character > 0)
+        ? d->character - 1
         : 0;
 }
 
@@ -131,19 +136,19 @@ int utf8_decode_at_character() {
          or  UTF8_END   (the end)
          or  UTF8_ERROR (error)
 */
-int utf8_decode_next() {
+int utf8_decoder_next(utf8_decoder *d) {
     int c;  /* the first byte of the character */
     int c1; /* the first continuation character */
     int c2; /* the second continuation character */
     int c3; /* the third continuation character */
     int r;  /* the result */
 
-    if (the_index >= the_length) {
-        return the_index == the_length ? UTF8_END : UTF8_ERROR;
+    if (d->index >= d->length) {
+        return d->index == d->length ? UTF8_END : UTF8_ERROR;
     }
-    the_byte = the_index;
-    the_char += 1;
-    c = get();
+    d->byte = d->index;
+    d->character += 1;
+    c = get(d);
 /*
     Zero continuation (0 to 127)
 */
@@ -154,7 +159,7 @@ int utf8_decode_next() {
     One continuation (128 to 2047)
 */
     if ((c & 0xE0) == 0xC0) {
-        c1 = cont();
+        c1 = cont(d);
         if (c1 >= 0) {
             r = ((c & 0x1F) << 6) | c1;
             if (r >= 128) {
@@ -166,8 +171,8 @@ int utf8_decode_next() {
     Two continuations (2048 to 55295 and 57344 to 65535)
 */
     } else if ((c & 0xF0) == 0xE0) {
-        c1 = cont();
-        c2 = cont();
+        c1 = cont(d);
+        c2 = cont(d);
         if ((c1 | c2) >= 0) {
             r = ((c & 0x0F) << 12) | (c1 << 6) | c2;
             if (r >= 2048 && (r < 55296 || r > 57343)) {
@@ -179,9 +184,9 @@ int utf8_decode_next() {
     Three continuations (65536 to 1114111)
 */
     } else if ((c & 0xF8) == 0xF0) {
-        c1 = cont();
-        c2 = cont();
-        c3 = cont();
+        c1 = cont(d);
+        c2 = cont(d);
+        c3 = cont(d);
         if ((c1 | c2 | c3) >= 0) {
             r = ((c & 0x07) << 18) | (c1 << 12) | (c2 << 6) | c3;
             if (r >= 65536 && r <= 1114111) {
@@ -192,3 +197,293 @@ int utf8_decode_next() {
     return UTF8_ERROR;
 }
 
+
+/*
+    The same, using the shared decoder. These are not reentrant.
+*/
+void utf8_decode_init(const char *p, int length) {
+    utf8_decoder_init(&the_decoder, p, length);
+}
+
+int utf8_decode_at_byte() {
+    return utf8_decoder_at_byte(&the_decoder);
+}
+
+int utf8_decode_at_character() {
+    return utf8_decoder_at_character(&the_decoder);
+}
+
+int utf8_decode_next() {
+    return utf8_decoder_next(&the_decoder);
+}
+
+
+/*
+    Decode one character from the `left` bytes at `p` into `*r`.
+    Returns the number of bytes used, or 0 if they are not valid (or the
+    character is cut off).
+*/
+static size_t decode_one(const unsigned char *p, size_t left, uint32_t *r) {
+    uint32_t c = p[0];
+    uint32_t minimum;
+    size_t length;
+    size_t i;
+
+    if ((c & 0x80) == 0) {
+        *r = c;
+        return 1;
+    } else if ((c & 0xE0) == 0xC0) {
+        length = 2; c &= 0x1F; minimum = 128;
+    } else if ((c & 0xF0) == 0xE0) {
+        length = 3; c &= 0x0F; minimum = 2048;
+    } else if ((c & 0xF8) == 0xF0) {
+        length = 4; c &= 0x07; minimum = 65536;
+    } else {
+        return 0;
+    }
+
+    if (left < length) {
+        return 0;
+    }
+    for (i = 1; i < length; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+
+    if (c < minimum || c > 1114111 || (c >= 55296 && c <= 57343)) {
+        return 0;
+    }
+    *r = c;
+    return length;
+}
+
+
+#ifdef UTF8_SSE2
+
+/*
+    Decode the 16 bytes at `p`, if they hold only characters of 1 to 3
+    bytes, into at most 16 characters at `out`. A character cut off at the
+    end of the 16 bytes is left for next time.
+    Returns the number of bytes used (0 if they can't be decoded this way,
+    e.g. they are not valid, or hold 4 byte characters), and sets `*count`
+    to the number of characters.
+*/
+static size_t decode_block(const unsigned char *p, uint32_t *out, size_t *count) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i n1 = _mm_srli_si128(v, 1); /* the byte after each byte */
+    __m128i n2 = _mm_srli_si128(v, 2); /* and the byte after that */
+
+    __m128i is_cont = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char) 0xC0)),
+                                     _mm_set1_epi8((char) 0x80));
+    __m128i is_lead2 = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char) 0xE0)),
+                                      _mm_set1_epi8((char) 0xC0));
+    __m128i is_lead3 = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char) 0xF0)),
+                                      _mm_set1_epi8((char) 0xE0));
+
+    unsigned int high = (unsigned int) _mm_movemask_epi8(v);
+    unsigned int conts = (unsigned int) _mm_movemask_epi8(is_cont);
+    unsigned int lead2 = (unsigned int) _mm_movemask_epi8(is_lead2);
+    unsigned int lead3 = (unsigned int) _mm_movemask_epi8(is_lead3);
+
+    /* leave a character cut off at the end for next time */
+    unsigned int expected;
+    unsigned int keep = 0xFFFF;
+    size_t used = 16;
+    if (((lead2 | lead3) & 0x8000) != 0) {
+        keep = 0x7FFF; used = 15;
+    }
+    if ((lead3 & 0x4000) != 0) {
+        keep = 0x3FFF; used = 14;
+    }
+
+    /*
+        Every byte of 128 or more is a first byte of 2 or 3, or a
+        continuation, and the continuations are exactly the bytes after each
+        first byte: so there are no 4 byte characters, 11111xxx bytes,
+        missing or extra continuations (including one that would be past
+        the bytes kept).
+    */
+    lead2 &= keep;
+    lead3 &= keep;
+    expected = (lead2 << 1) | (lead3 << 1) | (lead3 << 2);
+    if ((high & keep) != ((conts & keep) | lead2 | lead3)) {
+        return 0;
+    }
+    if ((conts & keep) != expected) {
+        return 0;
+    }
+
+    /*
+        Aliases: 2 byte characters below 128 start with 0xC0 or 0xC1, and 3
+        byte characters below 2048 start 0xE0 0x80 to 0xE0 0x9F. Surrogates
+        start 0xED 0xA0 to 0xED 0xBF.
+    */
+    {
+        __m128i alias2 = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char) 0xFE)),
+                                        _mm_set1_epi8((char) 0xC0));
+        __m128i n1_low = _mm_cmpeq_epi8(_mm_min_epu8(n1, _mm_set1_epi8((char) 0x9F)), n1);
+        __m128i alias3 = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) 0xE0)), n1_low);
+        __m128i surrogate = _mm_andnot_si128(n1_low,
+                                             _mm_cmpeq_epi8(v, _mm_set1_epi8((char) 0xED)));
+        __m128i bad = _mm_or_si128(alias2, _mm_or_si128(alias3, surrogate));
+        if (((unsigned int) _mm_movemask_epi8(bad) & keep) != 0) {
+            return 0;
+        }
+    }
+
+    /*
+        Work out the character starting at every byte, in 16 bits (every
+        character here is below 65536), then keep the ones that really start
+        a character.
+    */
+    {
+        uint16_t chars[16];
+        unsigned int starts = ~conts & keep;
+        size_t n = 0;
+        int half;
+
+        for (half = 0; half < 2; half++) {
+            __m128i b0, b1, b2, m2, m3, c1, c2, c3;
+            if (half == 0) {
+                b0 = _mm_unpacklo_epi8(v, zero);
+                b1 = _mm_unpacklo_epi8(n1, zero);
+                b2 = _mm_unpacklo_epi8(n2, zero);
+                m2 = _mm_unpacklo_epi8(is_lead2, is_lead2);
+                m3 = _mm_unpacklo_epi8(is_lead3, is_lead3);
+            } else {
+                b0 = _mm_unpackhi_epi8(v, zero);
+                b1 = _mm_unpackhi_epi8(n1, zero);
+                b2 = _mm_unpackhi_epi8(n2, zero);
+                m2 = _mm_unpackhi_epi8(is_lead2, is_lead2);
+                m3 = _mm_unpackhi_epi8(is_lead3, is_lead3);
+            }
+
+            /* the payloads of the first and continuation bytes */
+            c1 = _mm_slli_epi16(_mm_and_si128(b1, _mm_set1_epi16(0x3F)), 6);
+            c2 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b0, _mm_set1_epi16(0x1F)), 6),
+                              _mm_and_si128(b1, _mm_set1_epi16(0x3F)));
+            c3 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b0, _mm_set1_epi16(0x0F)), 12),
+                              _mm_or_si128(c1, _mm_and_si128(b2, _mm_set1_epi16(0x3F))));
+
+            b0 = _mm_andnot_si128(_mm_or_si128(m2, m3), b0);
+            b0 = _mm_or_si128(b0, _mm_and_si128(m2, c2));
+            b0 = _mm_or_si128(b0, _mm_and_si128(m3, c3));
+            _mm_storeu_si128((__m128i *) (chars + (8 * half)), b0);
+        }
+
+#if defined(__GNUC__)
+        while (starts) {
+            out[n++] = chars[__builtin_ctz(starts)];
+            starts &= starts - 1;
+        }
+#else
+        /* out[n] is written over until it holds a character */
+        size_t i;
+        for (i = 0; i < used; i++) {
+            out[n] = chars[i];
+            n += (starts >> i) & 1;
+        }
+#endif
+
+        *count = n;
+    }
+
+    return used;
+}
+
+
+/*
+    Decode `n` bytes of ASCII at `p` to `out`, where n is 16 (or 32 with
+    AVX2). Returns false if they are not all ASCII.
+*/
+static int decode_ascii(const unsigned char *p, uint32_t *out) {
+#ifdef UTF8_AVX2
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    if (_mm256_movemask_epi8(v) != 0) {
+        return 0;
+    }
+    _mm256_storeu_si256((__m256i *) (out + 0), _mm256_cvtepu8_epi32(_mm256_castsi256_si128(v)));
+    _mm256_storeu_si256((__m256i *) (out + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(_mm256_castsi256_si128(v), 8)));
+    _mm256_storeu_si256((__m256i *) (out + 16), _mm256_cvtepu8_epi32(_mm256_extracti128_si256(v, 1)));
+    _mm256_storeu_si256((__m256i *) (out + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(_mm256_extracti128_si256(v, 1), 8)));
+    return 1;
+#else
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i lo, hi;
+    if (_mm_movemask_epi8(v) != 0) {
+        return 0;
+    }
+    lo = _mm_unpacklo_epi8(v, zero);
+    hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128((__m128i *) (out + 0), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *) (out + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *) (out + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *) (out + 12), _mm_unpackhi_epi16(hi, zero));
+    return 1;
+#endif
+}
+
+#ifdef UTF8_AVX2
+#   define ASCII_BLOCK 32
+#else
+#   define ASCII_BLOCK 16
+#endif
+
+#endif /* UTF8_SSE2 */
+
+
+/*
+    Decode UTF-8 to UTF-32 in bulk, with the same rules as utf8_decoder_next.
+    Decodes the `length` bytes at `p` into at most `max` characters at `out`,
+    and returns how many. `*consumed` (if not NULL) is set to the number of
+    bytes decoded. If that is less than `length` and fewer than `max`
+    characters were decoded, the bytes at `*consumed` are not valid UTF-8:
+    they are an error, or a character cut off at the end.
+*/
+size_t utf8_decode_bulk(const char *p, size_t length, uint32_t *out, size_t max,
+                        size_t *consumed) {
+    const unsigned char *in = (const unsigned char *) p;
+    size_t index = 0;
+    size_t n = 0;
+
+    while (index < length && n < max) {
+        size_t used;
+        uint32_t r;
+
+#ifdef UTF8_SSE2
+        if (length - index >= ASCII_BLOCK && max - n >= ASCII_BLOCK) {
+            if (decode_ascii(in + index, out + n)) {
+                index += ASCII_BLOCK;
+                n += ASCII_BLOCK;
+                continue;
+            }
+        }
+        if (length - index >= 16 && max - n >= 16) {
+            size_t count;
+            used = decode_block(in + index, out + n, &count);
+            if (used) {
+                index += used;
+                n += count;
+                continue;
+            }
+        }
+#endif
+
+        used = decode_one(in + index, length - index, &r);
+        if (!used) {
+            break;
+        }
+        out[n] = r;
+        index += used;
+        n += 1;
+    }
+
+    if (consumed) {
+        *consumed = index;
+    }
+    return n;
+}
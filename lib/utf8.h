@@ -0,0 +1,64 @@
+/* utf8_decode.h */
+
+/* 2016-04-05 */
+
+/*
+Copyright (c) 2005 JSON.org
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+The Software shall be used for Good, not Evil.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef UTF8_DECODE_H
+#define UTF8_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UTF8_END   -1
+#define UTF8_ERROR -2
+
+/*
+    The state of one decoder. The utf8_decode_* functions share one static
+    decoder; the utf8_decoder_* functions take their own, so they are
+    reentrant.
+*/
+typedef struct utf8_decoder {
+    const char *input;
+    int index;
+    int length;
+    int character;
+    int byte;
+} utf8_decoder;
+
+int  utf8_decode_at_byte();
+int  utf8_decode_at_character();
+void utf8_decode_init(const char *p, int length);
+int  utf8_decode_next();
+
+int  utf8_decoder_at_byte(const utf8_decoder *d);
+int  utf8_decoder_at_character(const utf8_decoder *d);
+void utf8_decoder_init(utf8_decoder *d, const char *p, int length);
+int  utf8_decoder_next(utf8_decoder *d);
+
+size_t utf8_decode_bulk(const char *p, size_t length, uint32_t *out, size_t max,
+                        size_t *consumed);
+
+#endif /* UTF8_DECODE_H */
@@ -0,0 +1,296 @@
+// Test that the fused layout and emit functions give exactly the same result
+// as bf3_layout_utf8 followed by bf3_emit_triangles or bf3_emit_instances
+
+// COMPILE:
+//     gcc -std=c99 test/fused.c bakefont3.c -I. -lm -Wall -Wextra -o test-fused.bin
+// USAGE:
+//     ./test-fused.bin [data.bf3 ...]
+//     (default: example/test.bf3, with the texts in bench/corpus)
+//
+// For every table, lays out each text of the bench corpus, and seeded random
+// UTF-8 (including invalid bytes), with bf3_layout_triangles_utf8,
+// bf3_layout_instances_utf8, and the two passes. Each text is laid out whole,
+// then cut short at random, including partway through a UTF-8 sequence,
+// with `max_quads` that aren't a multiple of the 64 quad window. Checks that
+// the vertices, the instances, `consumed`, the number of quads and the final
+// bf3_layout state are all the same. Returns 0 if they are.
+
+
+#include "bakefont3.h"
+#include "bench/common.h" // read_file, for_each_table, test_random
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy
+#include <stdio.h>
+
+#ifndef TEST_DEFAULT_FILE
+#   define TEST_DEFAULT_FILE "example/test.bf3"
+#endif
+#ifndef TEST_CORPUS_DIR
+#   define TEST_CORPUS_DIR "bench/corpus"
+#endif
+
+#define NUM_CUTS    50    // random cuts of each text, for each table
+#define RANDOM_TEXT 8192  // bytes of random UTF-8
+#define SEED        4321
+
+static const char *corpora[] =
+    {"english.txt", "german.txt", "greek.txt", "cyrillic.txt", "cjk.txt", "code.txt"};
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+// around the 64 quad window of the fused functions
+static const size_t max_quads[] = {0, 1, 2, 63, 65, 100, 127, 129, 191, 1000};
+#define NUM_MAX_QUADS (sizeof(max_quads) / sizeof(max_quads[0]))
+
+
+typedef struct text text;
+
+struct text
+{
+    const char *name;
+    char *utf8;
+    size_t len;
+};
+
+typedef struct buffers buffers;
+
+struct buffers
+{
+    bf3_quad *quads;
+    bf3_vertex *vertices[2];    // two passes, fused
+    bf3_instance *instances[2]; // two passes, fused
+};
+
+
+static bool layout_equal(const bf3_layout *a, const bf3_layout *b)
+{
+    return (a->origin_x == b->origin_x)
+        && (a->pen_x == b->pen_x)
+        && (a->pen_y == b->pen_y)
+        && (a->lineheight == b->lineheight)
+        && (a->previous == b->previous)
+        && (a->metrics == b->metrics)
+        && (a->kerning == b->kerning)
+        && (a->num_metrics == b->num_metrics)
+        && (a->num_kerning == b->num_kerning)
+        && (a->dense_first == b->dense_first)
+        && (a->dense_index == b->dense_index)
+        && (a->dense_count == b->dense_count);
+}
+
+
+// Lay out `len` bytes of `utf8` all three ways from the same layout state.
+// Returns the number of failed checks.
+static size_t compare(const bf3_layout *start, const bf3_emitter *emitter,
+    buffers *b, size_t max, const char *utf8, size_t len, const char *name)
+{
+    size_t failures = 0;
+
+    bf3_layout two_pass = *start, triangles = *start, instances = *start;
+    size_t consumed = 0, triangles_consumed = 0, instances_consumed = 0;
+
+    size_t count = bf3_layout_utf8(&two_pass, b->quads, max, utf8, len, &consumed);
+    bf3_emit_triangles(emitter, b->vertices[0], b->quads, count);
+    bf3_emit_instances(emitter, b->instances[0], b->quads, count);
+
+    size_t triangles_count = bf3_layout_triangles_utf8(&triangles, emitter, b->vertices[1],
+        max, utf8, len, &triangles_consumed);
+    size_t instances_count = bf3_layout_instances_utf8(&instances, emitter, b->instances[1],
+        max, utf8, len, &instances_consumed);
+
+    if ((triangles_count != count) || (instances_count != count))
+        { failures++; }
+    else if ((triangles_consumed != consumed) || (instances_consumed != consumed))
+        { failures++; }
+    else if (0 != memcmp(b->vertices[0], b->vertices[1], 6 * count * sizeof(bf3_vertex)))
+        { failures++; }
+    else if (0 != memcmp(b->instances[0], b->instances[1], count * sizeof(bf3_instance)))
+        { failures++; }
+    else if (!layout_equal(&two_pass, &triangles) || !layout_equal(&two_pass, &instances))
+        { failures++; }
+
+    if (failures)
+    {
+        fprintf(stderr, "  %s, %u bytes, max_quads %u: %u/%u/%u quads, consumed %u/%u/%u\n",
+            name, (unsigned int) len, (unsigned int) max, (unsigned int) count,
+            (unsigned int) triangles_count, (unsigned int) instances_count,
+            (unsigned int) consumed, (unsigned int) triangles_consumed,
+            (unsigned int) instances_consumed);
+    }
+
+    return failures;
+}
+
+
+typedef struct tests tests;
+
+struct tests
+{
+    text *texts;
+    size_t num_texts;
+    buffers buffers;
+    size_t capacity; // quads
+};
+
+// Returns the number of failed checks
+static size_t test_table(const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning, void *arg)
+{
+    tests *t = arg;
+    size_t failures = 0;
+    size_t checks = 0;
+    uint32_t seed = SEED;
+
+    // a vertical gradient, so that top and bottom vertices differ
+    bf3_emitter emitter;
+    bf3_emitter_init(&emitter, info);
+    const uint8_t top[4] = {255, 128, 0, 200}, bottom[4] = {0, 64, 255, 255};
+    memcpy(emitter.color_top, top, 4);
+    memcpy(emitter.color_bottom, bottom, 4);
+
+    // starting left of and above the origin, so some coordinates are negative
+    bf3_layout start;
+    bf3_layout_init(&start, mode, metrics, kerning, -5, 30);
+
+    for (size_t i = 0; i < t->num_texts; i++)
+    {
+        const text *x = &t->texts[i];
+
+        // the whole text
+        failures += compare(&start, &emitter, &t->buffers, t->capacity, x->utf8, x->len, x->name);
+        checks++;
+
+        for (int cut = 0; cut < NUM_CUTS; cut++)
+        {
+            // cut anywhere, which for most of the corpus is often partway
+            // through a sequence
+            size_t len = test_random(&seed) % (x->len + 1);
+            size_t max = (cut < (int) NUM_MAX_QUADS) ? max_quads[cut]
+                : (test_random(&seed) % (len + 2));
+
+            // and every so often, just after a lead byte
+            if ((cut % 4) == 3)
+            {
+                while ((len < x->len) && ((unsigned char) x->utf8[len] < 0xC0)) { len++; }
+                if (len < x->len) { len++; }
+            }
+
+            failures += compare(&start, &emitter, &t->buffers, max, x->utf8, len, x->name);
+            checks++;
+        }
+
+        if (failures >= 10) { break; }
+    }
+
+    printf("  %u comparisons, %u failed\n", (unsigned int) checks, (unsigned int) failures);
+    return failures;
+}
+
+
+// Seeded random UTF-8: mostly valid characters of every length, with some
+// invalid bytes, overlong sequences, surrogates and cut off sequences
+static void random_utf8(char *dest, size_t len, uint32_t seed)
+{
+    size_t n = 0;
+    while (n + 4 <= len)
+    {
+        uint32_t r = test_random(&seed);
+        uint32_t kind = r % 100;
+        uint32_t c = test_random(&seed);
+
+        if (kind < 2)       { dest[n++] = (char) (c & 0xFF); continue; } // any byte
+        else if (kind < 3)  { dest[n++] = (char) 0xC0; dest[n++] = (char) 0xAF; continue; } // overlong
+        else if (kind < 4)  { dest[n++] = (char) 0xED; dest[n++] = (char) 0xA0; dest[n++] = (char) 0x80; continue; } // surrogate
+        else if (kind < 5)  { dest[n++] = (char) 0xE2; dest[n++] = (char) 0x82; continue; } // cut off
+        else if (kind < 50) { c = 0x20 + (c % 0x5F); }
+        else if (kind < 55) { c = '\n'; }
+        else if (kind < 75) { c = 0x80 + (c % 0x780); }
+        else if (kind < 95) { c = 0x800 + (c % 0xF800); if ((c >= 0xD800) && (c < 0xE000)) { c = 0xFFFD; } }
+        else                { c = 0x10000 + (c % 0x100000); }
+
+        if (c < 0x80) { dest[n++] = (char) c; }
+        else if (c < 0x800)
+        {
+            dest[n++] = (char) (0xC0 | (c >> 6));
+            dest[n++] = (char) (0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            dest[n++] = (char) (0xE0 | (c >> 12));
+            dest[n++] = (char) (0x80 | ((c >> 6) & 0x3F));
+            dest[n++] = (char) (0x80 | (c & 0x3F));
+        }
+        else
+        {
+            dest[n++] = (char) (0xF0 | (c >> 18));
+            dest[n++] = (char) (0x80 | ((c >> 12) & 0x3F));
+            dest[n++] = (char) (0x80 | ((c >> 6) & 0x3F));
+            dest[n++] = (char) (0x80 | (c & 0x3F));
+        }
+    }
+    while (n < len) { dest[n++] = 'x'; }
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t failures = 0;
+    text texts[NUM_CORPORA + 1] = {{0}};
+    tests t = {texts, 0, {0}, 0};
+
+    for (size_t i = 0; i < NUM_CORPORA; i++)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", TEST_CORPUS_DIR, corpora[i]);
+        text *x = &texts[t.num_texts];
+        x->name = corpora[i];
+        x->utf8 = read_file(path, &x->len);
+        if (!x->utf8) { fprintf(stderr, "Could not open %s\n", path); failures++; continue; }
+        t.num_texts++;
+    }
+
+    text *x = &texts[t.num_texts];
+    x->name = "random";
+    x->len = RANDOM_TEXT;
+    x->utf8 = malloc(RANDOM_TEXT);
+    if (!x->utf8) { fprintf(stderr, "Malloc error (text)\n"); return -1; }
+    random_utf8(x->utf8, RANDOM_TEXT, SEED);
+    t.num_texts++;
+
+    // at most one quad per byte
+    for (size_t i = 0; i < t.num_texts; i++)
+        { if (texts[i].len > t.capacity) { t.capacity = texts[i].len; } }
+
+    t.buffers.quads = malloc(t.capacity * sizeof(bf3_quad));
+    for (int i = 0; i < 2; i++)
+    {
+        t.buffers.vertices[i] = malloc(6 * t.capacity * sizeof(bf3_vertex));
+        t.buffers.instances[i] = malloc(t.capacity * sizeof(bf3_instance));
+    }
+
+    if (!t.buffers.quads || !t.buffers.vertices[0] || !t.buffers.vertices[1]
+        || !t.buffers.instances[0] || !t.buffers.instances[1])
+        { fprintf(stderr, "Malloc error\n"); failures++; goto done; }
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+            { failures += for_each_table(argv[i], test_table, &t); }
+    }
+    else
+    {
+        failures += for_each_table(TEST_DEFAULT_FILE, test_table, &t);
+    }
+
+    done:
+        for (int i = 0; i < 2; i++)
+        {
+            free(t.buffers.instances[i]);
+            free(t.buffers.vertices[i]);
+        }
+        free(t.buffers.quads);
+        for (size_t i = 0; i < t.num_texts; i++) { free(texts[i].utf8); }
+
+    if (failures) { printf("FAIL (%u)\n", (unsigned int) failures); return 1; }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,163 @@
+// Test that compact instance records expand to the same vertices as
+// bf3_emit_triangles
+
+// COMPILE:
+//     gcc -std=c99 test/instance.c bakefont3.c -I. -lm -Wall -Wextra -o test-instance.bin
+// USAGE:
+//     ./test-instance.bin [data.bf3 ...]
+//     (default: example/test.bf3)
+//
+// For every table, lays out every codepoint from U+0020 to U+FFFF, 64 to a
+// line and starting left of and above the origin. Then emits the quads with
+// bf3_emit_triangles and with bf3_emit_instances16, expands each instance the
+// same way as the reference vertex shader in bakefont3.h, and checks that
+// every vertex is exactly the same. Returns 0 if they are.
+
+
+#include "bakefont3.h"
+#include "bench/common.h" // read_file, memfile
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy
+#include <stdio.h>
+
+#ifndef TEST_DEFAULT_FILE
+#   define TEST_DEFAULT_FILE "example/test.bf3"
+#endif
+
+#define FIRST_CODEPOINT 0x20
+#define LAST_CODEPOINT  0xFFFF
+#define LINE_LENGTH     64
+
+
+// Expand one instance into six vertices, the same as the reference shader
+static void expand(const bf3_emitter *emitter, bf3_vertex vertices[6],
+    const bf3_instance16 *instance)
+{
+    static const int corners[6] = {0, 1, 2, 0, 2, 3};
+
+    for (int i = 0; i < 6; i++)
+    {
+        int corner = corners[i];
+        float right = (corner >= 2) ? 1.0f : 0.0f;
+        float bottom = ((corner == 1) || (corner == 2)) ? 1.0f : 0.0f;
+        float offset_x = (float) instance->tex_w * right;
+        float offset_y = (float) instance->tex_h * bottom;
+
+        bf3_vertex *vertex = &vertices[i];
+        vertex->x = (float) instance->x + offset_x;
+        vertex->y = (float) instance->y + offset_y;
+        vertex->u = ((float) instance->tex_x + offset_x) * emitter->inv_width;
+        vertex->v = ((float) instance->tex_y + offset_y) * emitter->inv_height;
+
+        // the fragment shader reads `channel`, which is what the mask selects
+        memset(vertex->mask, 0, 4);
+        if (instance->channel < 4) { vertex->mask[instance->channel] = 255; }
+
+        memcpy(vertex->color, instance->color, 4);
+    }
+}
+
+
+// Returns the number of mismatched quads
+static size_t test_table(const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning, const uint32_t *text, size_t len)
+{
+    size_t failures = 0;
+
+    bf3_quad *quads = malloc(len * sizeof(bf3_quad));
+    bf3_vertex *vertices = malloc(len * 6 * sizeof(bf3_vertex));
+    bf3_instance16 *instances = malloc(len * sizeof(bf3_instance16));
+    if (!quads || !vertices || !instances) { fprintf(stderr, "Malloc error\n"); failures = 1; goto done; }
+
+    bf3_layout layout;
+    bf3_layout_init(&layout, mode, metrics, kerning, -100, -20);
+    size_t count = bf3_layout_utf32(&layout, quads, len, text, len, NULL);
+
+    // one colour, as instances only have one
+    bf3_emitter emitter;
+    bf3_emitter_init(&emitter, info);
+    const uint8_t color[4] = {255, 128, 0, 200};
+    memcpy(emitter.color_top, color, 4);
+    memcpy(emitter.color_bottom, color, 4);
+
+    bf3_emit_triangles(&emitter, vertices, quads, count);
+    bf3_emit_instances16(&emitter, instances, quads, count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        bf3_vertex expanded[6];
+        expand(&emitter, expanded, &instances[i]);
+
+        if (0 != memcmp(expanded, &vertices[6 * i], sizeof(expanded)))
+        {
+            if (failures < 10)
+            {
+                fprintf(stderr, "  quad %u (%d, %d, tex %u %u %u %u %u) differs\n",
+                    (unsigned int) i, (int) quads[i].x, (int) quads[i].y,
+                    quads[i].tex_x, quads[i].tex_y, quads[i].tex_w, quads[i].tex_h,
+                    quads[i].tex_z);
+            }
+            failures++;
+        }
+    }
+
+    printf("  %u quads, %u differ\n", (unsigned int) count, (unsigned int) failures);
+
+    done:
+        free(instances);
+        free(vertices);
+        free(quads);
+        return failures;
+}
+
+
+// the text laid out with every table
+typedef struct text text;
+
+struct text
+{
+    const uint32_t *codepoints;
+    size_t len;
+};
+
+static size_t test_text(const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning, void *arg)
+{
+    const text *t = arg;
+    return test_table(info, mode, metrics, kerning, t->codepoints, t->len);
+}
+
+
+int main(int argc, char *argv[])
+{
+    // every codepoint in range, with a newline after every LINE_LENGTH
+    size_t max = (LAST_CODEPOINT - FIRST_CODEPOINT + 1);
+    max += (max / LINE_LENGTH) + 1;
+    uint32_t *codepoints = malloc(max * sizeof(uint32_t));
+    if (!codepoints) { fprintf(stderr, "Malloc error (text)\n"); return -1; }
+
+    size_t len = 0;
+    for (uint32_t codepoint = FIRST_CODEPOINT; codepoint <= LAST_CODEPOINT; codepoint++)
+    {
+        codepoints[len++] = codepoint;
+        if ((codepoint % LINE_LENGTH) == 0) { codepoints[len++] = '\n'; }
+    }
+
+    text t = {codepoints, len};
+    size_t failures = 0;
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+            { failures += for_each_table(argv[i], test_text, &t); }
+    }
+    else
+    {
+        failures += for_each_table(TEST_DEFAULT_FILE, test_text, &t);
+    }
+
+    free(codepoints);
+
+    if (failures) { printf("FAIL (%u)\n", (unsigned int) failures); return 1; }
+    printf("OK\n");
+    return 0;
+}
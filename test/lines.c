@@ -0,0 +1,232 @@
+// Test that bf3_lines_replace, laying out only the lines an edit touches,
+// gives the same result as laying out the whole text again
+
+// COMPILE:
+//     gcc -std=c99 test/lines.c bakefont3.c -I. -lm -Wall -Wextra -o test-lines.bin
+// USAGE:
+//     ./test-lines.bin [data.bf3 ...]
+//     (default: example/test.bf3)
+//
+// For every table, makes NUM_EDITS seeded random edits (inserting and
+// removing characters, including '\n', so that lines are joined and split)
+// and now and then moves the origin. After each one, checks that:
+//
+//   * the quads and vertices are exactly those of bf3_layout_utf32 and
+//     bf3_emit_triangles for the whole text
+//   * no vertex outside [dirty_first, dirty_end) changed, and every new
+//     vertex is inside it
+//   * there is one line per '\n', plus one, and bf3_lines_find agrees
+//
+// Also checks that a bf3_lines with no line storage stays empty, and every
+// edit returns false. Returns 0 if every check passes.
+
+
+#include "bakefont3.h"
+#include "bench/common.h" // for_each_table, test_random
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy
+#include <stdio.h>
+
+#ifndef TEST_DEFAULT_FILE
+#   define TEST_DEFAULT_FILE "example/test.bf3"
+#endif
+
+#define NUM_EDITS  2000
+#define CAPACITY   4000 // codepoints
+#define MAX_LINES  500
+#define SEED       12345
+
+// edits stop inserting once the text is this long
+#define MAX_TEXT   2000
+
+static const char *start_text = "Hello, world!\nAVAWAY To\n\nwww.example.org Te\n";
+
+// characters to insert: kerning pairs, non-ASCII, and newlines
+static const uint32_t alphabet[] =
+    {'A', 'V', 'W', 'T', 'o', 'e', 'a', '.', ' ', '\n', 'y', 0x20AC, 0xA3, 0x3B1, '\n'};
+#define ALPHABET_SIZE (sizeof(alphabet) / sizeof(alphabet[0]))
+
+
+// Returns the number of failed checks
+static size_t check(const bf3_lines *lines, const bf3_vertex *before, size_t quads_before,
+    bf3_quad *quads, bf3_vertex *vertices, int edit)
+{
+    size_t failures = 0;
+
+    // the reference: the whole text laid out from scratch, from the top left
+    bf3_layout layout;
+    bf3_layout_init(&layout, &lines->mode, lines->metrics, lines->kerning, lines->x, lines->y);
+    layout.pen_y += lines->mode.lineheight;
+    size_t count = bf3_layout_utf32(&layout, quads, CAPACITY, lines->codepoints,
+        lines->num_codepoints, NULL);
+    bf3_emit_triangles(&lines->emitter, vertices, quads, count);
+
+    if ((count != lines->num_quads) || (0 != memcmp(quads, lines->quads, count * sizeof(bf3_quad))))
+    {
+        fprintf(stderr, "  edit %d: quads differ (%u quads, expected %u)\n", edit,
+            (unsigned int) lines->num_quads, (unsigned int) count);
+        return 1;
+    }
+
+    if (0 != memcmp(vertices, lines->vertices, 6 * count * sizeof(bf3_vertex)))
+        { fprintf(stderr, "  edit %d: vertices differ\n", edit); failures++; }
+
+    // every vertex that changed, or is new, is in the dirty range
+    for (size_t i = 0; i < 6 * count; i++)
+    {
+        bool changed = (i >= 6 * quads_before)
+            || (0 != memcmp(&before[i], &lines->vertices[i], sizeof(bf3_vertex)));
+        if (changed && ((i < lines->dirty_first) || (i >= lines->dirty_end)))
+        {
+            fprintf(stderr, "  edit %d: vertex %u changed outside the dirty range %u to %u\n",
+                edit, (unsigned int) i, (unsigned int) lines->dirty_first,
+                (unsigned int) lines->dirty_end);
+            failures++;
+            break;
+        }
+    }
+
+    size_t num_lines = 1;
+    for (size_t i = 0; i < lines->num_codepoints; i++)
+        { num_lines += (lines->codepoints[i] == '\n'); }
+
+    if (num_lines != lines->num_lines)
+    {
+        fprintf(stderr, "  edit %d: %u lines, expected %u\n", edit,
+            (unsigned int) lines->num_lines, (unsigned int) num_lines);
+        failures++;
+    }
+    else if (bf3_lines_find(lines, lines->num_codepoints) != num_lines - 1)
+    {
+        fprintf(stderr, "  edit %d: the end of the text isn't on the last line\n", edit);
+        failures++;
+    }
+
+    return failures;
+}
+
+
+// Returns the number of failed checks
+static size_t test_table(const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning, void *arg)
+{
+    (void) arg;
+    size_t failures = 0;
+    uint32_t seed = SEED;
+
+    uint32_t *codepoints = malloc(CAPACITY * sizeof(uint32_t));
+    bf3_quad *quads = malloc(CAPACITY * sizeof(bf3_quad));
+    bf3_vertex *vertices = malloc(6 * CAPACITY * sizeof(bf3_vertex));
+    bf3_line *line_storage = malloc(MAX_LINES * sizeof(bf3_line));
+    bf3_quad *expected_quads = malloc(CAPACITY * sizeof(bf3_quad));
+    bf3_vertex *expected_vertices = malloc(6 * CAPACITY * sizeof(bf3_vertex));
+    bf3_vertex *before = malloc(6 * CAPACITY * sizeof(bf3_vertex));
+    if (!codepoints || !quads || !vertices || !line_storage || !expected_quads
+        || !expected_vertices || !before)
+        { fprintf(stderr, "Malloc error\n"); failures = 1; goto done; }
+
+    bf3_lines lines;
+    bf3_lines_init(&lines, codepoints, quads, vertices, CAPACITY, line_storage, MAX_LINES);
+    bf3_lines_set_origin(&lines, 7, 3);
+    bf3_lines_set_table(&lines, info, mode, metrics, kerning);
+    if (!bf3_lines_set_utf8(&lines, start_text, strlen(start_text)))
+        { fprintf(stderr, "  set_utf8 failed\n"); failures++; }
+
+    uint32_t relayouts = 0;
+    size_t total_lines = 0;
+
+    for (int edit = 0; edit < NUM_EDITS; edit++)
+    {
+        size_t quads_before = lines.num_quads;
+        memcpy(before, vertices, 6 * quads_before * sizeof(bf3_vertex));
+        bf3_lines_clean(&lines);
+        uint32_t relayouts_before = lines.relayouts;
+
+        if ((edit % 100) == 99)
+        {
+            // anywhere, including above and left of the screen
+            int32_t x = (int32_t) (test_random(&seed) % 64) - 32;
+            int32_t y = (int32_t) (test_random(&seed) % 64) - 32;
+            bf3_lines_set_origin(&lines, x, y);
+        }
+        else
+        {
+            size_t len = lines.num_codepoints;
+            size_t start = test_random(&seed) % (len + 1);
+            size_t remove = test_random(&seed) % 4;
+            if (remove > len - start) { remove = len - start; }
+
+            uint32_t insert[4];
+            size_t insert_len = (len < MAX_TEXT) ? (test_random(&seed) % 5) : 0;
+            for (size_t i = 0; i < insert_len; i++)
+                { insert[i] = alphabet[test_random(&seed) % ALPHABET_SIZE]; }
+
+            if (!bf3_lines_replace(&lines, start, remove, insert, insert_len))
+                { fprintf(stderr, "  edit %d: replace failed\n", edit); failures++; }
+        }
+
+        relayouts += lines.relayouts - relayouts_before;
+        total_lines += lines.num_lines;
+
+        failures += check(&lines, before, quads_before, expected_quads, expected_vertices, edit);
+        if (failures >= 10) { break; }
+    }
+
+    printf("  %u codepoints, %u lines, laid out %u of %u lines\n",
+        (unsigned int) lines.num_codepoints, (unsigned int) lines.num_lines,
+        (unsigned int) relayouts, (unsigned int) total_lines);
+
+    done:
+        free(before);
+        free(expected_vertices);
+        free(expected_quads);
+        free(line_storage);
+        free(vertices);
+        free(quads);
+        free(codepoints);
+        return failures;
+}
+
+
+// With no line storage, there's nowhere to put even an empty line
+static size_t test_no_lines(void)
+{
+    size_t failures = 0;
+
+    uint32_t codepoints[16];
+    bf3_quad quads[16];
+    bf3_vertex vertices[6 * 16];
+    const uint32_t insert[2] = {'a', '\n'};
+
+    bf3_lines lines;
+    bf3_lines_init(&lines, codepoints, quads, vertices, 16, NULL, 0);
+
+    if (bf3_lines_set_utf8(&lines, "a\nb", 3)) { failures++; }
+    if (bf3_lines_set_utf8(&lines, "", 0)) { failures++; }
+    if (bf3_lines_replace(&lines, 0, 0, insert, 2)) { failures++; }
+    if (bf3_lines_find(&lines, 0) != 0) { failures++; }
+    if (lines.num_lines || lines.num_codepoints || lines.num_quads) { failures++; }
+
+    printf("no line storage: %u failed\n", (unsigned int) failures);
+    return failures;
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t failures = test_no_lines();
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+            { failures += for_each_table(argv[i], test_table, NULL); }
+    }
+    else
+    {
+        failures += for_each_table(TEST_DEFAULT_FILE, test_table, NULL);
+    }
+
+    if (failures) { printf("FAIL (%u)\n", (unsigned int) failures); return 1; }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,350 @@
+// Test that utf8_decode_bulk, which decodes 16 bytes at a time with SIMD
+// where it can, follows exactly the same rules as utf8_decoder_next
+
+// COMPILE:
+//     gcc -std=c99 test/utf8.c lib/utf8.c -I. -Wall -Wextra -o test-utf8.bin
+//     gcc -std=c99 test/utf8.c lib/utf8.c -I. -Wall -Wextra -DUTF8_NO_SIMD -o test-utf8-scalar.bin
+// USAGE:
+//     ./test-utf8.bin
+//
+// Checks that:
+//
+//   * sequences that must be rejected (overlong aliases, surrogates, values
+//     above U+10FFFF, bytes that can never start a sequence, missing or bad
+//     continuation bytes, and sequences cut off at the end) are rejected at
+//     the byte where they start, wherever they are in a 16 byte block, and
+//     the smallest and largest sequences of each length are accepted
+//   * for every lead byte followed by any continuation byte (and a few
+//     others), starting at each offset around the end of a 16 byte block,
+//     the characters, their number and `consumed` are the same as
+//     utf8_decoder_next
+//   * so are they for seeded random text, mostly valid, with `max` large
+//     enough, exactly enough, and too small (where `consumed` is where the
+//     characters not decoded start)
+//
+// Returns 0 if every check passes.
+
+
+#include "lib/utf8.h"
+#include "bench/common.h" // test_random
+#include <string.h> // memcmp, memcpy, memset
+#include <stdio.h>
+
+#define BUFFER_SIZE 48  // bytes: three 16 byte blocks
+#define RANDOM_SIZE 600 // bytes, at most
+#define NUM_RANDOM  20000
+#define SEED        777
+
+
+typedef struct sequence sequence;
+
+struct sequence
+{
+    const char *bytes;
+    size_t len;
+    uint32_t value; // if valid
+};
+
+static const sequence invalid[] =
+{
+    {"\xC0\x80", 2, 0},             // overlong NUL
+    {"\xC1\xBF", 2, 0},             // overlong U+7F
+    {"\xE0\x80\x80", 3, 0},         // overlong NUL
+    {"\xE0\x9F\xBF", 3, 0},         // overlong U+7FF
+    {"\xF0\x80\x80\x80", 4, 0},     // overlong NUL
+    {"\xF0\x8F\xBF\xBF", 4, 0},     // overlong U+FFFF
+    {"\xED\xA0\x80", 3, 0},         // surrogate U+D800
+    {"\xED\xBF\xBF", 3, 0},         // surrogate U+DFFF
+    {"\xF4\x90\x80\x80", 4, 0},     // U+110000
+    {"\xF7\xBF\xBF\xBF", 4, 0},     // U+1FFFFF
+    {"\xF8\x88\x80\x80\x80", 5, 0}, // five bytes
+    {"\xFC\x84\x80\x80\x80\x80", 6, 0},
+    {"\xFE", 1, 0},
+    {"\xFF", 1, 0},
+    {"\x80", 1, 0},                 // continuation bytes on their own
+    {"\xBF", 1, 0},
+    {"\xC2\x41", 2, 0},             // not a continuation byte
+    {"\xC2\xC2\x80", 3, 0},
+    {"\xE2\x82\x41", 3, 0},
+    {"\xE2\x41\xAC", 3, 0},
+    {"\xF0\x9F\x98\x41", 4, 0},
+    {"\xF0\x9F\x41\x80", 4, 0},
+};
+#define NUM_INVALID (sizeof(invalid) / sizeof(invalid[0]))
+
+static const sequence valid[] =
+{
+    {"\x7F", 1, 0x7F},
+    {"\xC2\x80", 2, 0x80},
+    {"\xDF\xBF", 2, 0x7FF},
+    {"\xE0\xA0\x80", 3, 0x800},
+    {"\xED\x9F\xBF", 3, 0xD7FF},
+    {"\xEE\x80\x80", 3, 0xE000},
+    {"\xEF\xBF\xBF", 3, 0xFFFF},
+    {"\xF0\x90\x80\x80", 4, 0x10000},
+    {"\xF4\x8F\xBF\xBF", 4, 0x10FFFF},
+};
+#define NUM_VALID (sizeof(valid) / sizeof(valid[0]))
+
+
+// Decode `len` bytes with utf8_decoder_next. Returns the number of
+// characters, and the number of bytes before an error (or `len`).
+static size_t reference(const unsigned char *p, size_t len, uint32_t *out, size_t *consumed)
+{
+    utf8_decoder decoder;
+    utf8_decoder_init(&decoder, (const char *) p, (int) len);
+
+    size_t n = 0;
+    int c;
+    while ((c = utf8_decoder_next(&decoder)) >= 0) { out[n++] = (uint32_t) c; }
+
+    *consumed = (c == UTF8_ERROR) ? (size_t) utf8_decoder_at_byte(&decoder) : len;
+    return n;
+}
+
+
+// Compare utf8_decode_bulk with the reference for `len` bytes, with `max`
+// large enough, exactly enough, and one too few. Returns the number of
+// failed checks.
+static size_t compare(const unsigned char *p, size_t len)
+{
+    uint32_t expected[RANDOM_SIZE + 1], out[RANDOM_SIZE + 1];
+    size_t expected_consumed;
+    size_t count = reference(p, len, expected, &expected_consumed);
+
+    size_t maxes[3] = {RANDOM_SIZE + 1, count, count ? count - 1 : 0};
+
+    for (int m = 0; m < 3; m++)
+    {
+        size_t consumed = 0;
+        size_t n = utf8_decode_bulk((const char *) p, len, out, maxes[m], &consumed);
+
+        // stopping after `max` characters, at the start of the next one
+        size_t end = expected_consumed;
+        if (maxes[m] < count)
+        {
+            utf8_decoder decoder;
+            utf8_decoder_init(&decoder, (const char *) p, (int) len);
+            for (size_t i = 0; i <= maxes[m]; i++) { utf8_decoder_next(&decoder); }
+            end = (size_t) utf8_decoder_at_byte(&decoder); // where character `max` starts
+        }
+
+        size_t expected_n = (maxes[m] < count) ? maxes[m] : count;
+        if ((n != expected_n) || (consumed != end) || (0 != memcmp(out, expected, n * sizeof(uint32_t))))
+        {
+            fprintf(stderr, "  %u bytes, max %u: %u characters, %u bytes, expected %u, %u\n",
+                (unsigned int) len, (unsigned int) maxes[m], (unsigned int) n,
+                (unsigned int) consumed, (unsigned int) expected_n, (unsigned int) end);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Returns the number of failed checks
+static size_t test_sequences(void)
+{
+    size_t failures = 0;
+    unsigned char buffer[BUFFER_SIZE];
+    uint32_t out[BUFFER_SIZE];
+
+    for (size_t offset = 0; offset + 8 <= BUFFER_SIZE; offset++)
+    {
+        for (size_t i = 0; i < NUM_INVALID; i++)
+        {
+            const sequence *s = &invalid[i];
+            memset(buffer, 'a', BUFFER_SIZE);
+            memcpy(buffer + offset, s->bytes, s->len);
+
+            size_t consumed = 0;
+            size_t n = utf8_decode_bulk((const char *) buffer, BUFFER_SIZE, out, BUFFER_SIZE, &consumed);
+            if ((n != offset) || (consumed != offset))
+            {
+                fprintf(stderr, "  invalid sequence %u at %u: %u characters, %u bytes\n",
+                    (unsigned int) i, (unsigned int) offset, (unsigned int) n,
+                    (unsigned int) consumed);
+                failures++;
+            }
+            failures += compare(buffer, BUFFER_SIZE);
+        }
+
+        for (size_t i = 0; i < NUM_VALID; i++)
+        {
+            const sequence *s = &valid[i];
+            memset(buffer, 'a', BUFFER_SIZE);
+            memcpy(buffer + offset, s->bytes, s->len);
+
+            size_t consumed = 0;
+            size_t n = utf8_decode_bulk((const char *) buffer, BUFFER_SIZE, out, BUFFER_SIZE, &consumed);
+            if ((consumed != BUFFER_SIZE) || (n != BUFFER_SIZE - s->len + 1) || (out[offset] != s->value))
+            {
+                fprintf(stderr, "  valid sequence %u at %u: %u characters, %u bytes\n",
+                    (unsigned int) i, (unsigned int) offset, (unsigned int) n,
+                    (unsigned int) consumed);
+                failures++;
+            }
+        }
+    }
+
+    // every valid sequence longer than a byte, cut off at the end
+    for (size_t i = 0; i < NUM_VALID; i++)
+    {
+        const sequence *s = &valid[i];
+        for (size_t cut = 1; cut < s->len; cut++)
+        {
+            size_t len = BUFFER_SIZE - s->len + cut;
+            memset(buffer, 'a', BUFFER_SIZE);
+            memcpy(buffer + BUFFER_SIZE - s->len, s->bytes, cut);
+
+            size_t consumed = 0;
+            size_t n = utf8_decode_bulk((const char *) buffer, len, out, BUFFER_SIZE, &consumed);
+            if ((n != BUFFER_SIZE - s->len) || (consumed != BUFFER_SIZE - s->len))
+            {
+                fprintf(stderr, "  valid sequence %u cut to %u bytes: %u characters, %u bytes\n",
+                    (unsigned int) i, (unsigned int) cut, (unsigned int) n, (unsigned int) consumed);
+                failures++;
+            }
+            failures += compare(buffer, len);
+        }
+    }
+
+    printf("sequences: %u failed\n", (unsigned int) failures);
+    return failures;
+}
+
+
+// Every lead byte followed by every continuation byte (and a few others),
+// and then a few third bytes, starting on and around the end of the first 16
+// byte block. Returns the number of failed checks.
+static size_t test_block_end(void)
+{
+    static const unsigned char third[] = {0x00, 0x41, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xFF};
+    size_t failures = 0;
+    size_t checks = 0;
+    unsigned char buffer[BUFFER_SIZE];
+
+    for (size_t offset = 12; offset <= 16; offset++)
+    {
+        for (unsigned int x = 0x80; x <= 0xFF; x++)
+        {
+            for (unsigned int y = 0; y <= 0xFF; y++)
+            {
+                // any continuation byte, and a few that aren't
+                if (((y & 0xC0) != 0x80) && (y != 0x00) && (y != 0x41) && (y != 0x7F)
+                    && (y != 0xC0) && (y != 0xE0) && (y != 0xF0) && (y != 0xFF))
+                    { continue; }
+
+                for (size_t z = 0; z < sizeof(third); z++)
+                {
+                    memset(buffer, 'a', BUFFER_SIZE);
+                    buffer[offset] = (unsigned char) x;
+                    buffer[offset + 1] = (unsigned char) y;
+                    buffer[offset + 2] = third[z];
+                    buffer[offset + 3] = 0x80 | (unsigned char) (y & 0x3F);
+
+                    failures += compare(buffer, BUFFER_SIZE);
+                    checks++;
+                    if (failures >= 10) { goto done; }
+                }
+            }
+        }
+    }
+
+    done:
+        printf("block end: %u checks, %u failed\n", (unsigned int) checks, (unsigned int) failures);
+        return failures;
+}
+
+
+// Append `c` as UTF-8. Returns the number of bytes.
+static size_t encode(unsigned char *dest, uint32_t c)
+{
+    if (c < 0x80) { dest[0] = (unsigned char) c; return 1; }
+    if (c < 0x800)
+    {
+        dest[0] = (unsigned char) (0xC0 | (c >> 6));
+        dest[1] = (unsigned char) (0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000)
+    {
+        dest[0] = (unsigned char) (0xE0 | (c >> 12));
+        dest[1] = (unsigned char) (0x80 | ((c >> 6) & 0x3F));
+        dest[2] = (unsigned char) (0x80 | (c & 0x3F));
+        return 3;
+    }
+    dest[0] = (unsigned char) (0xF0 | (c >> 18));
+    dest[1] = (unsigned char) (0x80 | ((c >> 12) & 0x3F));
+    dest[2] = (unsigned char) (0x80 | ((c >> 6) & 0x3F));
+    dest[3] = (unsigned char) (0x80 | (c & 0x3F));
+    return 4;
+}
+
+
+// Seeded random text: runs of ASCII, or mostly characters of one length,
+// with now and then a random byte or invalid sequence, and sometimes cut
+// off at the end. Returns the number of failed checks.
+static size_t test_random_text(void)
+{
+    size_t failures = 0;
+    uint32_t seed = SEED;
+    unsigned char buffer[RANDOM_SIZE + 8];
+
+    for (int i = 0; i < NUM_RANDOM; i++)
+    {
+        size_t target = test_random(&seed) % RANDOM_SIZE;
+        uint32_t kind = test_random(&seed) % 5; // mostly 1, 2, 3 or 4 bytes
+        size_t len = 0;
+
+        while (len < target)
+        {
+            uint32_t r = test_random(&seed) % 1000;
+            uint32_t c = test_random(&seed);
+
+            if (r < 2)
+                { buffer[len++] = (unsigned char) c; continue; }
+            else if (r < 3)
+            {
+                const sequence *s = &invalid[c % NUM_INVALID];
+                memcpy(buffer + len, s->bytes, s->len);
+                len += s->len;
+                continue;
+            }
+
+            uint32_t length = ((r % 10) < 4) ? kind : (r % 5);
+            if (length <= 1)      { c = c % 0x80; }
+            else if (length == 2) { c = 0x80 + (c % 0x780); }
+            else if (length == 3) { c = 0x800 + (c % 0xF800); if ((c >= 0xD800) && (c < 0xE000)) { c = 0xFFFD; } }
+            else                  { c = 0x10000 + (c % 0x100000); }
+
+            len += encode(buffer + len, c);
+        }
+
+        if (((test_random(&seed) % 20) == 0) && len) { len -= 1 + (len > 1); }
+
+        failures += compare(buffer, len);
+        if (failures >= 10) { break; }
+    }
+
+    printf("random: %u texts, %u failed\n", (unsigned int) NUM_RANDOM, (unsigned int) failures);
+    return failures;
+}
+
+
+int main(void)
+{
+#ifdef UTF8_NO_SIMD
+    printf("without SIMD\n");
+#endif
+
+    size_t failures = 0;
+    failures += test_sequences();
+    failures += test_block_end();
+    failures += test_random_text();
+
+    if (failures) { printf("FAIL (%u)\n", (unsigned int) failures); return 1; }
+    printf("OK\n");
+    return 0;
+}
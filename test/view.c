@@ -0,0 +1,324 @@
+// Test that bf3_layout_view, laying out only the lines in view, gives the
+// same quads as laying out the whole document and culling the ones outside
+// the clip rectangle
+
+// COMPILE:
+//     gcc -std=c99 test/view.c bakefont3.c -I. -lm -Wall -Wextra -o test-view.bin
+// USAGE:
+//     ./test-view.bin [data.bf3 ...]
+//     (default: example/test.bf3, with the texts in bench/corpus)
+//
+// For every table, makes a document from the bench corpus, in a seeded
+// random order, with some lines much wider than the screen and some invalid
+// or cut off UTF-8 (including just before a '\n'), and indexes it a random
+// number of bytes at a time with bf3_line_index_update. Then, for document
+// origins above, below, left and right of the screen, checks that:
+//
+//   * random views, and views whose clip rectangle starts or ends on or
+//     next to the top of a line (so glyphs reaching into the line above or
+//     below count), give exactly the quads of bf3_layout_utf8 for the whole
+//     document that are inside the clip rectangle
+//   * with fewer quads than that, the first `max_quads` of them
+//   * the same again with lines half as tall, so that glyphs overlap the
+//     lines above and below
+//   * there is one line per '\n', plus one, and bf3_line_index_find agrees
+//
+// Returns 0 if every check passes.
+
+
+#include "bakefont3.h"
+#include "bench/common.h" // read_file, for_each_table, test_random
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy
+#include <stdio.h>
+
+#ifndef TEST_DEFAULT_FILE
+#   define TEST_DEFAULT_FILE "example/test.bf3"
+#endif
+#ifndef TEST_CORPUS_DIR
+#   define TEST_CORPUS_DIR "bench/corpus"
+#endif
+
+#define DOCUMENT_SIZE (128 * 1024) // bytes, at least
+#define LONG_LINE     3000         // bytes
+#define MAX_LINES     (64 * 1024)
+#define NUM_VIEWS     60           // for each document origin
+#define SEED          2024
+
+static const char *corpora[] =
+    {"english.txt", "german.txt", "greek.txt", "cyrillic.txt", "cjk.txt", "code.txt"};
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+// characters for the long lines: kerning pairs, mostly
+static const char long_line_chars[] = "AVWTo.y ";
+
+
+typedef struct document document;
+
+struct document
+{
+    char *utf8;
+    size_t len;
+};
+
+
+// Append `len` bytes to a document with room for them
+static void append(document *doc, const char *src, size_t len)
+{
+    memcpy(doc->utf8 + doc->len, src, len);
+    doc->len += len;
+}
+
+// Returns false if a corpus file can't be read
+static bool make_document(document *doc, uint32_t *seed)
+{
+    char *texts[NUM_CORPORA] = {0};
+    size_t lens[NUM_CORPORA];
+    size_t longest = 0;
+    bool ok = false;
+
+    for (size_t i = 0; i < NUM_CORPORA; i++)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", TEST_CORPUS_DIR, corpora[i]);
+        texts[i] = read_file(path, &lens[i]);
+        if (!texts[i]) { fprintf(stderr, "Could not open %s\n", path); goto done; }
+        if (lens[i] > longest) { longest = lens[i]; }
+    }
+
+    doc->len = 0;
+    doc->utf8 = malloc(DOCUMENT_SIZE + longest + LONG_LINE + 16);
+    if (!doc->utf8) { fprintf(stderr, "Malloc error (document)\n"); goto done; }
+
+    while (doc->len < DOCUMENT_SIZE)
+    {
+        size_t i = test_random(seed) % NUM_CORPORA;
+        append(doc, texts[i], lens[i]);
+
+        uint32_t r = test_random(seed) % 4;
+        if (r == 0)
+        {
+            for (int j = 0; j < LONG_LINE; j++)
+                { doc->utf8[doc->len++] = long_line_chars[test_random(seed) % (sizeof(long_line_chars) - 1)]; }
+            append(doc, "\n", 1);
+        }
+        else if (r == 1)
+        {
+            // a lead byte with no continuation, and a sequence cut off by a '\n'
+            append(doc, "\xC3" "a\xE2\x82\n\xFF\n", 7);
+        }
+    }
+
+    ok = true;
+
+    done:
+        for (size_t i = 0; i < NUM_CORPORA; i++) { free(texts[i]); }
+        return ok;
+}
+
+
+typedef struct tests tests;
+
+struct tests
+{
+    document doc;
+    size_t *offsets;
+    bf3_quad *all;      // the whole document
+    bf3_quad *expected; // the whole document, culled
+    bf3_quad *quads;    // from bf3_layout_view
+};
+
+
+// The top of line `line` of a document at `y`, in pixels on screen
+static int32_t line_top(const bf3_mode *mode, int32_t y, uint32_t line)
+{
+    return y + (int32_t) (((int64_t) mode->lineheight * line) / 64);
+}
+
+
+// Returns the number of failed checks
+static size_t check_view(tests *t, bf3_layout *layout, const bf3_line_index *index,
+    const bf3_view *view, size_t num_all, size_t max_quads)
+{
+    const bf3_quad *all = t->all;
+    size_t expected = 0;
+
+    if ((view->clip_left < view->clip_right) && (view->clip_top < view->clip_bottom))
+    {
+        for (size_t i = 0; (i < num_all) && (expected < max_quads); i++)
+        {
+            const bf3_quad *q = &all[i];
+            if ((q->x >= view->clip_right) || (q->x + q->tex_w <= view->clip_left)
+                || (q->y >= view->clip_bottom) || (q->y + q->tex_h <= view->clip_top))
+                { continue; }
+            t->expected[expected++] = *q;
+        }
+    }
+
+    size_t count = bf3_layout_view(layout, index, t->doc.utf8, t->doc.len, view,
+        t->quads, max_quads);
+
+    if ((count == expected) && (0 == memcmp(t->quads, t->expected, count * sizeof(bf3_quad))))
+        { return 0; }
+
+    fprintf(stderr, "  view at (%d, %d), clip (%d, %d) to (%d, %d), max_quads %u: "
+        "%u quads, expected %u\n", (int) view->x, (int) view->y,
+        (int) view->clip_left, (int) view->clip_top, (int) view->clip_right,
+        (int) view->clip_bottom, (unsigned int) max_quads, (unsigned int) count,
+        (unsigned int) expected);
+    return 1;
+}
+
+
+// Returns the number of failed checks
+static size_t test_mode(tests *t, const bf3_mode *mode, const char *metrics, const char *kerning)
+{
+    const document *doc = &t->doc;
+    size_t failures = 0;
+    size_t checks = 0;
+    uint32_t seed = SEED;
+
+    // index the document as if it were being appended to
+    bf3_line_index index;
+    bf3_line_index_init(&index, mode, t->offsets, MAX_LINES);
+    for (size_t indexed = 0; indexed < doc->len; )
+    {
+        indexed += test_random(&seed) % 10000;
+        if (indexed > doc->len) { indexed = doc->len; }
+        if (!bf3_line_index_update(&index, doc->utf8, indexed))
+            { fprintf(stderr, "  more than %u lines\n", (unsigned int) MAX_LINES); return 1; }
+    }
+
+    size_t num_lines = 1;
+    for (size_t i = 0; i < doc->len; i++) { num_lines += (doc->utf8[i] == '\n'); }
+    if (num_lines != index.num_lines)
+    {
+        fprintf(stderr, "  %u lines, expected %u\n", (unsigned int) index.num_lines,
+            (unsigned int) num_lines);
+        return 1;
+    }
+
+    if ((mode->lineheight <= 0) || (bf3_line_index_find(&index, -1) != 0)
+        || (bf3_line_index_find(&index, INT32_MAX) != num_lines - 1))
+        { fprintf(stderr, "  bf3_line_index_find is wrong\n"); failures++; }
+
+    // document origins: on screen, scrolled halfway down, left of the
+    // screen, and right of the screen (so there's nothing to see)
+    int32_t height = (int32_t) (bf3_line_index_height(&index) / 64);
+    const int32_t origins[][2] =
+        {{0, 0}, {13, -(height / 2)}, {-250, -(height / 3) - 7}, {700, 20}};
+    const size_t num_origins = sizeof(origins) / sizeof(origins[0]);
+
+    for (size_t o = 0; o < num_origins; o++)
+    {
+        // the reference: the whole document from the top left
+        bf3_layout layout;
+        bf3_layout_init(&layout, mode, metrics, kerning, origins[o][0], origins[o][1]);
+        layout.pen_y += mode->lineheight;
+        size_t num_all = bf3_layout_utf8(&layout, t->all, doc->len, doc->utf8, doc->len, NULL);
+
+        for (int v = 0; v < NUM_VIEWS; v++)
+        {
+            bf3_view view;
+            view.x = origins[o][0];
+            view.y = origins[o][1];
+            view.clip_left = (int32_t) (test_random(&seed) % 400) - 50;
+            view.clip_right = view.clip_left + (int32_t) (test_random(&seed) % 800);
+            view.clip_top = (int32_t) (test_random(&seed) % 600) - 100;
+            view.clip_bottom = view.clip_top + (int32_t) (test_random(&seed) % 700);
+
+            if (v == 0)
+            {
+                view.clip_left = 0; view.clip_top = 0;
+                view.clip_right = 640; view.clip_bottom = 480;
+            }
+            else if ((v % 3) == 1)
+            {
+                // one row of pixels, on or next to the top of a line
+                int32_t top = line_top(mode, view.y, test_random(&seed) % 20)
+                    + (int32_t) (test_random(&seed) % 3) - 1;
+                view.clip_top = top;
+                view.clip_bottom = top + 1;
+            }
+            else if ((v % 3) == 2)
+            {
+                // from the top of a line to the top of a later one
+                uint32_t line = test_random(&seed) % 20;
+                view.clip_top = line_top(mode, view.y, line);
+                view.clip_bottom = line_top(mode, view.y, line + (test_random(&seed) % 5));
+            }
+
+            bf3_layout_init(&layout, mode, metrics, kerning, 0, 0);
+            failures += check_view(t, &layout, &index, &view, num_all, doc->len);
+            checks++;
+
+            // cut short
+            size_t max_quads = test_random(&seed) % 100;
+            failures += check_view(t, &layout, &index, &view, num_all, max_quads);
+            checks++;
+
+            if (failures >= 10) { goto done; }
+        }
+    }
+
+    done:
+        printf("  %u bytes, %u lines, %u views, %u failed\n", (unsigned int) doc->len,
+            (unsigned int) index.num_lines, (unsigned int) checks, (unsigned int) failures);
+        return failures;
+}
+
+
+// Returns the number of failed checks
+static size_t test_table(const bf3_info *info, const bf3_mode *mode,
+    const char *metrics, const char *kerning, void *arg)
+{
+    (void) info;
+    size_t failures = test_mode(arg, mode, metrics, kerning);
+
+    // Again with lines half as tall, so that glyphs reach into the lines
+    // above and below theirs
+    bf3_mode squashed = *mode;
+    squashed.lineheight /= 2;
+    failures += test_mode(arg, &squashed, metrics, kerning);
+
+    return failures;
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t failures = 0;
+    tests t = {{0}, NULL, NULL, NULL, NULL};
+    uint32_t seed = SEED;
+
+    if (!make_document(&t.doc, &seed)) { failures++; goto done; }
+
+    // at most one quad per byte
+    t.offsets = malloc(MAX_LINES * sizeof(size_t));
+    t.all = malloc(t.doc.len * sizeof(bf3_quad));
+    t.expected = malloc(t.doc.len * sizeof(bf3_quad));
+    t.quads = malloc(t.doc.len * sizeof(bf3_quad));
+    if (!t.offsets || !t.all || !t.expected || !t.quads)
+        { fprintf(stderr, "Malloc error\n"); failures++; goto done; }
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+            { failures += for_each_table(argv[i], test_table, &t); }
+    }
+    else
+    {
+        failures += for_each_table(TEST_DEFAULT_FILE, test_table, &t);
+    }
+
+    done:
+        free(t.quads);
+        free(t.expected);
+        free(t.all);
+        free(t.offsets);
+        free(t.doc.utf8);
+
+    if (failures) { printf("FAIL (%u)\n", (unsigned int) failures); return 1; }
+    printf("OK\n");
+    return 0;
+}